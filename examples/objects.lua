@@ -0,0 +1,54 @@
+#!/usr/bin/env lua
+-- MoonODE example: objects.lua
+-- Benchmarks the bookkeeping of MoonODE objects: creates and destroys a large
+-- number of geoms, and measures the throughput of handle-to-object lookups.
+--
+-- Usage: lua objects.lua [numgeoms] [numpasses]
+local ode = require("moonode")
+local now, since = ode.now, ode.since
+local function printf(...) io.write(string.format(...)) end
+
+local N = tonumber(arg[1]) or 1000000 -- number of geoms
+local PASSES = tonumber(arg[2]) or 5  -- number of lookup passes
+
+local space = ode.create_simple_space()
+local geoms = {}
+
+-- Creation
+local t = now()
+for i = 1, N do geoms[i] = ode.create_sphere(space, 1.0) end
+local elapsed = since(t)
+printf("created %d geoms in %.3f s (%.0f geoms/s)\n", N, elapsed, N/elapsed)
+
+-- Lookup: space:get_geom() resolves the ODE handle to its MoonODE object
+-- and pushes the corresponding userdata (geoms are visited sequentially,
+-- so ODE's own cost is O(1) per call and the lookup dominates).
+local get_geom = space.get_geom
+t = now()
+for pass = 1, PASSES do
+   for i = 1, N do
+      local geom = get_geom(space, i)
+   end
+end
+elapsed = since(t)
+printf("%d lookups in %.3f s (%.0f lookups/s)\n", N*PASSES, elapsed, N*PASSES/elapsed)
+
+-- Destruction (in creation order, then the space)
+t = now()
+for i = 1, N do geoms[i]:destroy() end
+elapsed = since(t)
+printf("destroyed %d geoms in %.3f s (%.0f geoms/s)\n", N, elapsed, N/elapsed)
+space:destroy()
+
+-- Churn: interleaved creations and destructions, as with short-lived objects
+t = now()
+local batch = {}
+for i = 1, N do
+   local k = (i-1) % 1000 + 1
+   if batch[k] then batch[k]:destroy() end
+   batch[k] = ode.create_sphere(nil, 1.0)
+end
+for _, geom in pairs(batch) do geom:destroy() end
+elapsed = since(t)
+printf("created and destroyed %d geoms in %.3f s (%.0f geoms/s)\n", N, elapsed, N/elapsed)
+
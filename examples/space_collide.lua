@@ -104,6 +104,8 @@ elseif arg[1] == '-quadtree' then
    space = ode.create_quadtree_space(nil, {0, 0, 0}, {10, 0, 10}, 7)
 elseif arg[1] == '-sap' then
    space = ode.create_sap_space(nil, 'xzy')
+elseif arg[1] == '-split' then
+   space = ode.create_split_space()
 else
    error("invalid option '"..arg[1].."'")
 end
@@ -505,9 +505,76 @@ static const struct luaL_Reg MetaMethods[] =
         { NULL, NULL } /* sentinel */
     };
 
+/*------------------------------------------------------------------------------*
+ | Bulk state transfer                                                          |
+ *------------------------------------------------------------------------------*/
+
+#define STATE_SIZE 13 /* position (3), quaternion (4), linear vel (3), angular vel (3) */
+
+static int GetStates(lua_State *L)
+/* nextoffset = get_body_states({body}, buffer, [offset]) */
+    {
+    int i, n;
+    body_t body;
+    double *dst;
+    const dReal *p, *q, *v, *w;
+    buffer_t buffer = checkbuffer(L, 2, NULL);
+    size_t offset = checkoffset(L, 3);
+    if(!lua_istable(L, 1)) return argerror(L, 1, ERR_TABLE);
+    n = luaL_len(L, 1);
+    dst = (double*)bufferreserve(L, buffer, offset, n*STATE_SIZE*sizeof(double));
+    for(i = 0; i < n; i++)
+        {
+        lua_rawgeti(L, 1, i+1);
+        body = checkbody(L, -1, NULL);
+        lua_pop(L, 1);
+        p = dBodyGetPosition(body);
+        q = dBodyGetQuaternion(body);
+        v = dBodyGetLinearVel(body);
+        w = dBodyGetAngularVel(body);
+        dst[0] = p[0]; dst[1] = p[1]; dst[2] = p[2];
+        dst[3] = q[0]; dst[4] = q[1]; dst[5] = q[2]; dst[6] = q[3];
+        dst[7] = v[0]; dst[8] = v[1]; dst[9] = v[2];
+        dst[10] = w[0]; dst[11] = w[1]; dst[12] = w[2];
+        dst += STATE_SIZE;
+        }
+    lua_pushinteger(L, offset + n*STATE_SIZE*sizeof(double));
+    return 1;
+    }
+
+static int SetStates(lua_State *L)
+/* nextoffset = set_body_states({body}, buffer, [offset]) */
+    {
+    int i, n;
+    body_t body;
+    const double *src;
+    quat_t q;
+    buffer_t buffer = checkbuffer(L, 2, NULL);
+    size_t offset = checkoffset(L, 3);
+    if(!lua_istable(L, 1)) return argerror(L, 1, ERR_TABLE);
+    n = luaL_len(L, 1);
+    src = (const double*)bufferptr(L, buffer, offset, n*STATE_SIZE*sizeof(double), 2);
+    for(i = 0; i < n; i++)
+        {
+        lua_rawgeti(L, 1, i+1);
+        body = checkbody(L, -1, NULL);
+        lua_pop(L, 1);
+        q[0] = src[3]; q[1] = src[4]; q[2] = src[5]; q[3] = src[6];
+        dBodySetPosition(body, src[0], src[1], src[2]);
+        dBodySetQuaternion(body, q);
+        dBodySetLinearVel(body, src[7], src[8], src[9]);
+        dBodySetAngularVel(body, src[10], src[11], src[12]);
+        src += STATE_SIZE;
+        }
+    lua_pushinteger(L, offset + n*STATE_SIZE*sizeof(double));
+    return 1;
+    }
+
 static const struct luaL_Reg Functions[] = 
     {
         { "create_body", Create },
+        { "get_body_states", GetStates },
+        { "set_body_states", SetStates },
         { NULL, NULL } /* sentinel */
     };
 
@@ -0,0 +1,314 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* A buffer is a resizable and mutable area of memory, that can be used to exchange
+ * bulk binary data with MoonODE without passing through Lua strings.
+ * Objects that use the buffer memory in place (e.g. a tmdata created from a buffer)
+ * pin the buffer and keep a reference to it, so that it can not be resized nor
+ * explicitly destroyed while they are alive.
+ * When the state is closed, objects are collected in no particular order, so the
+ * buffer object may go before the objects pinning it: in this case the memory is
+ * released by the last bufferunpin().
+ */
+
+static void Release(lua_State *L, buffer_t buffer)
+    {
+    if(buffer->data) Free(L, buffer->data);
+    Free(L, buffer);
+    }
+
+static int freebuffer(lua_State *L, ud_t *ud)
+    {
+    buffer_t buffer = (buffer_t)ud->handle;
+    if(!freeuserdata(L, ud, "buffer")) return 0;
+    if(buffer->pins > 0)
+        buffer->orphan = 1; /* still in use */
+    else
+        Release(L, buffer);
+    return 0;
+    }
+
+static int newbuffer(lua_State *L, buffer_t buffer)
+    {
+    ud_t *ud;
+    ud = newuserdata(L, buffer, BUFFER_MT, "buffer");
+    ud->parent_ud = NULL;
+    ud->destructor = freebuffer;
+    return 1;
+    }
+
+static void Resize(lua_State *L, buffer_t buffer, size_t size)
+    {
+    char *data = NULL;
+    if(size == buffer->size) return;
+    if(buffer->pins > 0)
+        { failure(L, ERR_OPERATION); return; }
+    if(size > 0)
+        {
+        data = (char*)Malloc(L, size);
+        if(buffer->size < size)
+            {
+            if(buffer->size > 0) memcpy(data, buffer->data, buffer->size);
+            memset(data + buffer->size, 0, size - buffer->size);
+            }
+        else
+            memcpy(data, buffer->data, size);
+        }
+    if(buffer->data) Free(L, buffer->data);
+    buffer->data = data;
+    buffer->size = size;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Internal API                                                                 |
+ *------------------------------------------------------------------------------*/
+
+void *bufferptr(lua_State *L, buffer_t buffer, size_t offset, size_t len, int arg)
+/* Returns a pointer to the len bytes at the given offset, raising an error on the
+ * argument arg if they are not all in the buffer */
+    {
+    if(offset > buffer->size || len > buffer->size - offset)
+        { argerror(L, arg, ERR_BOUNDARIES); return NULL; }
+    return buffer->data + offset;
+    }
+
+void *bufferreserve(lua_State *L, buffer_t buffer, size_t offset, size_t len)
+/* Same as bufferptr(), but grows the buffer if needed (this fails if pinned) */
+    {
+    if(len > (size_t)-1 - offset) /* offset + len would overflow */
+        { failure(L, ERR_LENGTH); return NULL; }
+    if(offset + len > buffer->size)
+        Resize(L, buffer, offset + len);
+    return buffer->data + offset;
+    }
+
+void bufferpin(buffer_t buffer)
+    { buffer->pins++; }
+
+void bufferunpin(lua_State *L, buffer_t buffer)
+    {
+    if(--buffer->pins == 0 && buffer->orphan)
+        Release(L, buffer); /* the buffer object was already collected */
+    }
+
+size_t checkoffset(lua_State *L, int arg)
+    {
+    lua_Integer offset = luaL_optinteger(L, arg, 0);
+    if(offset < 0) argerror(L, arg, ERR_VALUE);
+    return (size_t)offset;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Methods                                                                      |
+ *------------------------------------------------------------------------------*/
+
+static int Create(lua_State *L)
+    {
+    size_t len;
+    const char *s;
+    lua_Integer size;
+    buffer_t buffer = (buffer_t)Malloc(L, sizeof(struct moonode_buffer_s));
+    memset(buffer, 0, sizeof(struct moonode_buffer_s));
+    if(lua_type(L, 1) == LUA_TSTRING)
+        {
+        s = lua_tolstring(L, 1, &len);
+        if(len > 0)
+            {
+            buffer->data = (char*)MallocNoErr(L, len);
+            if(!buffer->data) { Free(L, buffer); return errmemory(L); }
+            memcpy(buffer->data, s, len);
+            buffer->size = len;
+            }
+        }
+    else
+        {
+        size = luaL_optinteger(L, 1, 0);
+        if(size < 0) { Free(L, buffer); return argerror(L, 1, ERR_VALUE); }
+        if(size > 0)
+            {
+            buffer->data = (char*)MallocNoErr(L, size);
+            if(!buffer->data) { Free(L, buffer); return errmemory(L); }
+            memset(buffer->data, 0, size);
+            buffer->size = size;
+            }
+        }
+    return newbuffer(L, buffer);
+    }
+
+static int Size(lua_State *L)
+    {
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    lua_pushinteger(L, buffer->size);
+    return 1;
+    }
+
+static int SetSize(lua_State *L)
+    {
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    lua_Integer size = luaL_checkinteger(L, 2);
+    if(size < 0) return argerror(L, 2, ERR_VALUE);
+    Resize(L, buffer, size);
+    return 0;
+    }
+
+static int IsPinned(lua_State *L)
+    {
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    lua_pushboolean(L, buffer->pins > 0);
+    return 1;
+    }
+
+static int Read(lua_State *L)
+    {
+    char *ptr;
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    size_t offset = checkoffset(L, 2);
+    size_t len = offset < buffer->size ? buffer->size - offset : 0;
+    if(!lua_isnoneornil(L, 3))
+        len = luaL_checkinteger(L, 3);
+    ptr = bufferptr(L, buffer, offset, len, 3);
+    lua_pushlstring(L, len > 0 ? ptr : "", len);
+    return 1;
+    }
+
+static int Write(lua_State *L)
+    {
+    size_t len;
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    size_t offset = checkoffset(L, 2);
+    const char *s = luaL_checklstring(L, 3, &len);
+    if(len > 0)
+        memcpy(bufferreserve(L, buffer, offset, len), s, len);
+    lua_pushinteger(L, offset + len);
+    return 1;
+    }
+
+static int Pack(lua_State *L)
+    {
+    int err;
+    void *dst;
+    size_t count;
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    size_t offset = checkoffset(L, 2);
+    int type = checkdatatype(L, 3);
+    size_t size = sizeoftype(type);
+    int last = lua_gettop(L);
+    size_t oldsize = buffer->size;
+    size_t n = countdata(L, 4, last, 0);
+    if(n == 0)
+        { lua_pushinteger(L, offset); return 1; }
+    dst = bufferreserve(L, buffer, offset, n * size);
+    err = packdata(L, type, 4, last, dst, n, &count);
+    if(err == ERR_LENGTH) /* the guess was wrong: count and retry */
+        {
+        n = countdata(L, 4, last, 1);
+        dst = bufferreserve(L, buffer, offset, n * size);
+        err = packdata(L, type, 4, last, dst, n, &count);
+        }
+    if(err) return argerror(L, 4, err);
+    /* do not keep what was reserved in excess for a wrong guess */
+    if(buffer->size > oldsize && buffer->size > offset + count * size)
+        Resize(L, buffer, oldsize > offset + count * size ? oldsize : offset + count * size);
+    lua_pushinteger(L, offset + count * size);
+    return 1;
+    }
+
+static int Unpack(lua_State *L)
+    {
+    size_t len;
+    lua_Integer count;
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    size_t offset = checkoffset(L, 2);
+    int type = checkdatatype(L, 3);
+    size_t size = sizeoftype(type);
+    if(lua_isnoneornil(L, 4))
+        len = offset < buffer->size ? (buffer->size - offset) / size * size : 0;
+    else
+        {
+        count = luaL_checkinteger(L, 4);
+        if(offset > buffer->size) return argerror(L, 2, ERR_BOUNDARIES);
+        if(count < 0 || (lua_Unsigned)count > (buffer->size - offset) / size)
+            return argerror(L, 4, ERR_BOUNDARIES);
+        len = (size_t)count * size;
+        }
+    if(len == 0)
+        { lua_newtable(L); return 1; }
+    return pushdata(L, type, bufferptr(L, buffer, offset, len, 4), len);
+    }
+
+static int Destroy(lua_State *L)
+    {
+    ud_t *ud;
+    buffer_t buffer = testbuffer(L, 1, &ud);
+    if(!buffer) return 0; /* already deleted */
+    if(buffer->pins > 0) return failure(L, ERR_OPERATION);
+    return ud->destructor(L, ud);
+    }
+
+static int Collect(lua_State *L)
+/* __gc: not referenced anymore, so no longer pinned, unless the state is being closed */
+    {
+    ud_t *ud;
+    (void)testbuffer(L, 1, &ud);
+    if(!ud) return 0; /* already deleted */
+    return ud->destructor(L, ud);
+    }
+
+RAW_FUNC(buffer)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "size", Size },
+        { "resize", SetSize },
+        { "is_pinned", IsPinned },
+        { "read", Read },
+        { "write", Write },
+        { "pack", Pack },
+        { "unpack", Unpack },
+        { "destroy", Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Collect },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_buffer", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_buffer(lua_State *L)
+    {
+    udata_define(L, BUFFER_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,326 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <float.h>
+#include "internal.h"
+
+/* Static bounding volume hierarchy over the AABBs of a set of geoms.
+ *
+ * The tree is built once (median split along the longest axis of the centroids' bounds)
+ * and then only queried. It is used where a never-moving set of geoms needs to be tested
+ * many times against other volumes (e.g. the static geoms of a split space).
+ */
+
+#define LEAF_SIZE 4
+
+typedef struct {
+    double aabb[6];
+    int first;  /* leaf: index of first item, inner: index of first child */
+    int count;  /* leaf: number of items, inner: 0 */
+} node_t;
+
+struct moonode_bvh_s {
+    bvh_item_t *items;
+    int count;
+    node_t *nodes;
+    int nodecount;
+};
+
+static void Union(double dst[6], const double aabb[6])
+    {
+    if(aabb[0] < dst[0]) dst[0] = aabb[0];
+    if(aabb[1] > dst[1]) dst[1] = aabb[1];
+    if(aabb[2] < dst[2]) dst[2] = aabb[2];
+    if(aabb[3] > dst[3]) dst[3] = aabb[3];
+    if(aabb[4] < dst[4]) dst[4] = aabb[4];
+    if(aabb[5] > dst[5]) dst[5] = aabb[5];
+    }
+
+static void Bounds(const bvh_item_t *items, int first, int count, double aabb[6])
+    {
+    int i;
+    memcpy(aabb, items[first].aabb, 6*sizeof(double));
+    for(i = first+1; i < first+count; i++)
+        Union(aabb, items[i].aabb);
+    }
+
+#define Centroid(item, axis) ((item)->aabb[2*(axis)] + (item)->aabb[2*(axis)+1])
+
+static void Select(bvh_item_t *items, int first, int last, int k, int axis)
+/* Partially sorts items[first..last] by centroid, so that items[k] is in its
+ * final position (quickselect, Hoare partition). */
+    {
+    int i, j;
+    double pivot;
+    bvh_item_t tmp;
+    while(first < last)
+        {
+        pivot = Centroid(&items[(first+last)/2], axis);
+        i = first; j = last;
+        while(i <= j)
+            {
+            while(Centroid(&items[i], axis) < pivot) i++;
+            while(Centroid(&items[j], axis) > pivot) j--;
+            if(i <= j)
+                { tmp = items[i]; items[i] = items[j]; items[j] = tmp; i++; j--; }
+            }
+        if(k <= j) last = j;
+        else if(k >= i) first = i;
+        else return;
+        }
+    }
+
+static void Build(bvh_t *bvh, int index, int first, int count)
+    {
+    int i, axis, mid, child;
+    double c, cmin[3], cmax[3], ext, maxext;
+    node_t *node = &bvh->nodes[index];
+    Bounds(bvh->items, first, count, node->aabb);
+    if(count <= LEAF_SIZE)
+        { node->first = first; node->count = count; return; }
+    /* split along the longest axis of the centroids' bounds */
+    for(axis = 0; axis < 3; axis++)
+        { cmin[axis] = DBL_MAX; cmax[axis] = -DBL_MAX; }
+    for(i = first; i < first+count; i++)
+        {
+        for(axis = 0; axis < 3; axis++)
+            {
+            c = Centroid(&bvh->items[i], axis);
+            if(c < cmin[axis]) cmin[axis] = c;
+            if(c > cmax[axis]) cmax[axis] = c;
+            }
+        }
+    axis = 0; maxext = -1;
+    for(i = 0; i < 3; i++)
+        {
+        ext = cmax[i] - cmin[i];
+        if(ext > maxext) { maxext = ext; axis = i; }
+        }
+    mid = first + count/2;
+    Select(bvh->items, first, first+count-1, mid, axis);
+    child = bvh->nodecount;
+    bvh->nodecount += 2;
+    node->first = child;
+    node->count = 0;
+    Build(bvh, child, first, mid-first);
+    Build(bvh, child+1, mid, first+count-mid);
+    }
+
+bvh_t *bvh_build(lua_State *L, const bvh_item_t *items, int count)
+/* Builds a tree over a copy of the given items (count may be 0).
+ * Returns NULL on failure, without raising errors, so that the caller can release
+ * the items first. */
+    {
+    bvh_t *bvh = (bvh_t*)MallocNoErr(L, sizeof(bvh_t));
+    if(!bvh) return NULL;
+    bvh->count = count;
+    if(count == 0) return bvh;
+    bvh->items = (bvh_item_t*)MallocNoErr(L, count*sizeof(bvh_item_t));
+    bvh->nodes = (node_t*)MallocNoErr(L, 2*count*sizeof(node_t)); /* a binary tree has < 2n nodes */
+    if(!bvh->items || !bvh->nodes)
+        { bvh_free(L, bvh); return NULL; }
+    memcpy(bvh->items, items, count*sizeof(bvh_item_t));
+    bvh->nodecount = 1;
+    Build(bvh, 0, 0, count);
+    return bvh;
+    }
+
+void bvh_free(lua_State *L, bvh_t *bvh)
+    {
+    if(!bvh) return;
+    Free(L, bvh->items);
+    Free(L, bvh->nodes);
+    Free(L, bvh);
+    }
+
+int bvh_count(bvh_t *bvh)
+    { return bvh ? bvh->count : 0; }
+
+#define Overlap(a, b) (!((a)[0] > (b)[1] || (a)[1] < (b)[0] || \
+                         (a)[2] > (b)[3] || (a)[3] < (b)[2] || \
+                         (a)[4] > (b)[5] || (a)[5] < (b)[4]))
+
+#define STACK_SIZE 64 /* enough for a balanced tree of 2^62 leaves */
+
+int bvh_query_box(bvh_t *bvh, const double box[6], bvh_func_t func, void *data)
+/* Calls func for every item whose AABB overlaps box.
+ * func must return 0 to continue the query, !=0 to stop it.
+ * Returns 1 if stopped, 0 otherwise.
+ */
+    {
+    int i, sp = 0;
+    node_t *node;
+    int stack[STACK_SIZE];
+    if(!bvh || bvh->count == 0) return 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+        {
+        node = &bvh->nodes[stack[--sp]];
+        if(!Overlap(node->aabb, box)) continue;
+        if(node->count > 0)
+            {
+            for(i = node->first; i < node->first + node->count; i++)
+                {
+                if(Overlap(bvh->items[i].aabb, box) && func(&bvh->items[i], data))
+                    return 1;
+                }
+            }
+        else
+            {
+            stack[sp++] = node->first + 1;
+            stack[sp++] = node->first;
+            }
+        }
+    return 0;
+    }
+
+int bvh_classify_planes(const double aabb[6], const double *planes, int count)
+/* Classifies an AABB against the convex volume bounded by count planes (a, b, c, d),
+ * whose inside is a*x + b*y + c*z >= d. Returns -1 if the AABB is outside, 1 if it is
+ * inside, and 0 if it crosses the boundary (or may do so).
+ */
+    {
+    int i, k, result = 1;
+    double pmax, pmin; /* plane function at the AABB vertices farthest along +/- normal */
+    for(i = 0; i < count; i++, planes += 4)
+        {
+        pmax = pmin = 0;
+        for(k = 0; k < 3; k++)
+            {
+            /* (zero components are skipped, to avoid 0*inf with infinite AABBs) */
+            if(planes[k] > 0)
+                { pmax += planes[k]*aabb[2*k+1]; pmin += planes[k]*aabb[2*k]; }
+            else if(planes[k] < 0)
+                { pmax += planes[k]*aabb[2*k]; pmin += planes[k]*aabb[2*k+1]; }
+            }
+        if(pmax < planes[3]) return -1;
+        if(pmin < planes[3]) result = 0;
+        }
+    return result;
+    }
+
+int bvh_query_planes(bvh_t *bvh, const double *planes, int count, bvh_func_t func, void *data)
+/* Calls func for every item whose AABB is not outside the convex volume bounded by
+ * the planes (see bvh_classify_planes). Subtrees that are entirely inside are not
+ * tested any further. Same return values as bvh_query_box().
+ */
+    {
+    int i, cls, inside, sp = 0;
+    node_t *node;
+    int stack[STACK_SIZE]; /* node index * 2 + inside flag */
+    if(!bvh || bvh->count == 0) return 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+        {
+        inside = stack[--sp] & 1;
+        node = &bvh->nodes[stack[sp] >> 1];
+        if(!inside)
+            {
+            if((cls = bvh_classify_planes(node->aabb, planes, count)) < 0) continue;
+            inside = cls;
+            }
+        if(node->count > 0)
+            {
+            for(i = node->first; i < node->first + node->count; i++)
+                {
+                if(!inside && bvh_classify_planes(bvh->items[i].aabb, planes, count) < 0)
+                    continue;
+                if(func(&bvh->items[i], data)) return 1;
+                }
+            }
+        else
+            {
+            stack[sp++] = ((node->first + 1) << 1) | inside;
+            stack[sp++] = (node->first << 1) | inside;
+            }
+        }
+    return 0;
+    }
+
+static int RayBox(const double aabb[6], const double origin[3], const double invdir[3], double maxlen, double *tentry)
+/* Slab test: checks if the ray segment [0, maxlen] intersects the box */
+    {
+    int k;
+    double t0, t1, tmp, tmin = 0, tmax = maxlen;
+    for(k = 0; k < 3; k++)
+        {
+        if(invdir[k] == 0) /* (dir[k] = 0, see bvh_query_ray) */
+            {
+            if(origin[k] < aabb[2*k] || origin[k] > aabb[2*k+1]) return 0;
+            continue;
+            }
+        t0 = (aabb[2*k] - origin[k])*invdir[k];
+        t1 = (aabb[2*k+1] - origin[k])*invdir[k];
+        if(t0 > t1) { tmp = t0; t0 = t1; t1 = tmp; }
+        if(t0 > tmin) tmin = t0;
+        if(t1 < tmax) tmax = t1;
+        if(tmin > tmax) return 0;
+        }
+    *tentry = tmin;
+    return 1;
+    }
+
+int bvh_query_ray(bvh_t *bvh, const double origin[3], const double dir[3], const double *maxlen, bvh_func_t func, void *data)
+/* Calls func for every item whose AABB is crossed by the ray segment from origin along
+ * dir, up to *maxlen, visiting the nearest nodes first. func may shorten *maxlen (e.g.
+ * when it finds a hit) so as to prune farther nodes, and must return 0 to continue the
+ * query, !=0 to stop it. Returns 1 if stopped, 0 otherwise.
+ */
+    {
+    int i, k, sp = 0, near, far;
+    double invdir[3], t, tnear, tfar;
+    node_t *node;
+    int stack[STACK_SIZE];
+    if(!bvh || bvh->count == 0) return 0;
+    for(k = 0; k < 3; k++) invdir[k] = dir[k] != 0 ? 1/dir[k] : 0;
+    if(!RayBox(bvh->nodes[0].aabb, origin, invdir, *maxlen, &t)) return 0;
+    stack[sp++] = 0;
+    while(sp > 0)
+        {
+        node = &bvh->nodes[stack[--sp]];
+        if(!RayBox(node->aabb, origin, invdir, *maxlen, &t)) continue; /* maxlen may have changed */
+        if(node->count > 0)
+            {
+            for(i = node->first; i < node->first + node->count; i++)
+                {
+                if(RayBox(bvh->items[i].aabb, origin, invdir, *maxlen, &t) && func(&bvh->items[i], data))
+                    return 1;
+                }
+            continue;
+            }
+        near = node->first; far = node->first + 1;
+        if(!RayBox(bvh->nodes[near].aabb, origin, invdir, *maxlen, &tnear)) near = -1;
+        if(!RayBox(bvh->nodes[far].aabb, origin, invdir, *maxlen, &tfar)) far = -1;
+        if(near >= 0 && far >= 0 && tfar < tnear) { k = near; near = far; far = k; }
+        if(far >= 0) stack[sp++] = far;
+        if(near >= 0) stack[sp++] = near;
+        }
+    return 0;
+    }
+
+const bvh_item_t *bvh_items(bvh_t *bvh)
+/* Returns the items array (in tree order, which differs from the order they were passed) */
+    { return bvh ? bvh->items : NULL; }
+
@@ -27,6 +27,26 @@
     
 static int cb_ref = LUA_NOREF;
 
+static void SpaceCollide_(lua_State *L, space_t space, void *data, dNearCallback *callback)
+/* dSpaceCollide() wrapper, aware of split spaces */
+    {
+    if(issplitspace(space))
+        splitspacecollide(L, space, data, callback);
+    else
+        dSpaceCollide(space, data, callback);
+    }
+
+static void SpaceCollide2_(lua_State *L, geom_t o1, geom_t o2, void *data, dNearCallback *callback)
+/* dSpaceCollide2() wrapper, aware of split spaces */
+    {
+    if(dGeomIsSpace(o1) && issplitspace((space_t)o1))
+        splitspacecollide2(L, (space_t)o1, o2, data, callback);
+    else if(dGeomIsSpace(o2) && issplitspace((space_t)o2))
+        splitspacecollide2(L, (space_t)o2, o1, data, callback);
+    else
+        dSpaceCollide2(o1, o2, data, callback);
+    }
+
 static void NearCallback(void *data, geom_t o1, geom_t o2)
 /* This version implements the logic as in the ODE manual, and invokes
  * the user callback only when the two objects are both geoms (not spaces)
@@ -34,14 +54,16 @@ static void NearCallback(void *data, geom_t o1, geom_t o2)
     {
 #define L moonode_L
     (void)data; /* not used */
-    if(cb_ref==LUA_NOREF) return;
+    if(cb_ref==LUA_NOREF && sensorcount()==0) return;
     if(dGeomIsSpace(o1) || dGeomIsSpace(o2))
         {
-        if(dGeomIsSpace(o1)) dSpaceCollide((space_t)o1, data, NearCallback);
-        if(dGeomIsSpace(o2)) dSpaceCollide((space_t)o2, data, NearCallback);
+        if(dGeomIsSpace(o1)) SpaceCollide_(L, (space_t)o1, data, NearCallback);
+        if(dGeomIsSpace(o2)) SpaceCollide_(L, (space_t)o2, data, NearCallback);
         }
     else /* two geometries, so handle them to the user callback */
         {
+        if(sensorpair(L, o1, o2)) return; /* handled natively */
+        if(cb_ref==LUA_NOREF) return;
         if(!userdata(o1)) { unexpected(L); return; }
         if(!userdata(o2)) { unexpected(L); return; }
         lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref);
@@ -58,6 +80,7 @@ static void NearCallback2(void *data, geom_t o1, geom_t o2)
     {
 #define L moonode_L
     (void)data; /* not used */
+    if(!dGeomIsSpace(o1) && !dGeomIsSpace(o2) && sensorpair(L, o1, o2)) return;
     if(cb_ref==LUA_NOREF) return;
     if(!userdata(o1)) { unexpected(L); return; }
     if(!userdata(o2)) { unexpected(L); return; }
@@ -112,11 +135,41 @@ static int Collide(lua_State *L)
     return 2;
     }
 
+#define CONTACT_SIZE 7 /* position (3), normal (3), depth (1) */
+
+static int CollideInto(lua_State *L)
+/* n, nextoffset = collide_into(buffer, offset, o1, o2, maxcontacts, [flags]) */
+    {
+    int n, i;
+    double *dst;
+    contact_point_t contacts[MAX_CONTACTS];
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    size_t offset = checkoffset(L, 2);
+    geom_t o1 = checkgeomorspace(L, 3, NULL);
+    geom_t o2 = checkgeomorspace(L, 4, NULL);
+    int max_contacts = luaL_checkinteger(L, 5);
+    int flags = optflags(L, 6, 0); /* collideflags */
+    if(max_contacts<1 || max_contacts > MAX_CONTACTS)
+        return argerror(L, 5, ERR_RANGE);
+    n = dCollide(o1, o2, (flags&0xffff0000) | max_contacts, contacts, sizeof(contact_point_t));
+    dst = n > 0 ? (double*)bufferreserve(L, buffer, offset, n*CONTACT_SIZE*sizeof(double)) : NULL;
+    for(i=0; i<n; i++)
+        {
+        dst[0] = contacts[i].pos[0]; dst[1] = contacts[i].pos[1]; dst[2] = contacts[i].pos[2];
+        dst[3] = contacts[i].normal[0]; dst[4] = contacts[i].normal[1]; dst[5] = contacts[i].normal[2];
+        dst[6] = contacts[i].depth;
+        dst += CONTACT_SIZE;
+        }
+    lua_pushinteger(L, n);
+    lua_pushinteger(L, offset + n*CONTACT_SIZE*sizeof(double));
+    return 2;
+    }
+
 static int SpaceCollide(lua_State *L)
     {
     space_t space;
     space = checkspace(L, 1, NULL);
-    dSpaceCollide(space, NULL, NearCallback);
+    SpaceCollide_(L, space, NULL, NearCallback);
     return 0;
     }
 
@@ -127,13 +180,13 @@ static int SpaceCollide2(lua_State *L)
     if(lua_isnoneornil(L, 2))
         {
         space = checkspace(L, 1, NULL);
-        dSpaceCollide(space, NULL, NearCallback2);
+        SpaceCollide_(L, space, NULL, NearCallback2);
         }
     else
         {
         o1 = checkgeomorspace(L, 1, NULL);
         o2 = checkgeomorspace(L, 2, NULL);
-        dSpaceCollide2(o1, o2, NULL, NearCallback2);
+        SpaceCollide2_(L, o1, o2, NULL, NearCallback2);
         }
     return 0;
     }
@@ -142,6 +195,7 @@ static const struct luaL_Reg Functions[] =
     {
         { "set_near_callback", SetNearCallback },
         { "collide", Collide },
+        { "collide_into", CollideInto },
         { "space_collide", SpaceCollide },
         { "space_collide2", SpaceCollide2 },
         { NULL, NULL } /* sentinel */
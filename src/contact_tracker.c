@@ -0,0 +1,202 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+
+/* Contact events.
+ *
+ * When contact tracking is enabled, each contact joint created with create_contact_joint()
+ * or create_contact_joints() between geoms that match the tracking mask is given a joint
+ * feedback struct from a pool, and the pair of geoms is recorded in a hash table stamped
+ * with the current frame. After the step, contact_events() sums the impulses from the
+ * feedback of each pair, reports the pairs that started, persisted, or stopped being in
+ * contact, recycles the pool, and starts a new frame.
+ *
+ * The pool is made of fixed-size chunks, so that the feedback structs do not move while
+ * the joints refer to them, and it is never released. Pooled feedback structs must not
+ * be freed when the joints are destroyed (see jointdestroy()).
+ */
+
+#define CHUNK_SIZE 256
+#define EVENT_SIZE 4 /* event (1 = begin, 2 = persist, 3 = end), geom1 index, geom2 index, impulse */
+
+typedef struct {
+    jointfeedback_t fb;
+    geom_t g1, g2;
+} feedback_t;
+
+static feedback_t **Chunks = NULL;
+static int ChunkCount = 0;
+static int PoolUsed = 0;
+static pairtable_t Pairs = { NULL, 0, 0, 0 }; /* g1 < g2 */
+static uint32_t Mask = 0; /* tracking disabled */
+static uint32_t Frame = 1;
+
+static jointfeedback_t *Feedback(lua_State *L, geom_t g1, geom_t g2)
+/* Returns a feedback struct from the pool (NULL on failure) */
+    {
+    feedback_t **chunks, *entry;
+    if(PoolUsed == ChunkCount*CHUNK_SIZE)
+        {
+        chunks = (feedback_t**)MallocNoErr(L, (ChunkCount + 1)*sizeof(feedback_t*));
+        if(!chunks) return NULL;
+        if((chunks[ChunkCount] = (feedback_t*)MallocNoErr(L, CHUNK_SIZE*sizeof(feedback_t))) == NULL)
+            { Free(L, chunks); return NULL; }
+        if(Chunks)
+            {
+            memcpy(chunks, Chunks, ChunkCount*sizeof(feedback_t*));
+            Free(L, Chunks);
+            }
+        Chunks = chunks;
+        ChunkCount++;
+        }
+    entry = &Chunks[PoolUsed/CHUNK_SIZE][PoolUsed%CHUNK_SIZE];
+    PoolUsed++;
+    memset(entry, 0, sizeof(feedback_t));
+    entry->g1 = g1;
+    entry->g2 = g2;
+    return &entry->fb;
+    }
+
+int contactfeedbackpooled(jointfeedback_t *fb)
+/* Checks if the feedback struct belongs to the pool */
+    {
+    int i;
+    uintptr_t p = (uintptr_t)fb, chunk;
+    for(i = 0; i < ChunkCount; i++)
+        {
+        chunk = (uintptr_t)Chunks[i];
+        if(p >= chunk && p < chunk + CHUNK_SIZE*sizeof(feedback_t)) return 1;
+        }
+    return 0;
+    }
+
+void contacttrack(lua_State *L, joint_t joint, geom_t o1, geom_t o2)
+/* Called for each contact joint created between o1 and o2 */
+    {
+    pair_t *pair;
+    geom_t tmp;
+    jointfeedback_t *fb;
+    if(Mask == 0 || !o1 || !o2) return;
+    if(((dGeomGetCategoryBits(o1) | dGeomGetCategoryBits(o2)) & Mask) == 0) return;
+    if(o2 < o1) { tmp = o1; o1 = o2; o2 = tmp; }
+    if((pair = pairtable_insert(L, &Pairs, o1, o2)) == NULL) return; /* (just missed) */
+    pair->stamp = Frame;
+    if(dJointGetFeedback(joint) == NULL && (fb = Feedback(L, o1, o2)) != NULL)
+        dJointSetFeedback(joint, fb);
+    }
+
+void contactgeomdestroyed(geom_t geom)
+/* Called when a geom is being destroyed */
+    {
+    pairtable_purge(&Pairs, geom);
+    }
+
+static int SetContactTracking(lua_State *L)
+    {
+    Mask = (uint32_t)luaL_optinteger(L, 1, 0);
+    return 0;
+    }
+
+static double Norm(const double *v)
+    { return sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]); }
+
+static int ContactEvents(lua_State *L)
+/* n, {geom} = contact_events(stepsize, buffer, [offset], [persist]) */
+    {
+    int i, n;
+    double f, f2, *dst;
+    feedback_t *entry;
+    pair_t *pair;
+    double stepsize = luaL_checknumber(L, 1);
+    buffer_t buffer = checkbuffer(L, 2, NULL);
+    size_t offset = checkoffset(L, 3);
+    int persist = optboolean(L, 4, 0);
+    /* sum up the impulses of the contacts of each pair */
+    for(i = 0; i < PoolUsed; i++)
+        {
+        entry = &Chunks[i/CHUNK_SIZE][i%CHUNK_SIZE];
+        if((pair = pairtable_find(&Pairs, entry->g1, entry->g2)) == NULL) continue;
+        f = Norm(entry->fb.f1);
+        f2 = Norm(entry->fb.f2);
+        pair->value += (f > f2 ? f : f2)*stepsize;
+        }
+    PoolUsed = 0;
+    for(i = n = 0; i < Pairs.cap; i++)
+        {
+        pair = &Pairs.pairs[i];
+        if(pair->state == PAIR_NEW) n++;
+        else if(pair->state == PAIR_ACTIVE && (persist || pair->stamp != Frame)) n++;
+        }
+    dst = n > 0 ? (double*)bufferreserve(L, buffer, offset, n*EVENT_SIZE*sizeof(double)) : NULL;
+    lua_pushinteger(L, n);
+    lua_newtable(L); /* geom -> index (temporary) */
+    lua_newtable(L); /* geoms */
+    for(i = 0; i < Pairs.cap; i++)
+        {
+        pair = &Pairs.pairs[i];
+        if(pair->state != PAIR_NEW && pair->state != PAIR_ACTIVE) continue;
+        if(pair->value > pair->maxvalue) pair->maxvalue = pair->value;
+        if(pair->state == PAIR_NEW)
+            {
+            pair->state = PAIR_ACTIVE;
+            dst[0] = 1;
+            dst[3] = pair->value;
+            }
+        else if(pair->stamp != Frame)
+            {
+            pairtable_remove(&Pairs, pair);
+            dst[0] = 3;
+            dst[3] = pair->maxvalue;
+            }
+        else if(persist)
+            {
+            dst[0] = 2;
+            dst[3] = pair->value;
+            }
+        else
+            { pair->value = 0; continue; }
+        pair->value = 0;
+        dst[1] = pairtable_index(L, pair->g1);
+        dst[2] = pairtable_index(L, pair->g2);
+        dst += EVENT_SIZE;
+        }
+    lua_remove(L, -2);
+    Frame++;
+    pairtable_compact(L, &Pairs);
+    return 2;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "set_contact_tracking", SetContactTracking },
+        { "contact_events", ContactEvents },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_contact_tracker(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
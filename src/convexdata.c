@@ -0,0 +1,225 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+
+/* A convexdata is a reference-counted convex shape representation (planes, points
+ * and polygons, in the format expected by ODE) that can be shared by any number of
+ * convex geoms, so that instances of the same shape do not need a copy each.
+ * The arrays are released when both the convexdata object and all the geoms using
+ * it are gone. (Convex geoms created directly from planes, points and polygons get
+ * a private convexdata, with no Lua object.)
+ */
+
+/*------------------------------------------------------------------------------*
+ | Internal API                                                                 |
+ *------------------------------------------------------------------------------*/
+
+void convexdataref(convexdata_t data)
+    { data->refcount++; }
+
+void convexdataunref(lua_State *L, convexdata_t data)
+    {
+    if(--data->refcount > 0) return;
+    if(data->planes) Free(L, data->planes);
+    if(data->points) Free(L, data->points);
+    if(data->polygons) Free(L, data->polygons);
+    Free(L, data);
+    }
+
+static convexdata_t NewData(lua_State *L, double *planes, int planecount, double *points, int pointcount, unsigned int *polygons)
+/* Takes ownership of the arrays, and releases them on error */
+    {
+    convexdata_t data = (convexdata_t)MallocNoErr(L, sizeof(struct moonode_convexdata_s));
+    if(!data)
+        {
+        Free(L, planes); Free(L, points); Free(L, polygons);
+        errmemory(L);
+        return NULL;
+        }
+    data->planes = planes;
+    data->planecount = planecount;
+    data->points = points;
+    data->pointcount = pointcount;
+    data->polygons = polygons;
+    data->refcount = 1;
+    return data;
+    }
+
+convexdata_t convexdatacheck(lua_State *L, int arg)
+/* Creates a new convexdata (refcount=1) from the planes, points and polygons at
+ * arg, arg+1 and arg+2 (raises an error on failure) */
+    {
+    int err, i, planecount, pointcount;
+    unsigned int polygoncount;
+    vec4_t *planes;
+    vec3_t *vecs;
+    double *points;
+    unsigned int *polygons;
+    planes = checkvec4list(L, arg, &planecount, &err);
+    if(err) { argerror(L, arg, err); return NULL; }
+    vecs = checkvec3list(L, arg+1, &pointcount, &err);
+    if(err) { Free(L, planes); argerror(L, arg+1, err); return NULL; }
+    polygons = checkpolygons(L, arg+2, &polygoncount, &err);
+    if(err) { Free(L, planes); Free(L, vecs); argerror(L, arg+2, err); return NULL; }
+    /* ODE expects 3 doubles per point (vec3_t has 4) */
+    points = (double*)MallocNoErr(L, 3*pointcount*sizeof(double));
+    if(!points)
+        { Free(L, planes); Free(L, vecs); Free(L, polygons); errmemory(L); return NULL; }
+    for(i = 0; i < pointcount; i++) memcpy(points + 3*i, vecs[i], 3*sizeof(double));
+    Free(L, vecs);
+    return NewData(L, (double*)planes, planecount, points, pointcount, polygons);
+    }
+
+static double *CheckPoints(lua_State *L, int arg, int *count)
+/* Points passed either as a table of vec3, or as a binary string or buffer of
+ * packed doubles (3 per point). Returns a Malloc()'d array of 3 doubles per point */
+    {
+    int i, err;
+    size_t len;
+    const char *data;
+    vec3_t *vecs;
+    double *points;
+    buffer_t buffer;
+    if(lua_type(L, arg) == LUA_TTABLE)
+        {
+        vecs = checkvec3list(L, arg, count, &err);
+        if(err) { argerror(L, arg, err); return NULL; }
+        points = (double*)MallocNoErr(L, 3*(*count)*sizeof(double));
+        if(!points) { Free(L, vecs); errmemory(L); return NULL; }
+        for(i = 0; i < *count; i++) memcpy(points + 3*i, vecs[i], 3*sizeof(double));
+        Free(L, vecs);
+        return points;
+        }
+    if((buffer = testbuffer(L, arg, NULL)) != NULL)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, arg, &len);
+    if(len == 0 || len % (3*sizeof(double)) != 0) { argerror(L, arg, ERR_LENGTH); return NULL; }
+    *count = len / (3*sizeof(double));
+    points = (double*)MallocNoErr(L, len);
+    if(!points) { errmemory(L); return NULL; }
+    memcpy(points, data, len);
+    return points;
+    }
+
+convexdata_t convexdatahull(lua_State *L, int arg)
+/* Creates a new convexdata (refcount=1) as the convex hull of the points at arg,
+ * with the optional tolerance and max no. of vertices at arg+1 and arg+2 */
+    {
+    int err, count;
+    hull_t hull;
+    double *points;
+    double tolerance = luaL_optnumber(L, arg+1, 0);
+    int maxvertices = luaL_optinteger(L, arg+2, 0);
+    if(tolerance < 0) { argerror(L, arg+1, ERR_VALUE); return NULL; }
+    if(maxvertices < 0) { argerror(L, arg+2, ERR_VALUE); return NULL; }
+    points = CheckPoints(L, arg, &count);
+    err = hull_build(L, points, count, tolerance, maxvertices, &hull);
+    Free(L, points);
+    switch(err)
+        {
+        case 0: break;
+        case ERR_MEMORY: errmemory(L); return NULL;
+        case ERR_RANGE: argerror(L, arg+2, err); return NULL;
+        default: argerror(L, arg, err); return NULL;
+        }
+    return NewData(L, hull.planes, hull.planecount, hull.points, hull.pointcount, hull.polygons);
+    }
+
+convexdata_t convexdatafromhull(lua_State *L, hull_t *hull)
+/* Creates a new convexdata (refcount=1) taking ownership of the hull's arrays */
+    {
+    hull_t h = *hull;
+    memset(hull, 0, sizeof(hull_t)); /* (before NewData(), that releases the arrays on error) */
+    return NewData(L, h.planes, h.planecount, h.points, h.pointcount, h.polygons);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Methods                                                                      |
+ *------------------------------------------------------------------------------*/
+
+static int freeconvexdata(lua_State *L, ud_t *ud)
+    {
+    convexdata_t data = (convexdata_t)ud->handle;
+    if(!freeuserdata(L, ud, "convexdata")) return 0;
+    convexdataunref(L, data);
+    return 0;
+    }
+
+int newconvexdata(lua_State *L, convexdata_t data)
+/* Creates the Lua object for the convexdata (refcount=1) and pushes it on the stack */
+    {
+    ud_t *ud;
+    ud = newuserdata(L, data, CONVEXDATA_MT, "convexdata");
+    ud->parent_ud = NULL;
+    ud->destructor = freeconvexdata;
+    return 1;
+    }
+
+static int Create(lua_State *L)
+    { return newconvexdata(L, convexdatacheck(L, 1)); }
+
+static int CreateHull(lua_State *L)
+    { return newconvexdata(L, convexdatahull(L, 1)); }
+
+static int GetInfo(lua_State *L)
+    {
+    convexdata_t data = checkconvexdata(L, 1, NULL);
+    lua_pushinteger(L, data->planecount);
+    lua_pushinteger(L, data->pointcount);
+    lua_pushinteger(L, data->refcount - 1);
+    return 3;
+    }
+
+RAW_FUNC(convexdata)
+DESTROY_FUNC(convexdata)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "get_info", GetInfo },
+        { "destroy", Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_convexdata", Create },
+        { "create_convexdata_hull", CreateHull },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_convexdata(lua_State *L)
+    {
+    udata_define(L, CONVEXDATA_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
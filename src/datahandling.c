@@ -171,40 +171,188 @@ PACK_INTEGERS(uint32_t)
 PACK_INTEGERS(int64_t)
 PACK_INTEGERS(uint64_t)
 
-static int Pack(lua_State *L)
+/*-----------------------------------------------------------------------------*
+ | Streaming packer                                                            |
+ *-----------------------------------------------------------------------------*/
+
+/* The streaming packer encodes the values of the arguments first..top of the stack
+ * (numbers or, possibly nested, tables of numbers) directly in the destination,
+ * walking the nested tables in place instead of building a flat table first.
+ * Only the array part of tables is considered (raw access).
+ */
+
+#define MAX_DEPTH 64 /* max nesting level for tables */
+
+static size_t CountTable(lua_State *L, int arg, int depth, int *err)
+/* counts the terminal elements in the table at arg */
     {
-    int err = 0;
-    void *dst = NULL;
-    size_t dstsize = 0;
-    int type = checkdatatype(L, 1);
-    size_t n = toflattable(L, 2);
-    switch(type)
+    size_t i, len, n = 0;
+    if(depth > MAX_DEPTH) { *err = ERR_VALUE; return 0; }
+    luaL_checkstack(L, 2, "too many nested tables");
+    len = lua_rawlen(L, arg);
+    for(i = 1; i <= len && !*err; i++)
         {
-#define P(T) do { dstsize = n * sizeof(T);      \
-                  dst = Malloc(L, dstsize);     \
-                  err = Pack##T(L, n, dst, dstsize, NULL); } while(0)
+        if(lua_rawgeti(L, arg, i) == LUA_TTABLE)
+            n += CountTable(L, lua_gettop(L), depth + 1, err);
+        else
+            n++;
+        lua_pop(L, 1);
+        }
+    return n;
+    }
 
-        case DATATYPE_CHAR:   P(int8_t); break;
-        case DATATYPE_UCHAR:  P(uint8_t); break;
-        case DATATYPE_SHORT:  P(int16_t); break;
-        case DATATYPE_USHORT: P(uint16_t); break;
-        case DATATYPE_INT:    P(int32_t); break;
-        case DATATYPE_UINT:   P(uint32_t); break;
-        case DATATYPE_LONG:   P(int64_t); break;
-        case DATATYPE_ULONG:  P(uint64_t); break;
-        case DATATYPE_FLOAT:  P(float); break;
-        case DATATYPE_DOUBLE: P(double); break;
+static size_t GuessTable(lua_State *L, int arg)
+/* Guesses the no. of terminal elements in the table at arg, assuming it is either
+ * a flat array or a list of equally sized flat arrays (e.g. a list of vec3).
+ * Returns 0 if the guess is not applicable. */
+    {
+    int top = lua_gettop(L);
+    size_t n = 0, len = lua_rawlen(L, arg);
+    if(len == 0) return 0;
+    if(lua_rawgeti(L, arg, 1) != LUA_TTABLE)
+        n = len;
+    else if(lua_rawgeti(L, -1, 1) != LUA_TTABLE)
+        n = len * lua_rawlen(L, -2);
+    lua_settop(L, top);
+    return n;
+    }
+
+#define STREAM(T, what) /* what= number or integer */                   \
+static int Stream##T(lua_State *L, int arg, T *dst, size_t cap, size_t *pos, int depth) \
+    {                                                                   \
+    int err, isnum;                                                     \
+    size_t i, len;                                                      \
+    if(depth > MAX_DEPTH) return ERR_VALUE;                             \
+    luaL_checkstack(L, 2, "too many nested tables");                    \
+    len = lua_rawlen(L, arg);                                           \
+    for(i = 1; i <= len; i++)                                           \
+        {                                                               \
+        if(lua_rawgeti(L, arg, i) == LUA_TTABLE)                        \
+            {                                                           \
+            err = Stream##T(L, lua_gettop(L), dst, cap, pos, depth+1);  \
+            if(err) return err;                                         \
+            }                                                           \
+        else                                                            \
+            {                                                           \
+            if(*pos >= cap) return ERR_LENGTH;                          \
+            dst[*pos] = (T)lua_to##what##x(L, -1, &isnum);              \
+            if(!isnum) return ERR_TYPE;                                 \
+            (*pos)++;                                                   \
+            }                                                           \
+        lua_pop(L, 1);                                                  \
+        }                                                               \
+    return 0;                                                           \
+    }                                                                   \
+static int StreamArgs##T(lua_State *L, int first, int last, void *dst_, size_t cap, size_t *pos) \
+    {                                                                   \
+    int err, isnum, arg;                                                \
+    T *dst = (T*)dst_;                                                  \
+    for(arg = first; arg <= last; arg++)                                \
+        {                                                               \
+        if(lua_type(L, arg) == LUA_TTABLE)                              \
+            {                                                           \
+            err = Stream##T(L, arg, dst, cap, pos, 0);                  \
+            if(err) return err;                                         \
+            }                                                           \
+        else                                                            \
+            {                                                           \
+            if(*pos >= cap) return ERR_LENGTH;                          \
+            dst[*pos] = (T)lua_to##what##x(L, arg, &isnum);             \
+            if(!isnum) return ERR_TYPE;                                 \
+            (*pos)++;                                                   \
+            }                                                           \
+        }                                                               \
+    return 0;                                                           \
+    }
+
+#define STREAM_NUMBERS(T)     STREAM(T, number)
+#define STREAM_INTEGERS(T)    STREAM(T, integer)
+
+STREAM_NUMBERS(float)
+STREAM_NUMBERS(double)
+STREAM_INTEGERS(int8_t)
+STREAM_INTEGERS(uint8_t)
+STREAM_INTEGERS(int16_t)
+STREAM_INTEGERS(uint16_t)
+STREAM_INTEGERS(int32_t)
+STREAM_INTEGERS(uint32_t)
+STREAM_INTEGERS(int64_t)
+STREAM_INTEGERS(uint64_t)
+
+size_t countdata(lua_State *L, int first, int last, int exact)
+/* Returns the no. of terminal elements in the arguments first..last.
+ * If exact=0, it may return a guess (to be verified with packdata()).
+ * Raises an error for tables nested too deeply.
+ */
+    {
+    int arg, err = 0, top = lua_gettop(L);
+    size_t n = 0;
+    if(!exact && first == last && lua_type(L, first) == LUA_TTABLE)
+        {
+        if((n = GuessTable(L, first)) > 0) return n;
+        }
+    for(arg = first; arg <= last && !err; arg++)
+        {
+        if(lua_type(L, arg) == LUA_TTABLE)
+            n += CountTable(L, arg, 0, &err);
+        else
+            n++;
+        }
+    lua_settop(L, top);
+    if(err) luaL_argerror(L, first, errstring(err));
+    return n;
+    }
+
+int packdata(lua_State *L, int type, int first, int last, void *dst, size_t cap, size_t *count)
+/* Packs the values of the arguments first..last in dst, that has room for cap elements
+ * of the given type, and returns the no. of packed elements in *count.
+ * Returns ERR_LENGTH if there is not enough room, or another error code if a value
+ * is invalid. The stack is left unchanged.
+ */
+    {
+    int err = 0, top = lua_gettop(L);
+    *count = 0;
+    switch(type)
+        {
+        case DATATYPE_CHAR:   err = StreamArgsint8_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_UCHAR:  err = StreamArgsuint8_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_SHORT:  err = StreamArgsint16_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_USHORT: err = StreamArgsuint16_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_INT:    err = StreamArgsint32_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_UINT:   err = StreamArgsuint32_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_LONG:   err = StreamArgsint64_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_ULONG:  err = StreamArgsuint64_t(L, first, last, dst, cap, count); break;
+        case DATATYPE_FLOAT:  err = StreamArgsfloat(L, first, last, dst, cap, count); break;
+        case DATATYPE_DOUBLE: err = StreamArgsdouble(L, first, last, dst, cap, count); break;
         default:
             return unexpected(L);
-#undef P
         }
-    if(err)
+    lua_settop(L, top);
+    return err;
+    }
+
+static int Pack(lua_State *L)
+    {
+    int err;
+    luaL_Buffer b;
+    char *dst;
+    size_t count;
+    int type = checkdatatype(L, 1);
+    size_t size = sizeoftype(type);
+    int last = lua_gettop(L); /* luaL_Buffer may push a box on the stack */
+    size_t n = countdata(L, 2, last, 0);
+    /* pack directly in the memory of the resulting string */
+    dst = luaL_buffinitsize(L, &b, n * size);
+    err = packdata(L, type, 2, last, dst, n, &count);
+    if(err == ERR_LENGTH) /* the guess was wrong: count and retry */
         {
-        Free(L, dst);
-        return luaL_argerror(L, 2, errstring(err));
+        n = countdata(L, 2, last, 1);
+        dst = luaL_prepbuffsize(&b, n * size);
+        err = packdata(L, type, 2, last, dst, n, &count);
         }
-    lua_pushlstring(L, (char*)dst, dstsize);
-    Free(L, dst);
+    if(err)
+        return luaL_argerror(L, 2, errstring(err));
+    luaL_pushresultsize(&b, count * size);
     return 1;
     }
 
@@ -218,7 +366,7 @@ static int Unpack##T(lua_State *L, const void* data, size_t len) \
     if((len < sizeof(T)) || (len % sizeof(T)) != 0)     \
         return ERR_LENGTH;                              \
     n = len / sizeof(T);                                \
-    lua_newtable(L);                                    \
+    lua_createtable(L, n, 0);                           \
     for(i = 0; i < n; i++)                              \
         {                                               \
         lua_push##what(L, ((T*)data)[i]);               \
@@ -267,11 +415,556 @@ static int Unpack_(lua_State *L, int type, const void *data, size_t len)
 
 
 static int Unpack(lua_State *L)
+/* unpack(type, data, [offset], [count]), data = binary string or buffer */
     {
-    size_t len;
+    size_t len, size, offset, count;
+    const char *data;
     int type = checkdatatype(L, 1);
-    const void *data = luaL_checklstring(L, 2, &len);
-    return Unpack_(L, type, data, len);
+    buffer_t buffer = testbuffer(L, 2, NULL);
+    if(buffer)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, 2, &len);
+    if(lua_isnoneornil(L, 3) && lua_isnoneornil(L, 4))
+        return Unpack_(L, type, data, len);
+    size = sizeoftype(type);
+    offset = checkoffset(L, 3);
+    if(offset > len) return argerror(L, 3, ERR_BOUNDARIES);
+    count = lua_isnoneornil(L, 4) ? (len - offset) / size : (size_t)luaL_checkinteger(L, 4);
+    if(count > (len - offset) / size) return argerror(L, 4, ERR_BOUNDARIES);
+    if(count == 0) { lua_newtable(L); return 1; }
+    return Unpack_(L, type, data + offset, count * size);
+    }
+
+/*-----------------------------------------------------------------------------*
+ | Conversion kernels                                                          |
+ *-----------------------------------------------------------------------------*/
+
+/* Buffer-to-buffer conversions between data types, with dst = src * scale + bias.
+ * Values are converted in chunks through an intermediate array of doubles: each
+ * LOAD/STORE kernel is a plain loop over restrict pointers with a constant trip
+ * count, which the compiler can vectorize. Stores to integer types round to the
+ * nearest integer and saturate to the range of the type.
+ */
+
+#define CHUNK 256 /* elements per chunk */
+
+#define LOAD(T)                                                                 \
+static void Load##T(const void *src_, double *restrict tmp, size_t n)           \
+    {                                                                           \
+    size_t i;                                                                   \
+    const T *restrict src = (const T*)src_;                                     \
+    if(n == CHUNK)                                                              \
+        { for(i = 0; i < CHUNK; i++) tmp[i] = (double)src[i]; }                 \
+    else                                                                        \
+        { for(i = 0; i < n; i++) tmp[i] = (double)src[i]; }                     \
+    }
+
+#define STORE_REAL(T)                                                           \
+static void Store##T(void *dst_, const double *restrict tmp, size_t n)          \
+    {                                                                           \
+    size_t i;                                                                   \
+    T *restrict dst = (T*)dst_;                                                 \
+    if(n == CHUNK)                                                              \
+        { for(i = 0; i < CHUNK; i++) dst[i] = (T)tmp[i]; }                      \
+    else                                                                        \
+        { for(i = 0; i < n; i++) dst[i] = (T)tmp[i]; }                          \
+    }
+
+/* Rounds v to the nearest T, saturating to [minval, maxval]. The upper limit is
+ * compared as an exclusive double bound (maxval+1 for 64-bit types, where maxval
+ * is not representable as a double), and NaN is stored as 0.
+ */
+#define STORE_INT(T, minval, maxval, limit)                                     \
+static T Saturate##T(double v)                                                  \
+    {                                                                           \
+    if(v != v) return 0;                                                        \
+    if(v <= (double)(minval)) return (minval);                                  \
+    if(v >= (limit)) return (maxval);                                           \
+    return (T)(v >= 0 ? v + 0.5 : v - 0.5);                                     \
+    }                                                                           \
+static void Store##T(void *dst_, const double *restrict tmp, size_t n)          \
+    {                                                                           \
+    size_t i;                                                                   \
+    T *restrict dst = (T*)dst_;                                                 \
+    if(n == CHUNK)                                                              \
+        { for(i = 0; i < CHUNK; i++) dst[i] = Saturate##T(tmp[i]); }           \
+    else                                                                        \
+        { for(i = 0; i < n; i++) dst[i] = Saturate##T(tmp[i]); }                \
+    }
+
+LOAD(float)
+LOAD(double)
+LOAD(int8_t)
+LOAD(uint8_t)
+LOAD(int16_t)
+LOAD(uint16_t)
+LOAD(int32_t)
+LOAD(uint32_t)
+LOAD(int64_t)
+LOAD(uint64_t)
+STORE_REAL(float)
+STORE_REAL(double)
+STORE_INT(int8_t, INT8_MIN, INT8_MAX, (double)INT8_MAX)
+STORE_INT(uint8_t, 0, UINT8_MAX, (double)UINT8_MAX)
+STORE_INT(int16_t, INT16_MIN, INT16_MAX, (double)INT16_MAX)
+STORE_INT(uint16_t, 0, UINT16_MAX, (double)UINT16_MAX)
+STORE_INT(int32_t, INT32_MIN, INT32_MAX, (double)INT32_MAX)
+STORE_INT(uint32_t, 0, UINT32_MAX, (double)UINT32_MAX)
+STORE_INT(int64_t, INT64_MIN, INT64_MAX, 0x1p63)
+STORE_INT(uint64_t, 0, UINT64_MAX, 0x1p64)
+
+typedef void (*load_t)(const void *src, double *restrict tmp, size_t n);
+typedef void (*store_t)(void *dst, const double *restrict tmp, size_t n);
+
+static load_t Loader(int type)
+    {
+    switch(type)
+        {
+        case DATATYPE_CHAR:   return Loadint8_t;
+        case DATATYPE_UCHAR:  return Loaduint8_t;
+        case DATATYPE_SHORT:  return Loadint16_t;
+        case DATATYPE_USHORT: return Loaduint16_t;
+        case DATATYPE_INT:    return Loadint32_t;
+        case DATATYPE_UINT:   return Loaduint32_t;
+        case DATATYPE_LONG:   return Loadint64_t;
+        case DATATYPE_ULONG:  return Loaduint64_t;
+        case DATATYPE_FLOAT:  return Loadfloat;
+        case DATATYPE_DOUBLE: return Loaddouble;
+        default: return NULL;
+        }
+    return NULL;
+    }
+
+static store_t Storer(int type)
+    {
+    switch(type)
+        {
+        case DATATYPE_CHAR:   return Storeint8_t;
+        case DATATYPE_UCHAR:  return Storeuint8_t;
+        case DATATYPE_SHORT:  return Storeint16_t;
+        case DATATYPE_USHORT: return Storeuint16_t;
+        case DATATYPE_INT:    return Storeint32_t;
+        case DATATYPE_UINT:   return Storeuint32_t;
+        case DATATYPE_LONG:   return Storeint64_t;
+        case DATATYPE_ULONG:  return Storeuint64_t;
+        case DATATYPE_FLOAT:  return Storefloat;
+        case DATATYPE_DOUBLE: return Storedouble;
+        default: return NULL;
+        }
+    return NULL;
+    }
+
+static void ScaleBias(double *restrict tmp, size_t n, double scale, double bias)
+    {
+    size_t i;
+    if(n == CHUNK)
+        { for(i = 0; i < CHUNK; i++) tmp[i] = tmp[i] * scale + bias; }
+    else
+        { for(i = 0; i < n; i++) tmp[i] = tmp[i] * scale + bias; }
+    }
+
+void convertdata(int dsttype, void *dst, int srctype, const void *src, size_t count, double scale, double bias)
+/* Converts count elements from src to dst (which must not overlap) */
+    {
+    double tmp[CHUNK];
+    size_t n, dstsize = sizeoftype(dsttype), srcsize = sizeoftype(srctype);
+    load_t load = Loader(srctype);
+    store_t store = Storer(dsttype);
+    int identity = (scale == 1.0 && bias == 0.0);
+    if(identity && dsttype == srctype)
+        { memcpy(dst, src, count * dstsize); return; }
+    while(count > 0)
+        {
+        n = count < CHUNK ? count : CHUNK;
+        load(src, tmp, n);
+        if(!identity) ScaleBias(tmp, n, scale, bias);
+        store(dst, tmp, n);
+        src = (const char*)src + n * srcsize;
+        dst = (char*)dst + n * dstsize;
+        count -= n;
+        }
+    }
+
+static int Convert(lua_State *L)
+/* nextoffset = convert(dsttype, dstbuffer, dstoffset, srctype, src, srcoffset, count, [scale], [bias])
+ * src = buffer or binary string
+ */
+    {
+    size_t srclen;
+    const char *src;
+    char *dst;
+    int dsttype = checkdatatype(L, 1);
+    buffer_t dstbuffer = checkbuffer(L, 2, NULL);
+    size_t dstoffset = checkoffset(L, 3);
+    int srctype = checkdatatype(L, 4);
+    buffer_t srcbuffer = testbuffer(L, 5, NULL);
+    size_t srcoffset = checkoffset(L, 6);
+    lua_Integer n = luaL_checkinteger(L, 7);
+    double scale = luaL_optnumber(L, 8, 1.0);
+    double bias = luaL_optnumber(L, 9, 0.0);
+    size_t count, dstsize = sizeoftype(dsttype), srcsize = sizeoftype(srctype);
+    if(!srcbuffer) luaL_checklstring(L, 5, &srclen);
+    /* the lengths computed below must not overflow */
+    if(n < 0 || (lua_Unsigned)n > (size_t)-1/(dstsize > srcsize ? dstsize : srcsize))
+        return argerror(L, 7, ERR_RANGE);
+    count = (size_t)n;
+    if(count == 0)
+        { lua_pushinteger(L, dstoffset); return 1; }
+    /* reserve first, since the source may be in the same buffer */
+    dst = (char*)bufferreserve(L, dstbuffer, dstoffset, count * dstsize);
+    if(srcbuffer)
+        src = (const char*)bufferptr(L, srcbuffer, srcoffset, count * srcsize, 6);
+    else
+        {
+        src = lua_tolstring(L, 5, &srclen);
+        if(srcoffset > srclen || count * srcsize > srclen - srcoffset)
+            return argerror(L, 6, ERR_BOUNDARIES);
+        src += srcoffset;
+        }
+    if(src < dst + count * dstsize && dst < src + count * srcsize)
+        return luaL_argerror(L, 3, "overlapping source and destination");
+    convertdata(dsttype, dst, srctype, src, count, scale, bias);
+    lua_pushinteger(L, dstoffset + count * dstsize);
+    return 1;
+    }
+
+/*-----------------------------------------------------------------------------*
+ | Quantized body states                                                       |
+ *-----------------------------------------------------------------------------*/
+
+/* Body states are encoded in a bitstream (LSB first) as quantized fields:
+ * - position: 3 fixed point values in [position_min, position_max] (position_bits each),
+ * - orientation: smallest-three quaternion, i.e. the index of the largest component
+ *   (2 bits) and the other three components in [-1/sqrt(2), 1/sqrt(2)] (quaternion_bits
+ *   each, the largest one is recovered from the unit norm),
+ * - optionally, linear and angular velocities: 3+3 fixed point values in [-max, max]
+ *   (velocity_bits each).
+ *
+ * The quantized fields can be saved in a 'snapshot' buffer (as uint32 values), and a
+ * previous snapshot can be used as 'baseline' to delta encode the states. In delta
+ * encoding, each body starts with a 'changed' bit, and each field of a changed body
+ * is encoded as '0' (unchanged), '10' + zigzag delta (small deltas, in bits/4 bits),
+ * or '11' + value.
+ */
+
+#define QMAXFIELDS 13
+
+typedef struct {
+    double pmin[3], pmax[3];
+    double lvmax, avmax;
+    int pbits, qbits, vbits;
+    int velocities;
+    int nfields;
+    int bits[QMAXFIELDS];
+} qparams_t;
+
+static int GetBits(lua_State *L, int arg, const char *name, int defval)
+    {
+    int bits;
+    lua_getfield(L, arg, name);
+    bits = luaL_optinteger(L, -1, defval);
+    lua_pop(L, 1);
+    if(bits < 2 || bits > 30) 
+        return luaL_error(L, "invalid %s", name);
+    return bits;
+    }
+
+static void CheckQuantParams(lua_State *L, int arg, qparams_t *p)
+    {
+    int i;
+    if(!lua_istable(L, arg)) { argerror(L, arg, ERR_TABLE); return; }
+    memset(p, 0, sizeof(qparams_t));
+    lua_getfield(L, arg, "position_min"); checkvec3(L, -1, p->pmin); lua_pop(L, 1);
+    lua_getfield(L, arg, "position_max"); checkvec3(L, -1, p->pmax); lua_pop(L, 1);
+    p->pbits = GetBits(L, arg, "position_bits", 16);
+    p->qbits = GetBits(L, arg, "quaternion_bits", 10);
+    lua_getfield(L, arg, "velocities"); p->velocities = lua_toboolean(L, -1); lua_pop(L, 1);
+    if(p->velocities)
+        {
+        p->vbits = GetBits(L, arg, "velocity_bits", 12);
+        lua_getfield(L, arg, "linear_vel_max"); p->lvmax = luaL_checknumber(L, -1); lua_pop(L, 1);
+        lua_getfield(L, arg, "angular_vel_max"); p->avmax = luaL_checknumber(L, -1); lua_pop(L, 1);
+        }
+    for(i = 0; i < 3; i++)
+        if(p->pmax[i] <= p->pmin[i]) { argerror(L, arg, ERR_RANGE); return; }
+    if(p->velocities && (p->lvmax <= 0 || p->avmax <= 0))
+        { argerror(L, arg, ERR_RANGE); return; }
+    p->bits[0] = p->bits[1] = p->bits[2] = p->pbits;
+    p->bits[3] = 2;
+    p->bits[4] = p->bits[5] = p->bits[6] = p->qbits;
+    p->nfields = 7;
+    if(p->velocities)
+        {
+        for(i = 7; i < 13; i++) p->bits[i] = p->vbits;
+        p->nfields = 13;
+        }
+    }
+
+static uint32_t Quantize(double val, double minval, double maxval, int bits)
+    {
+    double maxq = (double)((1U << bits) - 1);
+    double q = (val - minval) / (maxval - minval) * maxq;
+    if(q <= 0) return 0;
+    if(q >= maxq) return (uint32_t)maxq;
+    return (uint32_t)(q + 0.5);
+    }
+
+static double Dequantize(uint32_t q, double minval, double maxval, int bits)
+    {
+    double maxq = (double)((1U << bits) - 1);
+    return minval + (maxval - minval) * (q / maxq);
+    }
+
+#define QRANGE 0.70710678118654752440 /* 1/sqrt(2) */
+
+static void QuantizeState(body_t body, const qparams_t *p, uint32_t *q)
+    {
+    int i, j, m = 0;
+    double quat[4], norm = 0;
+    const dReal *v = dBodyGetPosition(body);
+    for(i = 0; i < 3; i++)
+        q[i] = Quantize(v[i], p->pmin[i], p->pmax[i], p->pbits);
+    v = dBodyGetQuaternion(body);
+    for(i = 0; i < 4; i++)
+        {
+        quat[i] = v[i];
+        norm += v[i]*v[i];
+        if(fabs(v[i]) > fabs(v[m])) m = i;
+        }
+    norm = sqrt(norm);
+    if(norm == 0) { quat[0] = 1; norm = 1; m = 0; }
+    if(quat[m] < 0) norm = -norm; /* q and -q are the same rotation */
+    q[3] = m;
+    for(i = 0, j = 4; i < 4; i++)
+        if(i != m) q[j++] = Quantize(quat[i]/norm, -QRANGE, QRANGE, p->qbits);
+    if(p->velocities)
+        {
+        v = dBodyGetLinearVel(body);
+        for(i = 0; i < 3; i++) q[7+i] = Quantize(v[i], -p->lvmax, p->lvmax, p->vbits);
+        v = dBodyGetAngularVel(body);
+        for(i = 0; i < 3; i++) q[10+i] = Quantize(v[i], -p->avmax, p->avmax, p->vbits);
+        }
+    }
+
+static void ApplyState(body_t body, const qparams_t *p, const uint32_t *q)
+    {
+    int i, j, m = q[3];
+    double v[3], sum = 0;
+    quat_t quat;
+    for(i = 0; i < 3; i++)
+        v[i] = Dequantize(q[i], p->pmin[i], p->pmax[i], p->pbits);
+    dBodySetPosition(body, v[0], v[1], v[2]);
+    for(i = 0, j = 4; i < 4; i++)
+        {
+        if(i == m) continue;
+        quat[i] = Dequantize(q[j++], -QRANGE, QRANGE, p->qbits);
+        sum += quat[i]*quat[i];
+        }
+    quat[m] = sum < 1 ? sqrt(1 - sum) : 0;
+    dBodySetQuaternion(body, quat);
+    if(p->velocities)
+        {
+        for(i = 0; i < 3; i++) v[i] = Dequantize(q[7+i], -p->lvmax, p->lvmax, p->vbits);
+        dBodySetLinearVel(body, v[0], v[1], v[2]);
+        for(i = 0; i < 3; i++) v[i] = Dequantize(q[10+i], -p->avmax, p->avmax, p->vbits);
+        dBodySetAngularVel(body, v[0], v[1], v[2]);
+        }
+    }
+
+typedef struct {
+    uint8_t *data;
+    size_t len; /* no. of bytes written */
+    uint64_t acc;
+    int n; /* no. of bits in acc */
+} bitwriter_t;
+
+static void PutBits(bitwriter_t *w, uint32_t val, int bits)
+    {
+    w->acc |= (uint64_t)val << w->n;
+    w->n += bits;
+    while(w->n >= 8)
+        {
+        w->data[w->len++] = (uint8_t)(w->acc & 0xff);
+        w->acc >>= 8;
+        w->n -= 8;
+        }
+    }
+
+static void FlushBits(bitwriter_t *w)
+    {
+    if(w->n > 0) w->data[w->len++] = (uint8_t)(w->acc & 0xff);
+    w->acc = 0;
+    w->n = 0;
+    }
+
+typedef struct {
+    const uint8_t *data;
+    size_t size; /* no. of available bytes */
+    size_t len; /* no. of bytes read */
+    uint64_t acc;
+    int n; /* no. of bits in acc */
+} bitreader_t;
+
+static int GetBits_(bitreader_t *r, int bits, uint32_t *val)
+/* returns -1 if not enough data */
+    {
+    while(r->n < bits)
+        {
+        if(r->len >= r->size) return -1;
+        r->acc |= (uint64_t)r->data[r->len++] << r->n;
+        r->n += 8;
+        }
+    *val = (uint32_t)(r->acc & ((((uint64_t)1) << bits) - 1));
+    r->acc >>= bits;
+    r->n -= bits;
+    return 0;
+    }
+
+#define ZigZag(d) (((uint32_t)(d) << 1) ^ (uint32_t)((d) >> 31))
+#define UnZigZag(z) ((int32_t)((z) >> 1) ^ -(int32_t)((z) & 1))
+#define DeltaBits(bits) ((bits) < 8 ? 2 : (bits)/4)
+
+static void EncodeState(bitwriter_t *w, const qparams_t *p, const uint32_t *q, const uint32_t *base)
+    {
+    int k, db;
+    int32_t d;
+    uint32_t z;
+    if(!base)
+        {
+        for(k = 0; k < p->nfields; k++) PutBits(w, q[k], p->bits[k]);
+        return;
+        }
+    for(k = 0; k < p->nfields; k++)
+        if(q[k] != base[k]) break;
+    if(k == p->nfields) { PutBits(w, 0, 1); return; } /* unchanged body */
+    PutBits(w, 1, 1);
+    for(k = 0; k < p->nfields; k++)
+        {
+        if(q[k] == base[k]) { PutBits(w, 0, 1); continue; }
+        d = (int32_t)(q[k] - base[k]);
+        z = ZigZag(d);
+        db = DeltaBits(p->bits[k]);
+        if(z < (1U << db))
+            { PutBits(w, 1, 2); PutBits(w, z, db); } /* '10' (LSB first) */
+        else
+            { PutBits(w, 3, 2); PutBits(w, q[k], p->bits[k]); } /* '11' */
+        }
+    }
+
+static int DecodeState(bitreader_t *r, const qparams_t *p, uint32_t *q, const uint32_t *base)
+    {
+    int k;
+    uint32_t flag, z;
+    if(!base)
+        {
+        for(k = 0; k < p->nfields; k++)
+            if(GetBits_(r, p->bits[k], &q[k]) != 0) return -1;
+        return 0;
+        }
+    if(GetBits_(r, 1, &flag) != 0) return -1;
+    if(!flag)
+        { memcpy(q, base, p->nfields*sizeof(uint32_t)); return 0; }
+    for(k = 0; k < p->nfields; k++)
+        {
+        q[k] = base[k];
+        if(GetBits_(r, 1, &flag) != 0) return -1;
+        if(!flag) continue;
+        if(GetBits_(r, 1, &flag) != 0) return -1;
+        if(!flag)
+            {
+            if(GetBits_(r, DeltaBits(p->bits[k]), &z) != 0) return -1;
+            q[k] = base[k] + (uint32_t)UnZigZag(z);
+            }
+        else if(GetBits_(r, p->bits[k], &q[k]) != 0) return -1;
+        }
+    return 0;
+    }
+
+static body_t BodyAt(lua_State *L, int arg, int i)
+    {
+    body_t body;
+    lua_rawgeti(L, arg, i);
+    body = checkbody(L, -1, NULL);
+    lua_pop(L, 1);
+    return body;
+    }
+
+static void CheckSnapshots(lua_State *L, buffer_t buffer, buffer_t *snapshot, buffer_t *baseline)
+/* snapshot (arg 5) and baseline (arg 6), if given, must be distinct from each other and from buffer */
+    {
+    *snapshot = optbuffer(L, 5, NULL);
+    *baseline = optbuffer(L, 6, NULL);
+    if(*snapshot && (*snapshot == buffer || *snapshot == *baseline))
+        argerror(L, 5, ERR_VALUE);
+    if(*baseline && *baseline == buffer)
+        argerror(L, 6, ERR_VALUE);
+    }
+
+static int EncodeBodyStates(lua_State *L)
+/* nextoffset = encode_body_states({body}, buffer, offset, params, [snapshot], [baseline]) */
+    {
+    int i, n, k;
+    qparams_t p;
+    bitwriter_t w;
+    uint32_t q[QMAXFIELDS], *snapshot = NULL, *baseline = NULL;
+    size_t maxbits;
+    buffer_t snapbuf, basebuf;
+    buffer_t buffer = checkbuffer(L, 2, NULL);
+    size_t offset = checkoffset(L, 3);
+    if(!lua_istable(L, 1)) return argerror(L, 1, ERR_TABLE);
+    CheckQuantParams(L, 4, &p);
+    CheckSnapshots(L, buffer, &snapbuf, &basebuf);
+    n = luaL_len(L, 1);
+    maxbits = 1;
+    for(k = 0; k < p.nfields; k++) maxbits += 2 + p.bits[k];
+    memset(&w, 0, sizeof(w));
+    w.data = (uint8_t*)bufferreserve(L, buffer, offset, (n*maxbits + 7)/8);
+    if(snapbuf)
+        snapshot = (uint32_t*)bufferreserve(L, snapbuf, 0, n*p.nfields*sizeof(uint32_t));
+    if(basebuf)
+        baseline = (uint32_t*)bufferptr(L, basebuf, 0, n*p.nfields*sizeof(uint32_t), 6);
+    for(i = 0; i < n; i++)
+        {
+        QuantizeState(BodyAt(L, 1, i+1), &p, q);
+        EncodeState(&w, &p, q, baseline ? baseline + i*p.nfields : NULL);
+        if(snapshot) memcpy(snapshot + i*p.nfields, q, p.nfields*sizeof(uint32_t));
+        }
+    FlushBits(&w);
+    lua_pushinteger(L, offset + w.len);
+    return 1;
+    }
+
+static int DecodeBodyStates(lua_State *L)
+/* nextoffset = decode_body_states({body}, buffer, offset, params, [snapshot], [baseline]) */
+    {
+    int i, n;
+    qparams_t p;
+    bitreader_t r;
+    uint32_t q[QMAXFIELDS], *snapshot = NULL, *baseline = NULL;
+    buffer_t snapbuf, basebuf;
+    buffer_t buffer = checkbuffer(L, 2, NULL);
+    size_t offset = checkoffset(L, 3);
+    if(!lua_istable(L, 1)) return argerror(L, 1, ERR_TABLE);
+    CheckQuantParams(L, 4, &p);
+    CheckSnapshots(L, buffer, &snapbuf, &basebuf);
+    n = luaL_len(L, 1);
+    if(snapbuf)
+        snapshot = (uint32_t*)bufferreserve(L, snapbuf, 0, n*p.nfields*sizeof(uint32_t));
+    if(basebuf)
+        baseline = (uint32_t*)bufferptr(L, basebuf, 0, n*p.nfields*sizeof(uint32_t), 6);
+    memset(&r, 0, sizeof(r));
+    r.data = (const uint8_t*)bufferptr(L, buffer, offset, 0, 3);
+    r.size = buffer->size - offset;
+    for(i = 0; i < n; i++)
+        {
+        if(DecodeState(&r, &p, q, baseline ? baseline + i*p.nfields : NULL) != 0)
+            return argerror(L, 2, ERR_LENGTH);
+        ApplyState(BodyAt(L, 1, i+1), &p, q);
+        if(snapshot) memcpy(snapshot + i*p.nfields, q, p.nfields*sizeof(uint32_t));
+        }
+    lua_pushinteger(L, offset + r.len);
+    return 1;
     }
 
 /*-----------------------------------------------------------------------------*/
@@ -305,14 +998,13 @@ int testdata(lua_State *L, int type, size_t n, void *dst, size_t dstsize)
     }
 
 int checkdata(lua_State *L, int arg, int type, void *dst, size_t dstsize)
+/* packs the values in the argument arg (a number or a, possibly nested, table)
+ * in dst, that must point to dstsize bytes of memory */
     {
-    size_t n = toflattable(L, arg);
-    int err = testdata(L, type, n, dst, dstsize);
+    size_t count;
+    int err = packdata(L, type, arg, arg, dst, dstsize/sizeoftype(type), &count);
     if(err)
-        {
-        lua_pop(L, 1); /* flat table */
         return luaL_argerror(L, arg, errstring(err));
-        }
     return 0;
     }
 
@@ -330,6 +1022,9 @@ static const struct luaL_Reg Functions[] =
         { "sizeof", Sizeof },
         { "pack", Pack },
         { "unpack", Unpack },
+        { "convert", Convert },
+        { "encode_body_states", EncodeBodyStates },
+        { "decode_body_states", DecodeBodyStates },
         { NULL, NULL } /* sentinel */
     };
 
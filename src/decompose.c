@@ -0,0 +1,811 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+#include <stdio.h>
+#include <float.h>
+#include <limits.h>
+
+/* Approximate convex decomposition of triangle meshes (V-HACD style).
+ *
+ * The mesh is voxelized (surface voxels, plus the interior voxels found by parity along
+ * vertical columns if the mesh is closed), and the set of voxels is split recursively
+ * by axis-aligned planes. At each step the most concave part is split, at the plane
+ * (among a few candidates per axis) that minimizes the total volume of the convex hulls
+ * of the two halves, until all parts are within the concavity threshold or the max no.
+ * of parts is reached. The concavity of a part is the difference between the volume of
+ * its convex hull and its own volume, relative to the volume of the whole mesh.
+ * Each part is finally replaced by the convex hull of the mesh vertices it contains and
+ * of the centers of its boundary voxels.
+ *
+ * The resulting hulls can be saved in a cache file, together with a hash of the input
+ * mesh and of the parameters, so that the decomposition runs only once.
+ */
+
+typedef struct {
+    int maxparts;
+    double concavity; /* relative to the volume of the mesh */
+    int maxvertices; /* per hull (0 = unlimited) */
+    int resolution; /* no. of voxels along the longest side of the bounding box */
+} params_t;
+
+typedef struct {
+    int *voxels; /* indices of the voxels in the part */
+    int nvoxels;
+    double concavity;
+} part_t;
+
+typedef struct {
+    lua_State *L;
+    params_t params;
+    double *pts; /* mesh vertices, 3 doubles each */
+    int npts;
+    const uint32_t *indices;
+    int ntris;
+    double origin[3]; /* corner of the voxel grid */
+    double h; /* voxel size */
+    int dim[3]; /* no. of voxels along each axis */
+    int *label; /* part each voxel belongs to (-1 = empty) */
+    int nfilled; /* no. of non-empty voxels */
+    double *buf; /* scratch for hull points */
+    int nbuf, bufcap;
+    part_t *parts;
+    int nparts;
+} ctx_t;
+
+#define CANDIDATES 8 /* candidate split planes per axis */
+#define CANDIDATE_MAXVERTICES 64 /* for the hulls used to score the candidate splits */
+
+#define Cell(ctx, i, j, k) ((i) + (ctx)->dim[0]*((j) + (ctx)->dim[1]*(k)))
+#define Coord(ctx, v, axis) ((axis) == 0 ? (v) % (ctx)->dim[0] : \
+                        (axis) == 1 ? ((v) / (ctx)->dim[0]) % (ctx)->dim[1] : \
+                        (v) / ((ctx)->dim[0]*(ctx)->dim[1]))
+
+/*------------------------------------------------------------------------------*
+ | Voxelization                                                                 |
+ *------------------------------------------------------------------------------*/
+
+static int VoxelOf(ctx_t *ctx, const double *p)
+    {
+    int k, c[3];
+    for(k = 0; k < 3; k++)
+        {
+        c[k] = (int)floor((p[k] - ctx->origin[k])/ctx->h);
+        if(c[k] < 0) c[k] = 0;
+        if(c[k] >= ctx->dim[k]) c[k] = ctx->dim[k] - 1;
+        }
+    return Cell(ctx, c[0], c[1], c[2]);
+    }
+
+static void MarkSurface(ctx_t *ctx, const double *v0, const double *v1, const double *v2)
+/* Marks the voxels touched by the triangle, sampling it at half the voxel size */
+    {
+    int a, b, k, m;
+    double e, emax = 0, p[3];
+    for(k = 0; k < 3; k++)
+        {
+        if((e = fabs(v1[k] - v0[k])) > emax) emax = e;
+        if((e = fabs(v2[k] - v0[k])) > emax) emax = e;
+        if((e = fabs(v2[k] - v1[k])) > emax) emax = e;
+        }
+    m = (int)ceil(2*emax/ctx->h) + 1;
+    for(a = 0; a <= m; a++)
+        for(b = 0; b <= m - a; b++)
+            {
+            for(k = 0; k < 3; k++)
+                p[k] = v0[k] + (v1[k] - v0[k])*a/m + (v2[k] - v0[k])*b/m;
+            ctx->label[VoxelOf(ctx, p)] = 0;
+            }
+    }
+
+static int CompareDouble(const void *a, const void *b)
+    {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+    }
+
+static int ColumnCrossing(ctx_t *ctx, int t, int i, int j, double *z)
+/* Checks if the vertical line through the center of column (i, j) crosses triangle t,
+ * and if so computes the z of the crossing */
+    {
+    const double *a = ctx->pts + 3*ctx->indices[3*t];
+    const double *b = ctx->pts + 3*ctx->indices[3*t+1];
+    const double *c = ctx->pts + 3*ctx->indices[3*t+2];
+    /* (the small offset avoids hitting edges and vertices exactly) */
+    double x = ctx->origin[0] + (i + 0.5 + 1e-7)*ctx->h;
+    double y = ctx->origin[1] + (j + 0.5 + 2e-7)*ctx->h;
+    double area = (b[0] - a[0])*(c[1] - a[1]) - (c[0] - a[0])*(b[1] - a[1]);
+    double wa = (b[0] - x)*(c[1] - y) - (c[0] - x)*(b[1] - y);
+    double wb = (c[0] - x)*(a[1] - y) - (a[0] - x)*(c[1] - y);
+    double wc = area - wa - wb;
+    if(area == 0) return 0;
+    if(area < 0) { area = -area; wa = -wa; wb = -wb; wc = -wc; }
+    if(wa < 0 || wb < 0 || wc < 0) return 0;
+    *z = (wa*a[2] + wb*b[2] + wc*c[2])/area;
+    return 1;
+    }
+
+static int FillInterior(ctx_t *ctx)
+/* Marks the voxels whose centers are inside the mesh, by parity of the crossings
+ * along vertical columns (this has no effect if the mesh is not closed) */
+    {
+    int t, i, j, k, n, i0, i1, j0, j1, q, ncols = ctx->dim[0]*ctx->dim[1];
+    int *count, *offset;
+    double *zs, z, lo[2], hi[2], zc;
+    const double *p;
+    count = (int*)MallocNoErr(ctx->L, (ncols + 1)*sizeof(int));
+    offset = (int*)MallocNoErr(ctx->L, (ncols + 1)*sizeof(int));
+    if(!count || !offset)
+        {
+        if(count) Free(ctx->L, count);
+        if(offset) Free(ctx->L, offset);
+        return ERR_MEMORY;
+        }
+    memset(count, 0, (ncols + 1)*sizeof(int));
+    zs = NULL;
+    for(q = 0; q < 2; q++) /* first pass: count crossings; second pass: collect them */
+        {
+        for(t = 0; t < ctx->ntris; t++)
+            {
+            lo[0] = lo[1] = DBL_MAX; hi[0] = hi[1] = -DBL_MAX;
+            for(n = 0; n < 3; n++)
+                {
+                p = ctx->pts + 3*ctx->indices[3*t+n];
+                for(k = 0; k < 2; k++)
+                    {
+                    if(p[k] < lo[k]) lo[k] = p[k];
+                    if(p[k] > hi[k]) hi[k] = p[k];
+                    }
+                }
+            i0 = (int)floor((lo[0] - ctx->origin[0])/ctx->h - 0.5); if(i0 < 0) i0 = 0;
+            i1 = (int)ceil((hi[0] - ctx->origin[0])/ctx->h - 0.5); if(i1 >= ctx->dim[0]) i1 = ctx->dim[0] - 1;
+            j0 = (int)floor((lo[1] - ctx->origin[1])/ctx->h - 0.5); if(j0 < 0) j0 = 0;
+            j1 = (int)ceil((hi[1] - ctx->origin[1])/ctx->h - 0.5); if(j1 >= ctx->dim[1]) j1 = ctx->dim[1] - 1;
+            for(j = j0; j <= j1; j++)
+                for(i = i0; i <= i1; i++)
+                    {
+                    if(!ColumnCrossing(ctx, t, i, j, &z)) continue;
+                    if(q == 0) count[i + ctx->dim[0]*j]++;
+                    else zs[offset[i + ctx->dim[0]*j]++] = z;
+                    }
+            }
+        if(q == 0)
+            {
+            for(i = 0, n = 0; i < ncols; i++) { offset[i] = n; n += count[i]; }
+            offset[ncols] = n;
+            if((zs = (double*)MallocNoErr(ctx->L, (n + 1)*sizeof(double))) == NULL)
+                { Free(ctx->L, count); Free(ctx->L, offset); return ERR_MEMORY; }
+            }
+        }
+    /* (offset[c] now points at the end of column c, i.e. at the start of column c+1) */
+    for(j = 0; j < ctx->dim[1]; j++)
+        for(i = 0; i < ctx->dim[0]; i++)
+            {
+            q = i + ctx->dim[0]*j;
+            n = count[q];
+            if(n < 2) continue;
+            qsort(zs + offset[q] - n, n, sizeof(double), CompareDouble);
+            for(t = offset[q] - n; t + 1 < offset[q]; t += 2)
+                for(k = 0; k < ctx->dim[2]; k++)
+                    {
+                    zc = ctx->origin[2] + (k + 0.5)*ctx->h;
+                    if(zc >= zs[t] && zc <= zs[t+1]) ctx->label[Cell(ctx, i, j, k)] = 0;
+                    }
+            }
+    Free(ctx->L, count);
+    Free(ctx->L, offset);
+    Free(ctx->L, zs);
+    return 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Decomposition                                                                |
+ *------------------------------------------------------------------------------*/
+
+static int PushPoint(ctx_t *ctx, double x, double y, double z)
+    {
+    double *buf;
+    if(ctx->nbuf == ctx->bufcap)
+        {
+        ctx->bufcap = ctx->bufcap ? 2*ctx->bufcap : 1024;
+        if((buf = (double*)MallocNoErr(ctx->L, 3*ctx->bufcap*sizeof(double))) == NULL) return ERR_MEMORY;
+        if(ctx->buf)
+            {
+            memcpy(buf, ctx->buf, 3*ctx->nbuf*sizeof(double));
+            Free(ctx->L, ctx->buf);
+            }
+        ctx->buf = buf;
+        }
+    ctx->buf[3*ctx->nbuf] = x;
+    ctx->buf[3*ctx->nbuf+1] = y;
+    ctx->buf[3*ctx->nbuf+2] = z;
+    ctx->nbuf++;
+    return 0;
+    }
+
+static int SameSet(ctx_t *ctx, int v, int nb, int axis, int s)
+/* Checks if voxel nb belongs to the same part of v and, if axis >= 0, lies on the same
+ * side of the plane s along the axis */
+    {
+    if(ctx->label[nb] != ctx->label[v]) return 0;
+    if(axis < 0) return 1;
+    return (Coord(ctx, v, axis) < s) == (Coord(ctx, nb, axis) < s);
+    }
+
+static int IsBoundary(ctx_t *ctx, int v, int axis, int s)
+    {
+    int k, c, step;
+    for(k = 0; k < 3; k++)
+        {
+        c = Coord(ctx, v, k);
+        step = k == 0 ? 1 : k == 1 ? ctx->dim[0] : ctx->dim[0]*ctx->dim[1];
+        if(c == 0 || !SameSet(ctx, v, v - step, axis, s)) return 1;
+        if(c == ctx->dim[k] - 1 || !SameSet(ctx, v, v + step, axis, s)) return 1;
+        }
+    return 0;
+    }
+
+static int CollectPoints(ctx_t *ctx, const part_t *part, int axis, int s, int side, int corners)
+/* Collects in ctx->buf the corners (or the centers) of the boundary voxels of the part
+ * or, if axis >= 0, of its subset on the given side of plane s */
+    {
+    int i, v, c[3], dx, dy, dz;
+    double x, y, z;
+    ctx->nbuf = 0;
+    for(i = 0; i < part->nvoxels; i++)
+        {
+        v = part->voxels[i];
+        if(axis >= 0 && (Coord(ctx, v, axis) < s) != side) continue;
+        if(!IsBoundary(ctx, v, axis, s)) continue;
+        c[0] = Coord(ctx, v, 0); c[1] = Coord(ctx, v, 1); c[2] = Coord(ctx, v, 2);
+        x = ctx->origin[0] + c[0]*ctx->h;
+        y = ctx->origin[1] + c[1]*ctx->h;
+        z = ctx->origin[2] + c[2]*ctx->h;
+        if(!corners)
+            {
+            if(PushPoint(ctx, x + ctx->h/2, y + ctx->h/2, z + ctx->h/2) != 0) return ERR_MEMORY;
+            continue;
+            }
+        for(dz = 0; dz < 2; dz++)
+            for(dy = 0; dy < 2; dy++)
+                for(dx = 0; dx < 2; dx++)
+                    if(PushPoint(ctx, x + dx*ctx->h, y + dy*ctx->h, z + dz*ctx->h) != 0)
+                        return ERR_MEMORY;
+        }
+    return 0;
+    }
+
+static double Volume(const hull_t *hull)
+/* Sum of the volumes of the pyramids with base on the polygons and apex at the origin */
+    {
+    int i, j, k, len;
+    double vol = 0, n[3];
+    const double *u, *v;
+    for(i = 0, k = 0; i < hull->polygonslen; i += len + 1, k++)
+        {
+        len = hull->polygons[i];
+        n[0] = n[1] = n[2] = 0;
+        for(j = 0; j < len; j++)
+            {
+            u = hull->points + 3*hull->polygons[i + 1 + j];
+            v = hull->points + 3*hull->polygons[i + 1 + (j + 1) % len];
+            n[0] += u[1]*v[2] - u[2]*v[1];
+            n[1] += u[2]*v[0] - u[0]*v[2];
+            n[2] += u[0]*v[1] - u[1]*v[0];
+            }
+        /* area = |n|/2, and n is parallel to the plane's normal */
+        vol += (n[0]*hull->planes[4*k] + n[1]*hull->planes[4*k+1] + n[2]*hull->planes[4*k+2])
+                    * hull->planes[4*k+3] / 6;
+        }
+    return vol;
+    }
+
+static int HullVolume(ctx_t *ctx, const part_t *part, int axis, int s, int side, int maxvertices, double *vol)
+/* Computes the volume of the hull of the voxels of the part (or of its subset on the
+ * given side of plane s, if axis >= 0) */
+    {
+    int err;
+    hull_t hull;
+    if((err = CollectPoints(ctx, part, axis, s, side, 1)) != 0) return err;
+    if((err = hull_build(ctx->L, ctx->buf, ctx->nbuf, 0, maxvertices, &hull)) != 0) return err;
+    *vol = Volume(&hull);
+    hull_free(ctx->L, &hull);
+    return 0;
+    }
+
+static int Concavity(ctx_t *ctx, part_t *part)
+    {
+    int err;
+    double vol;
+    if((err = HullVolume(ctx, part, -1, 0, 0, 0, &vol)) != 0) return err;
+    part->concavity = (vol - part->nvoxels*ctx->h*ctx->h*ctx->h) / (ctx->nfilled*ctx->h*ctx->h*ctx->h);
+    return 0;
+    }
+
+static int Split(ctx_t *ctx, int index)
+/* Splits the part at the best candidate plane, appending the second half to the parts.
+ * Returns 0 on success, 1 if no valid split was found, or ERR_MEMORY */
+    {
+    int i, k, v, axis, s, lo, hi, na, err, bestaxis = -1, bests = 0;
+    double va, vb, score, bestscore = DBL_MAX;
+    part_t *part = &ctx->parts[index], a, b;
+    for(axis = 0; axis < 3; axis++)
+        {
+        lo = INT_MAX; hi = -1;
+        for(i = 0; i < part->nvoxels; i++)
+            {
+            v = Coord(ctx, part->voxels[i], axis);
+            if(v < lo) lo = v;
+            if(v > hi) hi = v;
+            }
+        for(k = 1; k <= CANDIDATES; k++)
+            {
+            s = lo + ((hi - lo + 1)*k)/(CANDIDATES + 1);
+            if(s <= lo || s > hi) continue;
+            if(k > 1 && s == lo + ((hi - lo + 1)*(k-1))/(CANDIDATES + 1)) continue; /* duplicate */
+            err = HullVolume(ctx, part, axis, s, 1, CANDIDATE_MAXVERTICES, &va);
+            if(err == ERR_MEMORY) return err;
+            if(err) continue;
+            err = HullVolume(ctx, part, axis, s, 0, CANDIDATE_MAXVERTICES, &vb);
+            if(err == ERR_MEMORY) return err;
+            if(err) continue;
+            score = va + vb;
+            if(score < bestscore) { bestscore = score; bestaxis = axis; bests = s; }
+            }
+        }
+    if(bestaxis < 0) return 1;
+    for(i = 0, na = 0; i < part->nvoxels; i++)
+        if(Coord(ctx, part->voxels[i], bestaxis) < bests) na++;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    a.voxels = (int*)MallocNoErr(ctx->L, na*sizeof(int));
+    b.voxels = (int*)MallocNoErr(ctx->L, (part->nvoxels - na)*sizeof(int));
+    if(!a.voxels || !b.voxels)
+        {
+        if(a.voxels) Free(ctx->L, a.voxels);
+        if(b.voxels) Free(ctx->L, b.voxels);
+        return ERR_MEMORY;
+        }
+    for(i = 0; i < part->nvoxels; i++)
+        {
+        v = part->voxels[i];
+        if(Coord(ctx, v, bestaxis) < bests)
+            a.voxels[a.nvoxels++] = v;
+        else
+            {
+            b.voxels[b.nvoxels++] = v;
+            ctx->label[v] = ctx->nparts;
+            }
+        }
+    Free(ctx->L, part->voxels);
+    ctx->parts[index] = a;
+    ctx->parts[ctx->nparts++] = b;
+    if((err = Concavity(ctx, &ctx->parts[index])) == ERR_MEMORY) return err;
+    if(err) ctx->parts[index].concavity = 0; /* degenerate (flat): cannot be split further */
+    if((err = Concavity(ctx, &ctx->parts[ctx->nparts-1])) == ERR_MEMORY) return err;
+    if(err) ctx->parts[ctx->nparts-1].concavity = 0;
+    return 0;
+    }
+
+static int Decompose(ctx_t *ctx)
+    {
+    int i, k, err;
+    part_t *part = &ctx->parts[0];
+    part->voxels = (int*)MallocNoErr(ctx->L, ctx->nfilled*sizeof(int));
+    if(!part->voxels) return ERR_MEMORY;
+    for(i = 0, k = ctx->dim[0]*ctx->dim[1]*ctx->dim[2]; i < k; i++)
+        if(ctx->label[i] == 0) part->voxels[part->nvoxels++] = i;
+    ctx->nparts = 1;
+    if((err = Concavity(ctx, part)) != 0) return err;
+    while(ctx->nparts < ctx->params.maxparts)
+        {
+        /* split the most concave part */
+        k = 0;
+        for(i = 1; i < ctx->nparts; i++)
+            if(ctx->parts[i].concavity > ctx->parts[k].concavity) k = i;
+        if(ctx->parts[k].concavity <= ctx->params.concavity) break;
+        err = Split(ctx, k);
+        if(err < 0) return err;
+        if(err > 0) ctx->parts[k].concavity = 0; /* cannot be split */
+        }
+    return 0;
+    }
+
+static int FinalHull(ctx_t *ctx, int index, hull_t *hull)
+/* Computes the hull of the part's mesh vertices and boundary voxels centers */
+    {
+    int i, err;
+    part_t *part = &ctx->parts[index];
+    if((err = CollectPoints(ctx, part, -1, 0, 0, 0)) != 0) return err;
+    for(i = 0; i < ctx->npts; i++)
+        if(ctx->label[VoxelOf(ctx, ctx->pts + 3*i)] == index &&
+            (err = PushPoint(ctx, ctx->pts[3*i], ctx->pts[3*i+1], ctx->pts[3*i+2])) != 0) return err;
+    err = hull_build(ctx->L, ctx->buf, ctx->nbuf, 0, ctx->params.maxvertices, hull);
+    if(err == 0 || err == ERR_MEMORY) return err;
+    /* degenerate (e.g. a flat part one voxel thick): use the voxel corners instead */
+    if((err = CollectPoints(ctx, part, -1, 0, 0, 1)) != 0) return err;
+    return hull_build(ctx->L, ctx->buf, ctx->nbuf, 0, ctx->params.maxvertices, hull);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Cache file                                                                   |
+ *------------------------------------------------------------------------------*/
+
+/* Header of cache files, followed by partcount hulls, each made of a hullheader_t
+ * followed by the planes (4 doubles each), the points (3 doubles each) and the
+ * polygons (polygonslen uint32) */
+typedef struct {
+    char magic[4]; /* "MOCX" */
+    uint32_t version; /* = 1 */
+    uint32_t partcount;
+    uint32_t reserved;
+    uint64_t hash; /* of the input mesh and parameters */
+} fileheader_t;
+
+typedef struct {
+    uint32_t planecount;
+    uint32_t pointcount;
+    uint32_t polygonslen;
+    uint32_t reserved;
+} hullheader_t;
+
+#define FILE_MAGIC "MOCX"
+#define FILE_VERSION 1
+
+static uint64_t Hash(uint64_t h, const void *data, size_t len)
+/* FNV-1a */
+    {
+    size_t i;
+    const unsigned char *p = (const unsigned char*)data;
+    for(i = 0; i < len; i++) { h ^= p[i]; h *= 0x100000001b3ULL; }
+    return h;
+    }
+
+static uint64_t InputHash(ctx_t *ctx)
+    {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = Hash(h, ctx->pts, 3*ctx->npts*sizeof(double));
+    h = Hash(h, ctx->indices, 3*ctx->ntris*sizeof(uint32_t));
+    h = Hash(h, &ctx->params.maxparts, sizeof(int));
+    h = Hash(h, &ctx->params.concavity, sizeof(double));
+    h = Hash(h, &ctx->params.maxvertices, sizeof(int));
+    h = Hash(h, &ctx->params.resolution, sizeof(int));
+    return h;
+    }
+
+static void FreeHulls(lua_State *L, hull_t *hulls, int count)
+    {
+    int i;
+    for(i = 0; i < count; i++) hull_free(L, &hulls[i]);
+    Free(L, hulls);
+    }
+
+/* Limits for the counts read from cache files (way above what the decomposition produces) */
+#define CACHE_MAX_PARTS 65536
+#define CACHE_MAX_COUNT 1048576
+
+static int CheckPolygons(const hull_t *hull)
+/* Checks that the polygons are consistent with the points and planes */
+    {
+    int i, j, n, count = 0;
+    for(i = 0; i < hull->polygonslen; i += n + 1)
+        {
+        n = hull->polygons[i];
+        if(n < 3 || n > hull->polygonslen - i - 1) return 0;
+        for(j = 1; j <= n; j++)
+            if(hull->polygons[i + j] >= (unsigned int)hull->pointcount) return 0;
+        count++;
+        }
+    return count == hull->planecount;
+    }
+
+static int LoadCache(lua_State *L, const char *filename, uint64_t hash, hull_t **hullsp, int *countp)
+/* Returns 0 on success, or 1 if the file does not exist, does not match the input,
+ * or is not valid */
+    {
+    FILE *f;
+    fileheader_t header;
+    hullheader_t hh;
+    hull_t *hulls, *hull;
+    int i, ok = 1;
+    if((f = fopen(filename, "rb")) == NULL) return 1;
+    if(fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, FILE_MAGIC, 4) != 0 ||
+        header.version != FILE_VERSION || header.hash != hash || header.partcount == 0 ||
+        header.partcount > CACHE_MAX_PARTS)
+        { fclose(f); return 1; }
+    hulls = (hull_t*)MallocNoErr(L, (size_t)header.partcount*sizeof(hull_t));
+    if(!hulls) { fclose(f); return 1; }
+    memset(hulls, 0, (size_t)header.partcount*sizeof(hull_t));
+    for(i = 0; ok && i < (int)header.partcount; i++)
+        {
+        hull = &hulls[i];
+        if(fread(&hh, sizeof(hh), 1, f) != 1 ||
+            hh.planecount == 0 || hh.planecount > CACHE_MAX_COUNT ||
+            hh.pointcount == 0 || hh.pointcount > CACHE_MAX_COUNT ||
+            hh.polygonslen == 0 || hh.polygonslen > CACHE_MAX_COUNT) { ok = 0; break; }
+        hull->planes = (double*)MallocNoErr(L, (size_t)hh.planecount*4*sizeof(double));
+        hull->points = (double*)MallocNoErr(L, (size_t)hh.pointcount*3*sizeof(double));
+        hull->polygons = (unsigned int*)MallocNoErr(L, (size_t)hh.polygonslen*sizeof(unsigned int));
+        hull->planecount = hh.planecount;
+        hull->pointcount = hh.pointcount;
+        hull->polygonslen = hh.polygonslen;
+        ok = hull->planes && hull->points && hull->polygons &&
+            fread(hull->planes, 4*sizeof(double), hh.planecount, f) == hh.planecount &&
+            fread(hull->points, 3*sizeof(double), hh.pointcount, f) == hh.pointcount &&
+            fread(hull->polygons, sizeof(unsigned int), hh.polygonslen, f) == hh.polygonslen &&
+            CheckPolygons(hull);
+        }
+    fclose(f);
+    if(!ok) { FreeHulls(L, hulls, header.partcount); return 1; }
+    *hullsp = hulls;
+    *countp = header.partcount;
+    return 0;
+    }
+
+static int SaveCache(const char *filename, uint64_t hash, const hull_t *hulls, int count)
+/* Returns ERR_xxx on failure, 0 on success */
+    {
+    FILE *f;
+    fileheader_t header;
+    hullheader_t hh;
+    const hull_t *hull;
+    int i, ok;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FILE_MAGIC, 4);
+    header.version = FILE_VERSION;
+    header.partcount = count;
+    header.hash = hash;
+    if((f = fopen(filename, "wb")) == NULL) return ERR_FOPEN;
+    ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for(i = 0; ok && i < count; i++)
+        {
+        hull = &hulls[i];
+        memset(&hh, 0, sizeof(hh));
+        hh.planecount = hull->planecount;
+        hh.pointcount = hull->pointcount;
+        hh.polygonslen = hull->polygonslen;
+        ok = fwrite(&hh, sizeof(hh), 1, f) == 1 &&
+            fwrite(hull->planes, 4*sizeof(double), hh.planecount, f) == hh.planecount &&
+            fwrite(hull->points, 3*sizeof(double), hh.pointcount, f) == hh.pointcount &&
+            fwrite(hull->polygons, sizeof(unsigned int), hh.polygonslen, f) == hh.polygonslen;
+        }
+    if(fclose(f) != 0) ok = 0;
+    return ok ? 0 : ERR_OPERATION;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Lua API                                                                      |
+ *------------------------------------------------------------------------------*/
+
+static int GetInteger(lua_State *L, int arg, const char *name, int defval)
+    {
+    int val;
+    lua_getfield(L, arg, name);
+    val = lua_isnoneornil(L, -1) ? defval : luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    return val;
+    }
+
+static double GetNumber(lua_State *L, int arg, const char *name, double defval)
+    {
+    double val;
+    lua_getfield(L, arg, name);
+    val = lua_isnoneornil(L, -1) ? defval : luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+    return val;
+    }
+
+static const char *CheckParams(lua_State *L, int arg, params_t *params)
+/* Returns the cache filename, if any */
+    {
+    const char *cache = NULL;
+    params->maxparts = 16;
+    params->concavity = 0.01;
+    params->maxvertices = 64;
+    params->resolution = 40;
+    if(lua_isnoneornil(L, arg)) return NULL;
+    if(!lua_istable(L, arg)) { argerror(L, arg, ERR_TABLE); return NULL; }
+    params->maxparts = GetInteger(L, arg, "maxparts", params->maxparts);
+    params->concavity = GetNumber(L, arg, "concavity", params->concavity);
+    params->maxvertices = GetInteger(L, arg, "maxvertices", params->maxvertices);
+    params->resolution = GetInteger(L, arg, "resolution", params->resolution);
+    if(params->maxparts < 1 || params->concavity < 0 || params->resolution < 4 || params->resolution > 512 ||
+        params->maxvertices < 0 || (params->maxvertices > 0 && params->maxvertices < 4))
+        { argerror(L, arg, ERR_RANGE); return NULL; }
+    lua_getfield(L, arg, "cache");
+    if(!lua_isnoneornil(L, -1)) cache = luaL_checkstring(L, -1);
+    lua_pop(L, 1); /* (the string is still referenced by the params table) */
+    return cache;
+    }
+
+static void FreeCtx(ctx_t *ctx)
+    {
+    int i;
+    lua_State *L = ctx->L;
+    if(ctx->pts) Free(L, ctx->pts);
+    if(ctx->label) Free(L, ctx->label);
+    if(ctx->buf) Free(L, ctx->buf);
+    if(ctx->parts)
+        {
+        for(i = 0; i < ctx->nparts; i++)
+            if(ctx->parts[i].voxels) Free(L, ctx->parts[i].voxels);
+        Free(L, ctx->parts);
+        }
+    }
+
+static int Init(ctx_t *ctx, int vertextype, const void *positions, int pcount, const uint32_t *indices, int icount)
+/* Returns 0 on success, or ERR_xxx */
+    {
+    int i, k, ncells;
+    double lo[3], hi[3], extent = 0;
+    ctx->npts = pcount;
+    ctx->indices = indices;
+    ctx->ntris = icount/3;
+    if(ctx->ntris == 0) return ERR_EMPTY;
+    for(i = 0; i < icount; i++)
+        if(indices[i] >= (uint32_t)pcount) return ERR_BOUNDARIES;
+    ctx->pts = (double*)MallocNoErr(ctx->L, 3*pcount*sizeof(double));
+    ctx->parts = (part_t*)MallocNoErr(ctx->L, ctx->params.maxparts*sizeof(part_t));
+    if(!ctx->pts || !ctx->parts) return ERR_MEMORY;
+    memset(ctx->parts, 0, ctx->params.maxparts*sizeof(part_t));
+    for(i = 0; i < 3*pcount; i++)
+        ctx->pts[i] = vertextype == DATATYPE_FLOAT ? ((const float*)positions)[i] : ((const double*)positions)[i];
+    /* voxel grid */
+    for(k = 0; k < 3; k++) { lo[k] = DBL_MAX; hi[k] = -DBL_MAX; }
+    for(i = 0; i < pcount; i++)
+        for(k = 0; k < 3; k++)
+            {
+            if(ctx->pts[3*i+k] < lo[k]) lo[k] = ctx->pts[3*i+k];
+            if(ctx->pts[3*i+k] > hi[k]) hi[k] = ctx->pts[3*i+k];
+            }
+    for(k = 0; k < 3; k++)
+        if(hi[k] - lo[k] > extent) extent = hi[k] - lo[k];
+    if(extent <= 0) return ERR_VALUE;
+    ctx->h = extent/ctx->params.resolution;
+    for(k = 0; k < 3; k++)
+        {
+        ctx->dim[k] = (int)floor((hi[k] - lo[k])/ctx->h) + 1;
+        ctx->origin[k] = (lo[k] + hi[k] - ctx->dim[k]*ctx->h)/2; /* centered */
+        }
+    ncells = ctx->dim[0]*ctx->dim[1]*ctx->dim[2];
+    if((ctx->label = (int*)MallocNoErr(ctx->L, ncells*sizeof(int))) == NULL) return ERR_MEMORY;
+    for(i = 0; i < ncells; i++) ctx->label[i] = -1;
+    for(i = 0; i < ctx->ntris; i++)
+        MarkSurface(ctx, ctx->pts + 3*indices[3*i], ctx->pts + 3*indices[3*i+1], ctx->pts + 3*indices[3*i+2]);
+    if(FillInterior(ctx) != 0) return ERR_MEMORY;
+    ctx->nfilled = 0;
+    for(i = 0; i < ncells; i++)
+        if(ctx->label[i] == 0) ctx->nfilled++;
+    return 0;
+    }
+
+typedef struct {
+    hull_t *hulls;
+    int count;
+    convexdata_t data; /* created but not yet owned by a Lua object */
+} conv_t;
+
+static int ConvexDatas(lua_State *L)
+/* Creates a table with a convexdata for each hull in the conv_t at index 1 */
+    {
+    int i;
+    conv_t *conv = (conv_t*)lua_touserdata(L, 1);
+    lua_newtable(L);
+    for(i = 0; i < conv->count; i++)
+        {
+        conv->data = convexdatafromhull(L, &conv->hulls[i]);
+        newconvexdata(L, conv->data);
+        conv->data = NULL;
+        lua_rawseti(L, -2, i+1);
+        }
+    return 1;
+    }
+
+static int DecomposeConvex(lua_State *L)
+/* convexdatas, cached = decompose_convex(tmdata | mesh, [params]) */
+    {
+    int i, err, saveerr = 0, vertextype, pcount, icount, count = 0, cached = 0;
+    const void *positions;
+    const uint32_t *indices;
+    const char *cache;
+    uint64_t hash = 0;
+    hull_t *hulls = NULL;
+    ctx_t ctx;
+    conv_t conv;
+    ud_t *ud;
+    mesh_t mesh;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.L = L;
+    if(testtmdata(L, 1, &ud))
+        tmdata_getdata(ud, &vertextype, &pcount, &positions, &icount, &indices);
+    else
+        {
+        mesh = checkmesh(L, 1, NULL);
+        vertextype = mesh->vertextype;
+        pcount = mesh->pcount;
+        positions = mesh->positions;
+        icount = mesh->icount;
+        indices = (const uint32_t*)mesh->indices;
+        }
+    cache = CheckParams(L, 2, &ctx.params);
+    err = Init(&ctx, vertextype, positions, pcount, indices, icount);
+    if(err) { FreeCtx(&ctx); return err == ERR_MEMORY ? errmemory(L) : argerror(L, 1, err); }
+    if(cache)
+        {
+        hash = InputHash(&ctx);
+        cached = (LoadCache(L, cache, hash, &hulls, &count) == 0);
+        }
+    if(!cached)
+        {
+        if((err = Decompose(&ctx)) == 0)
+            {
+            hulls = (hull_t*)MallocNoErr(L, ctx.nparts*sizeof(hull_t));
+            if(!hulls) err = ERR_MEMORY;
+            else memset(hulls, 0, ctx.nparts*sizeof(hull_t));
+            }
+        for(i = 0; err == 0 && i < ctx.nparts; i++)
+            {
+            err = FinalHull(&ctx, i, &hulls[count]);
+            if(err == 0) count++;
+            else if(err != ERR_MEMORY) err = 0; /* degenerate part (e.g. flat): skip it */
+            }
+        if(err == 0 && count == 0) err = ERR_VALUE;
+        if(err == 0 && cache) saveerr = SaveCache(cache, hash, hulls, count);
+        }
+    FreeCtx(&ctx);
+    if(err || saveerr)
+        {
+        if(hulls) FreeHulls(L, hulls, count);
+        if(err == ERR_MEMORY) return errmemory(L);
+        if(err) return argerror(L, 1, err);
+        return luaL_error(L, "%s '%s'", errstring(saveerr), cache);
+        }
+    /* create the convexdata objects in protected mode, so to release the hulls on error */
+    memset(&conv, 0, sizeof(conv));
+    conv.hulls = hulls;
+    conv.count = count;
+    lua_pushcfunction(L, ConvexDatas);
+    lua_pushlightuserdata(L, &conv);
+    if(lua_pcall(L, 1, 1, 0) != LUA_OK)
+        {
+        if(conv.data) convexdataunref(L, conv.data);
+        FreeHulls(L, hulls, count); /* (those already converted are empty) */
+        return lua_error(L);
+        }
+    Free(L, hulls);
+    lua_pushboolean(L, cached);
+    return 2;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "decompose_convex", DecomposeConvex },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_decompose(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,443 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+
+/* Distance queries between convex geoms, using the GJK algorithm.
+ *
+ * Each shape is represented by its support mapping in world coordinates. Spheres and
+ * capsules are treated as a point and a segment ('core' shapes) with a margin equal to
+ * their radius, which makes GJK converge exactly for them instead of approximating
+ * their curved surfaces. If the core shapes overlap, the geoms are overlapping and
+ * no distance is computed (use collide() for penetration).
+ */
+
+#define GJK_MAX_ITERATIONS 64
+#define GJK_REL_TOLERANCE 1e-8 /* relative, on the squared distance */
+#define GJK_ABS_TOLERANCE 1e-20 /* absolute, on the squared distance */
+
+enum { SHAPE_POINT, SHAPE_SEGMENT, SHAPE_BOX, SHAPE_CYLINDER, SHAPE_CONVEX };
+
+typedef struct {
+    int type;
+    double pos[3];
+    double R[12]; /* rotation (ODE layout, 3x4) */
+    double margin;
+    double half[3]; /* box half sides, or radius and half length (cylinder, segment) */
+    const double *points; /* convex points (local coordinates) */
+    int count;
+} shape_t;
+
+typedef struct {
+    int n;
+    double w[4][3]; /* vertices of the Minkowski difference A - B */
+    double a[4][3], b[4][3]; /* corresponding support points on A and B */
+    double l[4]; /* barycentric coordinates of the closest point */
+} simplex_t;
+
+#define Dot(u, v) ((u)[0]*(v)[0] + (u)[1]*(v)[1] + (u)[2]*(v)[2])
+#define Sub(d, u, v) do { (d)[0]=(u)[0]-(v)[0]; (d)[1]=(u)[1]-(v)[1]; (d)[2]=(u)[2]-(v)[2]; } while(0)
+#define Cross(d, u, v) do {                     \
+    (d)[0] = (u)[1]*(v)[2] - (u)[2]*(v)[1];     \
+    (d)[1] = (u)[2]*(v)[0] - (u)[0]*(v)[2];     \
+    (d)[2] = (u)[0]*(v)[1] - (u)[1]*(v)[0];     \
+} while(0)
+
+/*------------------------------------------------------------------------------*
+ | Support mappings                                                             |
+ *------------------------------------------------------------------------------*/
+
+static void Support(const shape_t *s, const double d[3], double out[3])
+/* Computes the point of the (core) shape farthest along the direction d */
+    {
+    int i, k;
+    double dl[3], p[3], rho, dot, maxdot;
+    const double *R = s->R;
+    /* direction in local coordinates (R^T d) */
+    dl[0] = R[0]*d[0] + R[4]*d[1] + R[8]*d[2];
+    dl[1] = R[1]*d[0] + R[5]*d[1] + R[9]*d[2];
+    dl[2] = R[2]*d[0] + R[6]*d[1] + R[10]*d[2];
+    switch(s->type)
+        {
+        case SHAPE_POINT:
+            out[0] = s->pos[0]; out[1] = s->pos[1]; out[2] = s->pos[2];
+            return;
+        case SHAPE_SEGMENT: /* along the local z axis */
+            p[0] = p[1] = 0;
+            p[2] = dl[2] < 0 ? -s->half[1] : s->half[1];
+            break;
+        case SHAPE_BOX:
+            for(k = 0; k < 3; k++) p[k] = dl[k] < 0 ? -s->half[k] : s->half[k];
+            break;
+        case SHAPE_CYLINDER: /* along the local z axis */
+            rho = sqrt(dl[0]*dl[0] + dl[1]*dl[1]);
+            if(rho > 0)
+                { p[0] = s->half[0]*dl[0]/rho; p[1] = s->half[0]*dl[1]/rho; }
+            else
+                p[0] = p[1] = 0;
+            p[2] = dl[2] < 0 ? -s->half[1] : s->half[1];
+            break;
+        case SHAPE_CONVEX:
+            k = 0; maxdot = Dot(s->points, dl);
+            for(i = 1; i < s->count; i++)
+                {
+                dot = Dot(s->points + 3*i, dl);
+                if(dot > maxdot) { maxdot = dot; k = i; }
+                }
+            p[0] = s->points[3*k]; p[1] = s->points[3*k+1]; p[2] = s->points[3*k+2];
+            break;
+        default:
+            p[0] = p[1] = p[2] = 0;
+        }
+    /* back to world coordinates */
+    out[0] = s->pos[0] + R[0]*p[0] + R[1]*p[1] + R[2]*p[2];
+    out[1] = s->pos[1] + R[4]*p[0] + R[5]*p[1] + R[6]*p[2];
+    out[2] = s->pos[2] + R[8]*p[0] + R[9]*p[1] + R[10]*p[2];
+    }
+
+/*------------------------------------------------------------------------------*
+ | Closest point of a simplex to the origin                                     |
+ *------------------------------------------------------------------------------*/
+
+static void Vertex(const simplex_t *s, int i, simplex_t *out, int n)
+/* Sets the n-th vertex of out to the i-th vertex of s */
+    {
+    memcpy(out->w[n], s->w[i], 3*sizeof(double));
+    memcpy(out->a[n], s->a[i], 3*sizeof(double));
+    memcpy(out->b[n], s->b[i], 3*sizeof(double));
+    }
+
+static void Reduce1(const simplex_t *s, int i, simplex_t *out)
+    {
+    Vertex(s, i, out, 0);
+    out->l[0] = 1;
+    out->n = 1;
+    }
+
+static void Reduce2(const simplex_t *s, int i, int j, double t, simplex_t *out)
+    {
+    Vertex(s, i, out, 0);
+    Vertex(s, j, out, 1);
+    out->l[0] = 1 - t; out->l[1] = t;
+    out->n = 2;
+    }
+
+static void Segment(const simplex_t *s, int i, int j, simplex_t *out)
+    {
+    double ab[3], t, den;
+    Sub(ab, s->w[j], s->w[i]);
+    den = Dot(ab, ab);
+    t = den > 0 ? -Dot(s->w[i], ab)/den : 0;
+    if(t <= 0) Reduce1(s, i, out);
+    else if(t >= 1) Reduce1(s, j, out);
+    else Reduce2(s, i, j, t, out);
+    }
+
+static void Triangle(const simplex_t *s, int i, int j, int k, simplex_t *out)
+/* Closest point on triangle (Ericson, Real-Time Collision Detection, 5.1.5) */
+    {
+    double ab[3], ac[3], d1, d2, d3, d4, d5, d6, va, vb, vc, v, w, den;
+    const double *a = s->w[i], *b = s->w[j], *c = s->w[k];
+    Sub(ab, b, a);
+    Sub(ac, c, a);
+    d1 = -Dot(ab, a); d2 = -Dot(ac, a);
+    if(d1 <= 0 && d2 <= 0) { Reduce1(s, i, out); return; }
+    d3 = -Dot(ab, b); d4 = -Dot(ac, b);
+    if(d3 >= 0 && d4 <= d3) { Reduce1(s, j, out); return; }
+    vc = d1*d4 - d3*d2;
+    if(vc <= 0 && d1 >= 0 && d3 <= 0) { Reduce2(s, i, j, d1/(d1 - d3), out); return; }
+    d5 = -Dot(ab, c); d6 = -Dot(ac, c);
+    if(d6 >= 0 && d5 <= d6) { Reduce1(s, k, out); return; }
+    vb = d5*d2 - d1*d6;
+    if(vb <= 0 && d2 >= 0 && d6 <= 0) { Reduce2(s, i, k, d2/(d2 - d6), out); return; }
+    va = d3*d6 - d5*d4;
+    if(va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+        { Reduce2(s, j, k, (d4 - d3)/((d4 - d3) + (d5 - d6)), out); return; }
+    den = va + vb + vc;
+    if(den <= 0) { Segment(s, i, j, out); return; } /* degenerate */
+    v = vb/den; w = vc/den;
+    Vertex(s, i, out, 0); Vertex(s, j, out, 1); Vertex(s, k, out, 2);
+    out->l[0] = 1 - v - w; out->l[1] = v; out->l[2] = w;
+    out->n = 3;
+    }
+
+static void Point(const simplex_t *s, double v[3])
+    {
+    int i;
+    v[0] = v[1] = v[2] = 0;
+    for(i = 0; i < s->n; i++)
+        {
+        v[0] += s->l[i]*s->w[i][0];
+        v[1] += s->l[i]*s->w[i][1];
+        v[2] += s->l[i]*s->w[i][2];
+        }
+    }
+
+static int Outside(const double *a, const double *b, const double *c, const double *d)
+/* Checks if the origin and d are on opposite sides of the plane through a, b, c */
+    {
+    double ab[3], ac[3], ad[3], n[3], sp, sd;
+    Sub(ab, b, a); Sub(ac, c, a); Sub(ad, d, a);
+    Cross(n, ab, ac);
+    sp = -Dot(a, n);
+    sd = Dot(ad, n);
+    return sp*sd < 0;
+    }
+
+static int Tetrahedron(const simplex_t *s, simplex_t *out)
+/* Returns 1 if the origin is inside the tetrahedron */
+    {
+    static const int face[4][4] = { {0,1,2,3}, {0,2,3,1}, {0,3,1,2}, {1,3,2,0} };
+    int f, inside = 1;
+    double v[3], d, best = -1;
+    simplex_t tmp;
+    for(f = 0; f < 4; f++)
+        {
+        if(!Outside(s->w[face[f][0]], s->w[face[f][1]], s->w[face[f][2]], s->w[face[f][3]]))
+            continue;
+        inside = 0;
+        Triangle(s, face[f][0], face[f][1], face[f][2], &tmp);
+        Point(&tmp, v);
+        d = Dot(v, v);
+        if(best < 0 || d < best) { best = d; *out = tmp; }
+        }
+    return inside;
+    }
+
+static int Closest(simplex_t *s, double v[3])
+/* Reduces the simplex to the smallest sub-simplex containing its closest point to the
+ * origin, and returns the latter in v. Returns 1 if the origin is inside the simplex. */
+    {
+    simplex_t out;
+    switch(s->n)
+        {
+        case 1: out = *s; out.l[0] = 1; break;
+        case 2: Segment(s, 0, 1, &out); break;
+        case 3: Triangle(s, 0, 1, 2, &out); break;
+        default:
+            if(Tetrahedron(s, &out)) { v[0] = v[1] = v[2] = 0; return 1; }
+        }
+    *s = out;
+    Point(s, v);
+    return 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | GJK                                                                          |
+ *------------------------------------------------------------------------------*/
+
+static int Gjk(const shape_t *A, const shape_t *B, double *dist, double pa[3], double pb[3])
+/* Computes the distance between the two shapes (including margins) and their closest
+ * points. Returns 1 if the shapes overlap, 0 otherwise. */
+    {
+    int i, iter, inside;
+    double v[3], w[3], a[3], b[3], nv[3], prevv[3], vv, prev = -1, len;
+    simplex_t s, prevs;
+    s.n = 0;
+    Sub(v, A->pos, B->pos);
+    if(Dot(v, v) == 0) { v[0] = 1; v[1] = v[2] = 0; }
+    for(iter = 0; iter < GJK_MAX_ITERATIONS; iter++)
+        {
+        nv[0] = -v[0]; nv[1] = -v[1]; nv[2] = -v[2];
+        Support(A, nv, a);
+        Support(B, v, b);
+        Sub(w, a, b);
+        vv = Dot(v, v);
+        if(s.n > 0)
+            {
+            /* no more progress possible: v is the closest point (within tolerance) */
+            if(vv - Dot(v, w) <= GJK_REL_TOLERANCE*vv) break;
+            for(i = 0; i < s.n; i++) /* w already in the simplex (numerical issues) */
+                if(w[0] == s.w[i][0] && w[1] == s.w[i][1] && w[2] == s.w[i][2]) break;
+            if(i < s.n) break;
+            }
+        prevs = s;
+        memcpy(prevv, v, sizeof(v));
+        memcpy(s.w[s.n], w, sizeof(w));
+        memcpy(s.a[s.n], a, sizeof(a));
+        memcpy(s.b[s.n], b, sizeof(b));
+        s.n++;
+        inside = Closest(&s, v);
+        if(inside || (prev >= 0 && Dot(v, v) >= prev))
+            {
+            /* If v.w > 0, then v.w/|v| is a positive lower bound for the distance, so
+             * the origin cannot be inside the simplex (nor can the distance increase):
+             * this is due to numerical issues with a nearly degenerate simplex, and
+             * the previous simplex is taken as the result. */
+            if(prevs.n > 0 && Dot(prevv, w) > 0) { s = prevs; break; }
+            if(inside) return 1;
+            }
+        vv = Dot(v, v);
+        if(vv <= GJK_ABS_TOLERANCE) return 1;
+        prev = vv;
+        }
+    /* closest points on the core shapes */
+    pa[0] = pa[1] = pa[2] = pb[0] = pb[1] = pb[2] = 0;
+    for(i = 0; i < s.n; i++)
+        {
+        pa[0] += s.l[i]*s.a[i][0]; pa[1] += s.l[i]*s.a[i][1]; pa[2] += s.l[i]*s.a[i][2];
+        pb[0] += s.l[i]*s.b[i][0]; pb[1] += s.l[i]*s.b[i][1]; pb[2] += s.l[i]*s.b[i][2];
+        }
+    /* add the margins */
+    Sub(v, pa, pb);
+    len = sqrt(Dot(v, v));
+    if(len <= A->margin + B->margin) return 1;
+    for(i = 0; i < 3; i++)
+        {
+        pa[i] -= v[i]*A->margin/len;
+        pb[i] += v[i]*B->margin/len;
+        }
+    *dist = len - A->margin - B->margin;
+    return 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Geoms                                                                        |
+ *------------------------------------------------------------------------------*/
+
+static int Shape(geom_t geom, shape_t *s)
+/* Initializes the shape for the given geom. Returns -1 if the geom class is not supported. */
+    {
+    dReal r, l;
+    dVector3 sides;
+    ud_t *ud;
+    convexdata_t data;
+    memset(s, 0, sizeof(shape_t));
+    switch(dGeomGetClass(geom))
+        {
+        case dSphereClass:
+            s->type = SHAPE_POINT;
+            s->margin = dGeomSphereGetRadius(geom);
+            break;
+        case dCapsuleClass:
+            s->type = SHAPE_SEGMENT;
+            dGeomCapsuleGetParams(geom, &r, &l);
+            s->margin = r;
+            s->half[1] = l/2;
+            break;
+        case dCylinderClass:
+            s->type = SHAPE_CYLINDER;
+            dGeomCylinderGetParams(geom, &r, &l);
+            s->half[0] = r;
+            s->half[1] = l/2;
+            break;
+        case dBoxClass:
+            s->type = SHAPE_BOX;
+            dGeomBoxGetLengths(geom, sides);
+            s->half[0] = sides[0]/2; s->half[1] = sides[1]/2; s->half[2] = sides[2]/2;
+            break;
+        case dConvexClass:
+            if((ud = userdata(geom)) == NULL || (data = (convexdata_t)ud->info) == NULL) return -1;
+            if(data->pointcount == 0) return -1;
+            s->type = SHAPE_CONVEX;
+            s->points = data->points;
+            s->count = data->pointcount;
+            break;
+        default:
+            return -1;
+        }
+    memcpy(s->pos, dGeomGetPosition(geom), 3*sizeof(double));
+    memcpy(s->R, dGeomGetRotation(geom), 12*sizeof(double));
+    return 0;
+    }
+
+static int PlaneDistance(geom_t plane, const shape_t *s, double *dist, double pp[3], double ps[3])
+/* Distance between a plane and a shape (pp, ps = closest points on plane and shape) */
+    {
+    int i;
+    dVector4 params;
+    double n[3], d;
+    dGeomPlaneGetParams(plane, params);
+    n[0] = -params[0]; n[1] = -params[1]; n[2] = -params[2];
+    Support(s, n, ps);
+    d = Dot(params, ps) - params[3] - s->margin;
+    if(d <= 0) return 1;
+    for(i = 0; i < 3; i++)
+        {
+        ps[i] -= params[i]*s->margin;
+        pp[i] = ps[i] - params[i]*d;
+        }
+    *dist = d;
+    return 0;
+    }
+
+int geomdistance(geom_t g1, geom_t g2, double *dist, double p1[3], double p2[3])
+/* Computes the distance between two convex geoms (or a geom and a plane), and their
+ * closest points. If g2 is NULL, the point p2 is used instead.
+ * Returns 0 on success, 1 if the geoms overlap, ERR_OPERATION if not supported.
+ */
+    {
+    shape_t A, B;
+    int plane1 = dGeomGetClass(g1) == dPlaneClass;
+    int plane2 = g2 && dGeomGetClass(g2) == dPlaneClass;
+    if(plane1 && plane2) return ERR_OPERATION;
+    if(g2 == NULL)
+        {
+        memset(&B, 0, sizeof(B));
+        B.type = SHAPE_POINT;
+        B.R[0] = B.R[5] = B.R[10] = 1;
+        memcpy(B.pos, p2, 3*sizeof(double));
+        }
+    else if(!plane2 && Shape(g2, &B) != 0) return ERR_OPERATION;
+    if(plane1) return PlaneDistance(g1, &B, dist, p1, p2);
+    if(Shape(g1, &A) != 0) return ERR_OPERATION;
+    if(plane2) return PlaneDistance(g2, &A, dist, p2, p1);
+    return Gjk(&A, &B, dist, p1, p2);
+    }
+
+static int Supported(geom_t geom)
+    {
+    shape_t s;
+    return dGeomGetClass(geom) == dPlaneClass || Shape(geom, &s) == 0;
+    }
+
+static int Distance(lua_State *L)
+/* distance, point1, point2 = distance(geom1, geom2|point) */
+    {
+    int rc;
+    double dist;
+    vec3_t p1, p2;
+    geom_t g1 = checkgeom(L, 1, NULL);
+    geom_t g2 = testgeom(L, 2, NULL);
+    if(!g2) checkvec3(L, 2, p2);
+    rc = geomdistance(g1, g2, &dist, p1, p2);
+    if(rc < 0) return argerror(L, Supported(g1) ? 2 : 1, ERR_OPERATION);
+    if(rc == 1) { lua_pushnumber(L, 0); return 1; }
+    lua_pushnumber(L, dist);
+    pushvec3(L, p1);
+    pushvec3(L, p2);
+    return 3;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "distance", Distance },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_distance(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
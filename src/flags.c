@@ -72,21 +72,72 @@ static int CollideFlags(lua_State *L)
     return 1;
     }
 
+/*----------------------------------------------------------------------*
+ | rayflags
+ *----------------------------------------------------------------------*/
+
+static int checkrayflags(lua_State *L, int arg) 
+    {
+    const char *s;
+    int flags = 0;
+    
+    while(lua_isstring(L, arg))
+        {
+        s = lua_tostring(L, arg++);
+#define CASE(CODE,str) if((strcmp(s, str)==0)) do { flags |= CODE; goto done; } while(0)
+        CASE(RAY_ANY_HIT, "any hit");
+        CASE(RAY_BACKFACE_CULL, "backface cull");
+#undef CASE
+        return luaL_argerror(L, --arg, badvalue(L,s));
+        done: ;
+        }
+
+    return flags;
+    }
+
+static int pushrayflags(lua_State *L, int flags)
+    {
+    int n = 0;
+
+#define CASE(CODE,str) do { if( flags & CODE) { lua_pushstring(L, str); n++; } } while(0)
+        CASE(RAY_ANY_HIT, "any hit");
+        CASE(RAY_BACKFACE_CULL, "backface cull");
+#undef CASE
+
+    return n;
+    }
+
+static int RayFlags(lua_State *L)
+    {
+    if(lua_type(L, 1) == LUA_TNUMBER)
+        return pushrayflags(L, luaL_checkinteger(L, 1));
+    lua_pushinteger(L, checkrayflags(L, 1));
+    return 1;
+    }
+
 #define dCONTACTS_UNIMPORTANT CONTACTS_UNIMPORTANT
+#define dRAY_ANY_HIT RAY_ANY_HIT
+#define dRAY_BACKFACE_CULL RAY_BACKFACE_CULL
 
 #define Add_CollideFlags(L) \
     ADD(CONTACTS_UNIMPORTANT);\
 
+#define Add_RayFlags(L) \
+    ADD(RAY_ANY_HIT);\
+    ADD(RAY_BACKFACE_CULL);\
+
 
 static int AddConstants(lua_State *L) /* ode.XXX constants for dXxx values */
     {
     Add_CollideFlags(L);
+    Add_RayFlags(L);
     return 0;
     }
 
 static const struct luaL_Reg Functions[] = 
     {
         { "collideflags", CollideFlags },
+        { "rayflags", RayFlags },
         { NULL, NULL } /* sentinel */
     };
 
@@ -29,6 +29,9 @@ int geomdestroy(lua_State *L, geom_t geom)
 /* Wrapper for dGeomDestroy() */
     {
     (void)L;
+    splitspacegeomdestroyed(geom);
+    sensorgeomdestroyed(geom);
+    contactgeomdestroyed(geom);
     dGeomDestroy(geom);
     return 0;
     }
@@ -51,8 +54,9 @@ static int GetSpace(lua_State *L)
     {
     geom_t geom = checkgeom(L, 1, NULL);
     space_t space = dGeomGetSpace(geom);
-    if(!space) lua_pushnil(L);
-    else pushspace(L, space);
+    ud_t *ud = space ? userdata(space) : NULL;
+    if(!ud) lua_pushnil(L); /* no space, or the hidden space of a split space */
+    else pushuserdata(L, ud);
     return 1;
     }
 
@@ -25,79 +25,113 @@
 
 #include "internal.h"
 
-/* We need to keep data around because ODE doesn't seem to copy it */
-typedef struct {
-    double *planes;
-    double *points;
-    unsigned int *polygons;
-} info_t;
-
-#define FreeInfo(L, info) do {                                  \
-    if(info) {                                                  \
-        Free((L), (info)->points); (info)->points = NULL;       \
-        Free((L), (info)->planes); (info)->planes = NULL;       \
-        Free((L), (info)->polygons); (info)->polygons = NULL;   \
-    }                                                           \
-} while(0)
+/* ODE doesn't copy the data, so we keep it around in a convexdata (ud->info), which
+ * may be private to the geom or shared with other geoms */
 
 static int freegeom(lua_State *L, ud_t *ud)
     {
     geom_t geom = (geom_t)ud->handle;
-    info_t *info = (info_t*)ud->info;
+    convexdata_t data = (convexdata_t)ud->info;
     ud->info = NULL; /* to prevent automatic release */
     if(!freeuserdata(L, ud, "geom_convex")) return 0;
-    FreeInfo(L, info);
-    Free(L, info);
     geomdestroy(L, geom);
+    if(data) convexdataunref(L, data);
     return 0;
     }
 
-static int newgeom(lua_State *L, geom_t geom, info_t* info)
+static int newgeom(lua_State *L, geom_t geom, convexdata_t data)
     {
     ud_t *ud;
     ud = newuserdata(L, geom, GEOM_CONVEX_MT, "geom_convex");
-    ud->info = info;
+    ud->info = data;
     ud->parent_ud = NULL;
     ud->destructor = freegeom;
     return 1;
     }
 
+static convexdata_t CheckData(lua_State *L, int arg)
+/* Returns a new reference to either the convexdata at arg, or to a private one
+ * created from the planes, points and polygons at arg, arg+1, arg+2 */
+    {
+    convexdata_t data = testconvexdata(L, arg, NULL);
+    if(!data) return convexdatacheck(L, arg);
+    convexdataref(data);
+    return data;
+    }
+
 static int Create(lua_State *L)
     {
-    int err;
-    int planecount, pointcount;
-    unsigned int polygoncount;
-    geom_t geom = NULL;
     space_t space = checkspace(L, 1, NULL);
-    info_t* info = Malloc(L, sizeof(info_t));
-#define Cleanup() do { FreeInfo(L, info); Free(L, info); } while(0)
-    info->planes = (double*)checkvec4list(L, 2, &planecount, &err);
-    if(err) { Cleanup(); return argerror(L, 2, err); }
-    info->points = (double*)checkvec3list(L, 3, &pointcount, &err);
-    if(err) { Cleanup(); return argerror(L, 3, err); }
-    info->polygons = checkpolygons(L, 4, &polygoncount, &err);
-    if(err) { Cleanup(); return argerror(L, 4, err); }
-    geom = dCreateConvex(space, info->planes, planecount, info->points, pointcount, info->polygons);
-#undef Cleanup
-    return newgeom(L, geom, info);
+    convexdata_t data = CheckData(L, 2);
+    geom_t geom = dCreateConvex(space, data->planes, data->planecount,
+            data->points, data->pointcount, data->polygons);
+    return newgeom(L, geom, data);
+    }
+
+static int CreateHull(lua_State *L)
+    {
+    space_t space = checkspace(L, 1, NULL);
+    convexdata_t data = convexdatahull(L, 2);
+    geom_t geom = dCreateConvex(space, data->planes, data->planecount,
+            data->points, data->pointcount, data->polygons);
+    return newgeom(L, geom, data);
+    }
+
+static int CreateCompound(lua_State *L)
+/* geoms = create_convex_compound(space, body, {convexdata}) */
+    {
+    int i, n;
+    geom_t geom;
+    convexdata_t data;
+    space_t space = checkspace(L, 1, NULL);
+    body_t body = optbody(L, 2, NULL);
+    if(!lua_istable(L, 3)) return argerror(L, 3, ERR_TABLE);
+    n = luaL_len(L, 3);
+    for(i = 1; i <= n; i++) /* check all before creating anything */
+        {
+        lua_rawgeti(L, 3, i);
+        if(!testconvexdata(L, -1, NULL)) return argerror(L, 3, ERR_TYPE);
+        lua_pop(L, 1);
+        }
+    lua_newtable(L);
+    for(i = 1; i <= n; i++)
+        {
+        lua_rawgeti(L, 3, i);
+        data = testconvexdata(L, -1, NULL);
+        lua_pop(L, 1);
+        convexdataref(data);
+        geom = dCreateConvex(space, data->planes, data->planecount,
+                data->points, data->pointcount, data->polygons);
+        newgeom(L, geom, data);
+        if(body) dGeomSetBody(geom, body);
+        lua_rawseti(L, -2, i);
+        }
+    return 1;
+    }
+
+static void SetData(lua_State *L, ud_t *ud, convexdata_t data)
+    {
+    geom_t geom = (geom_t)ud->handle;
+    convexdata_t old = (convexdata_t)ud->info;
+    dGeomSetConvex(geom, data->planes, data->planecount,
+            data->points, data->pointcount, data->polygons);
+    ud->info = data;
+    if(old) convexdataunref(L, old);
     }
 
 static int Set(lua_State *L)
     {
-    int err;
-    int planecount, pointcount;
-    unsigned int polygoncount;
     ud_t *ud;
-    geom_t geom = checkgeom_convex(L, 1, &ud);
-    info_t *info = (info_t*)ud->info;
-    FreeInfo(L, info);
-    info->planes = (double*)checkvec4list(L, 2, &planecount, &err);
-    if(err) return argerror(L, 2, err);
-    info->points = (double*)checkvec3list(L, 3, &pointcount, &err);
-    if(err) return argerror(L, 3, err);
-    info->polygons = checkpolygons(L, 4, &polygoncount, &err);
-    if(err) return argerror(L, 4, err);
-    dGeomSetConvex(geom, info->planes, planecount, info->points, pointcount, info->polygons);
+    checkgeom_convex(L, 1, &ud);
+    SetData(L, ud, CheckData(L, 2));
+    return 0;
+    }
+
+static int SetHull(lua_State *L)
+    {
+    ud_t *ud;
+    checkgeom_convex(L, 1, &ud);
+    SetData(L, ud, convexdatahull(L, 2));
     return 0;
     }
 
@@ -106,6 +140,7 @@ DESTROY_FUNC(geom)
 static const struct luaL_Reg Methods[] = 
     {
         { "set", Set },
+        { "set_hull", SetHull },
         { "destroy", Destroy },
         { NULL, NULL } /* sentinel */
     };
@@ -119,6 +154,8 @@ static const struct luaL_Reg MetaMethods[] =
 static const struct luaL_Reg Functions[] = 
     {
         { "create_convex", Create },
+        { "create_convex_hull", CreateHull },
+        { "create_convex_compound", CreateCompound },
         { NULL, NULL } /* sentinel */
     };
 
@@ -68,6 +68,31 @@ static int GetHfData(lua_State *L)
     return 1;
     }
 
+static int InvalidateIfUsing(lua_State *L, const void *mem, const char *mt, const void *info)
+/* callback for udata_scan */
+    {
+    ud_t *ud = (ud_t*)mem;
+    geom_t geom = (geom_t)ud->handle;
+    space_t space;
+    (void)L; (void)mt;
+    if(!IsValid(ud) || dGeomHeightfieldGetHeightfieldData(geom) != (hfdata_t)info) return 0;
+    /* the geom may be non-placeable, so it can not be marked as moved by re-setting its
+     * position: re-adding it to its space does the same */
+    if((space = dGeomGetSpace(geom)) != NULL)
+        {
+        dSpaceRemove(space, geom);
+        dSpaceAdd(space, geom);
+        }
+    splitspacegeomchanged(geom);
+    return 0;
+    }
+
+void heightfielddatachanged(lua_State *L, hfdata_t hfdata)
+/* Called when the bounds of hfdata change, to invalidate the AABBs of the 
+ * heightfield geoms that use it */
+    {
+    udata_scan(L, GEOM_HEIGHTFIELD_MT, hfdata, InvalidateIfUsing);
+    }
 
 DESTROY_FUNC(geom)
 
@@ -25,9 +25,16 @@
 
 #include "internal.h"
 
+/* Trimesh geoms whose last transform is automatically updated at each world step */
+#define IsAutoLastTransform(ud)     MarkGet((ud)->marks, 1)
+#define MarkAutoLastTransform(ud)   MarkSet((ud)->marks, 1) 
+#define CancelAutoLastTransform(ud) MarkReset((ud)->marks, 1)
+static int AutoCount = 0; /* no. of geoms marked as such */
+
 static int freegeom(lua_State *L, ud_t *ud)
     {
     geom_t geom = (geom_t)ud->handle;
+    if(IsAutoLastTransform(ud)) AutoCount--;
     if(!freeuserdata(L, ud, "geom_trimesh")) return 0;
     geomdestroy(L, geom);
     return 0;
@@ -83,6 +90,95 @@ static int GetLastTransform(lua_State *L)
     return 1;
     }
 
+static void SaveTransform(geom_t geom)
+/* Sets the last transform to the current position and rotation of the geom */
+    {
+    int i, j;
+    mat4_t transform;
+    const double *pos = dGeomGetPosition(geom);
+    const double *rot = dGeomGetRotation(geom); /* 3x4, row major */
+    for(i = 0; i < 3; i++)
+        {
+        for(j = 0; j < 3; j++)
+            transform[i + 4*j] = rot[4*i + j];
+        transform[4*i + 3] = 0;
+        transform[12 + i] = pos[i];
+        }
+    transform[15] = 1;
+    dGeomTriMeshSetLastTransform(geom, transform);
+    }
+
+static int SetAutoLastTransform(lua_State *L)
+    {
+    ud_t *ud;
+    geom_t geom = checkgeom_trimesh(L, 1, &ud);
+    int enable = checkboolean(L, 2);
+    if(enable && !IsAutoLastTransform(ud))
+        {
+        MarkAutoLastTransform(ud);
+        AutoCount++;
+        SaveTransform(geom);
+        }
+    else if(!enable && IsAutoLastTransform(ud))
+        {
+        CancelAutoLastTransform(ud);
+        AutoCount--;
+        }
+    return 0;
+    }
+
+static int GetAutoLastTransform(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkgeom_trimesh(L, 1, &ud);
+    lua_pushboolean(L, IsAutoLastTransform(ud));
+    return 1;
+    }
+
+static int SaveIfAuto(lua_State *L, const void *mem, const char *mt, const void *info)
+/* callback for udata_scan */
+    {
+    ud_t *ud = (ud_t*)mem;
+    geom_t geom = (geom_t)ud->handle;
+    body_t body;
+    (void)L; (void)mt;
+    if(!IsValid(ud) || !IsAutoLastTransform(ud)) return 0;
+    body = dGeomGetBody(geom);
+    if(body && dBodyGetWorld(body) != (world_t)info) return 0;
+    SaveTransform(geom);
+    return 0;
+    }
+
+void trimeshsavetransforms(lua_State *L, world_t world)
+/* Called before stepping the world, to record the transforms of the trimeshes 
+ * (attached to bodies of the world, or static) marked with set_auto_last_transform() */
+    {
+    if(AutoCount == 0) return;
+    udata_scan(L, GEOM_TRIMESH_MT, world, SaveIfAuto);
+    }
+
+static int InvalidateIfUsing(lua_State *L, const void *mem, const char *mt, const void *info)
+/* callback for udata_scan */
+    {
+    ud_t *ud = (ud_t*)mem;
+    geom_t geom = (geom_t)ud->handle;
+    const double *pos;
+    (void)L; (void)mt;
+    if(!IsValid(ud) || dGeomTriMeshGetData(geom) != (tmdata_t)info) return 0;
+    /* re-setting the position marks the geom as moved, so that its AABB is recomputed */
+    pos = dGeomGetPosition(geom);
+    dGeomSetPosition(geom, pos[0], pos[1], pos[2]);
+    splitspacegeomchanged(geom);
+    return 0;
+    }
+
+void trimeshdatachanged(lua_State *L, tmdata_t tmdata)
+/* Called when the positions of tmdata are modified, to invalidate the AABBs of the
+ * trimesh geoms that use it */
+    {
+    udata_scan(L, GEOM_TRIMESH_MT, tmdata, InvalidateIfUsing);
+    }
+
 int dGeomTriMeshGetTriangleCount(geom_t g);  /* missing prototype in headers? */
 static int GetTriangleCount(lua_State *L)
     {
@@ -116,7 +212,6 @@ static int GetPoint(lua_State *L)
     return 1;
     }
 
-#if 0 //@@ do we need these?
 static int EnableTC(lua_State *L)
     {
     geom_t geom = checkgeom_trimesh(L, 1, NULL);
@@ -148,6 +243,25 @@ static int ClearTCCache(lua_State *L)
     return 0;
     }
 
+/* Native triangle filter (ud->info): a triangle is considered for collision with
+ * another geom only if its category bits intersect the given mask or, if no mask
+ * was given, the collide bits of the other geom. */
+typedef struct {
+    int usemask;
+    uint32_t mask;
+    int count; /* no. of triangles with categories */
+    uint32_t categories[1]; /* categories[count] */
+} filter_t;
+
+static int Filter(ud_t *ud, geom_t object, int index)
+    {
+    uint32_t mask;
+    filter_t *filter = (filter_t*)ud->info;
+    if(!filter || index < 0 || index >= filter->count) return 1;
+    mask = filter->usemask ? filter->mask : (uint32_t)dGeomGetCollideBits(object);
+    return (filter->categories[index] & mask) != 0;
+    }
+
 static int Callback(geom_t geom, geom_t object, int index)
     {
 #define L moonode_L
@@ -155,6 +269,8 @@ static int Callback(geom_t geom, geom_t object, int index)
     int top = lua_gettop(L);
     ud_t *ud = userdata(geom);
     if(!ud) { unexpected(L); return 0; }
+    if(!Filter(ud, object, index)) return 0;
+    if(ud->ref1 == LUA_NOREF) return 1;
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
     pushgeom(L, geom);
     pushgeom(L, object);
@@ -167,35 +283,6 @@ static int Callback(geom_t geom, geom_t object, int index)
 #undef L
     }
 
-static int SetCallback(lua_State *L)
-    {
-    ud_t *ud;
-    geom_t geom = checkgeom_trimesh(L, 1, &ud);
-    if(lua_isnoneornil(L, 2)) /* remove callback */
-        {
-        if(ud->ref1!=LUA_NOREF)
-            {
-            dGeomTriMeshSetCallback(geom, NULL);
-            Unreference(L, ud->ref1);
-            }
-        return 0;
-        }
-    if(!lua_isfunction(L, 2))
-        return argerror(L, 2, ERR_FUNCTION);
-    Reference(L, 2, ud->ref1);
-    dGeomTriMeshSetCallback(geom, Callback);
-    return 0;
-    }
-
-static int GetCallback(lua_State *L)
-    {
-    ud_t *ud;
-    (void)checkgeom_trimesh(L, 1, &ud);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
-    return 1;
-    }
-
-
 static int RayCallback(geom_t geom, geom_t ray, int index, double u, double v)
     {
 #define L moonode_L
@@ -203,6 +290,8 @@ static int RayCallback(geom_t geom, geom_t ray, int index, double u, double v)
     int top = lua_gettop(L);
     ud_t *ud = userdata(geom);
     if(!ud) { unexpected(L); return 0; }
+    if(!Filter(ud, ray, index)) return 0;
+    if(ud->ref2 == LUA_NOREF) return 1;
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref2);
     pushgeom(L, geom);
     pushgeom(L, ray);
@@ -217,23 +306,51 @@ static int RayCallback(geom_t geom, geom_t ray, int index, double u, double v)
 #undef L
     }
 
+static void UpdateCallbacks(geom_t geom, ud_t *ud)
+/* The ODE callbacks are set only if there is something to call, since they are
+ * invoked for every candidate triangle */
+    {
+    dGeomTriMeshSetCallback(geom, (ud->info || ud->ref1 != LUA_NOREF) ? Callback : NULL);
+    dGeomTriMeshSetRayCallback(geom, (ud->info || ud->ref2 != LUA_NOREF) ? RayCallback : NULL);
+    }
+
+static int SetCallback(lua_State *L)
+    {
+    ud_t *ud;
+    geom_t geom = checkgeom_trimesh(L, 1, &ud);
+    if(lua_isnoneornil(L, 2)) /* remove callback */
+        Unreference(L, ud->ref1);
+    else
+        {
+        if(!lua_isfunction(L, 2))
+            return argerror(L, 2, ERR_FUNCTION);
+        Reference(L, 2, ud->ref1);
+        }
+    UpdateCallbacks(geom, ud);
+    return 0;
+    }
+
+static int GetCallback(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkgeom_trimesh(L, 1, &ud);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
+    return 1;
+    }
+
 static int SetRayCallback(lua_State *L)
     {
     ud_t *ud;
     geom_t geom = checkgeom_trimesh(L, 1, &ud);
     if(lua_isnoneornil(L, 2)) /* remove callback */
+        Unreference(L, ud->ref2);
+    else
         {
-        if(ud->ref2!=LUA_NOREF)
-            {
-            dGeomTriMeshSetRayCallback(geom, NULL);
-            Unreference(L, ud->ref2);
-            }
-        return 0;
+        if(!lua_isfunction(L, 2))
+            return argerror(L, 2, ERR_FUNCTION);
+        Reference(L, 2, ud->ref2);
         }
-    if(!lua_isfunction(L, 2))
-        return argerror(L, 2, ERR_FUNCTION);
-    Reference(L, 2, ud->ref2);
-    dGeomTriMeshSetRayCallback(geom, RayCallback);
+    UpdateCallbacks(geom, ud);
     return 0;
     }
 
@@ -244,7 +361,45 @@ static int GetRayCallback(lua_State *L)
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref2);
     return 1;
     }
-#endif
+
+static int SetTriangleFilter(lua_State *L)
+/* set_triangle_filter(categories, [mask]) */
+    {
+    ud_t *ud;
+    size_t len;
+    int count, usemask;
+    uint32_t mask;
+    const char *data;
+    buffer_t buffer;
+    filter_t *filter;
+    geom_t geom = checkgeom_trimesh(L, 1, &ud);
+    if(lua_isnoneornil(L, 2)) /* remove filter */
+        {
+        if(ud->info) { Free(L, ud->info); ud->info = NULL; }
+        UpdateCallbacks(geom, ud);
+        return 0;
+        }
+    if((buffer = testbuffer(L, 2, NULL)) != NULL)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, 2, &len);
+    if(len == 0 || len % sizeof(uint32_t) != 0)
+        return argerror(L, 2, ERR_LENGTH);
+    usemask = !lua_isnoneornil(L, 3);
+    mask = usemask ? (uint32_t)luaL_checkinteger(L, 3) : 0;
+    count = len / sizeof(uint32_t);
+    /* the categories are copied, so the buffer can be reused. The old filter is
+     * replaced only once the new one is ready, so it is kept on errors */
+    filter = (filter_t*)Malloc(L, sizeof(filter_t) + (count - 1)*sizeof(uint32_t));
+    filter->count = count;
+    filter->usemask = usemask;
+    filter->mask = mask;
+    memcpy(filter->categories, data, len);
+    if(ud->info) Free(L, ud->info);
+    ud->info = filter;
+    UpdateCallbacks(geom, ud);
+    return 0;
+    }
 
 DESTROY_FUNC(geom)
 
@@ -254,17 +409,20 @@ static const struct luaL_Reg Methods[] =
         { "get_data", GetData },
         { "set_last_transform", SetLastTransform },
         { "get_last_transform", GetLastTransform },
+        { "set_auto_last_transform", SetAutoLastTransform },
+        { "get_auto_last_transform", GetAutoLastTransform },
         { "get_triangle_count", GetTriangleCount },
         { "get_triangle", GetTriangle },
         { "get_point", GetPoint },
-//      { "set_callback", SetCallback },
-//      { "get_callback", GetCallback },
-//      { "set_ray_callback", SetRayCallback },
-//      { "get_ray_callback", GetRayCallback },
-//      { "enable_tc", EnableTC },
-//      { "disable_tc", DisableTC },
-//      { "is_tc_enabled", IsTCEnabled },
-//      { "clear_tc_cache", ClearTCCache },
+        { "set_callback", SetCallback },
+        { "get_callback", GetCallback },
+        { "set_ray_callback", SetRayCallback },
+        { "get_ray_callback", GetRayCallback },
+        { "set_triangle_filter", SetTriangleFilter },
+        { "enable_tc", EnableTC },
+        { "disable_tc", DisableTC },
+        { "is_tc_enabled", IsTCEnabled },
+        { "clear_tc_cache", ClearTCCache },
         { "destroy", Destroy },
         { NULL, NULL } /* sentinel */
     };
@@ -25,11 +25,112 @@
 
 #include "internal.h"
 
+/* Native height sources, and tile cache for the Lua callback source */
+typedef struct {
+    uint32_t seed;
+    int octaves;
+    double frequency; /* of the first octave, in cycles per sample */
+    double lacunarity;
+    double gain;
+} noise_t;
+
+typedef struct {
+    int datatype;
+    const void *data;
+    int gw, gd; /* grid dimensions, in samples */
+} grid_t;
+
+#define TILE_SHIFT 4
+#define TILE_SIZE (1 << TILE_SHIFT) /* tile side, in samples */
+#define TILE_MASK (TILE_SIZE - 1)
+#define DEFAULT_CACHE_TILES 64
+
+typedef struct {
+    int tx, tz; /* tile coordinates */
+    int valid;
+    double height[TILE_SIZE*TILE_SIZE];
+} tile_t;
+
+/* Pager for heightfields whose samples are loaded from a file on demand, in pages 
+ * of PAGE_SIDE x PAGE_SIDE samples kept in an LRU cache */
+#define PAGE_SHIFT 6
+#define PAGE_SIDE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIDE - 1)
+#define DEFAULT_CACHE_PAGES 256
+
+typedef struct page_s page_t;
+struct page_s {
+    int px, pz; /* page coordinates (-1 if not loaded) */
+    page_t *prev, *next; /* LRU list, most recently used first */
+    page_t *hnext; /* hash chain */
+    char *data; /* samples, row major */
+};
+
+typedef struct {
+    pagefile_t *pf;
+    int datatype;
+    size_t samplesize;
+    int nw, nd;
+    int maxpages, npages;
+    page_t *pages; /* pool of maxpages pages */
+    char *pagedata; /* memory for the samples of the pages in the pool */
+    page_t **buckets;
+    int nbuckets; /* power of 2 */
+    page_t *head, *tail; /* LRU list */
+    uint64_t loads; /* no. of page loads */
+} pager_t;
+
+typedef struct {
+    buffer_t buffer; /* buffer used in place for the height samples (if any) */
+    mapfile_t *map; /* mapped file containing the height samples (if any) */
+    hfdata_t hfdata;
+    int nw, nd; /* dimensions of the heightfield, in samples */
+    int wrap;
+    noise_t noise; /* create_hfdata_with_noise() */
+    grid_t grid; /* create_hfdata_with_grid() */
+    void *gridcopy; /* grid samples copied from a string (if any) */
+    tile_t *cache; /* create_hfdata_with_callback() */
+    int ntiles; /* power of 2 (0 if no cache) */
+    pager_t *pager; /* create_hfdata_paged() */
+    /* samples used by ODE in place, and modifiable with set_heights() (create_hfdata()) */
+    void *samples;
+    int ownsamples; /* samples copied from a string */
+    int datatype;
+    double minh, maxh; /* current bounds (raw) */
+} info_t;
+
+/* Header of hfdata files, followed by the height samples */
+typedef struct {
+    char magic[4]; /* "MOHF" */
+    uint32_t version; /* = 1 */
+    uint32_t datatype; /* DATATYPE_UCHAR, _SHORT, _FLOAT or _DOUBLE */
+    uint32_t widthsamples;
+    uint32_t depthsamples;
+    uint32_t reserved[3];
+} fileheader_t;
+
+#define FILE_MAGIC "MOHF"
+#define FILE_VERSION 1
+
+static void pagerfree(lua_State *L, pager_t *pager);
+
 static int freehfdata(lua_State *L, ud_t *ud)
     {
     hfdata_t hfdata = (hfdata_t)ud->handle;
+    info_t *info = (info_t*)ud->info;
+    ud->info = NULL; // to prevent its automatic deletion
     if(!freeuserdata(L, ud, "hfdata")) return 0;
     dGeomHeightfieldDataDestroy(hfdata);
+    if(info)
+        {
+        if(info->buffer) bufferunpin(L, info->buffer);
+        if(info->map) mapfile_close(L, info->map);
+        if(info->gridcopy) Free(L, info->gridcopy);
+        if(info->cache) Free(L, info->cache);
+        if(info->pager) pagerfree(L, info->pager);
+        if(info->ownsamples) Free(L, info->samples);
+        Free(L, info);
+        }
     return 0;
     }
 
@@ -42,63 +143,294 @@ static int newhfdata(lua_State *L, hfdata_t hfdata)
     return 1;
     }
 
-static int Create(lua_State *L)
+static size_t SampleSize(int datatype)
+    {
+    switch(datatype)
+        {
+        case DATATYPE_UCHAR: return sizeof(unsigned char);
+        case DATATYPE_SHORT: return sizeof(short);
+        case DATATYPE_FLOAT: return sizeof(float);
+        case DATATYPE_DOUBLE: return sizeof(double);
+        default: return 0;
+        }
+    return 0;
+    }
+
+typedef struct {
+    double width, depth;
+    double scale, offset, thickness;
+    int wrap;
+} params_t;
+
+static void checkparams(lua_State *L, int arg_width, int arg_scale, params_t *p)
+/* width and depth at arg_width, arg_width+1, the others at arg_scale .. arg_scale+3 */
+    {
+    p->width = luaL_checknumber(L, arg_width);
+    p->depth = luaL_checknumber(L, arg_width+1);
+    p->scale = luaL_checknumber(L, arg_scale);
+    p->offset = luaL_checknumber(L, arg_scale+1);
+    p->thickness = luaL_checknumber(L, arg_scale+2);
+    p->wrap = checkboolean(L, arg_scale+3);
+    }
+
+static void Build(hfdata_t hfdata, int datatype, const void *data, int copy,
+            int widthsamples, int depthsamples, const params_t *p)
     {
-    size_t len;
-    int datatype = checkdatatype(L, 1);
-    const char* data = luaL_checklstring(L, 2, &len);
-    double width = luaL_checknumber(L, 3);
-    double depth = luaL_checknumber(L, 4);
-    int widthsamples = luaL_checkinteger(L, 5);
-    int depthsamples = luaL_checkinteger(L, 6);
-    double scale = luaL_checknumber(L, 7);
-    double offset = luaL_checknumber(L, 8);
-    double thickness = luaL_checknumber(L, 9);
-    int wrap = checkboolean(L, 10);
-    hfdata_t hfdata = dGeomHeightfieldDataCreate();
     switch(datatype)
         {
-#define F(T, func)  do {                                                \
-    if(len != widthsamples*depthsamples*sizeof(T))                      \
-        {                                                               \
-        dGeomHeightfieldDataDestroy(hfdata);                            \
-        return argerror(L, 2, ERR_LENGTH);                              \
-        }                                                               \
-    func(hfdata, (const T*)data, 1/* bCopyHeightData */, width, depth,  \
-        widthsamples, depthsamples, scale, offset, thickness, wrap);    \
-} while(0)
+#define F(T, func) func(hfdata, (const T*)data, copy /* bCopyHeightData */,     \
+        p->width, p->depth, widthsamples, depthsamples,                         \
+        p->scale, p->offset, p->thickness, p->wrap)
         case DATATYPE_UCHAR: F(unsigned char, dGeomHeightfieldDataBuildByte); break;
         case DATATYPE_SHORT: F(short, dGeomHeightfieldDataBuildShort); break;
         case DATATYPE_FLOAT: F(float, dGeomHeightfieldDataBuildSingle); break;
         case DATATYPE_DOUBLE: F(double, dGeomHeightfieldDataBuildDouble); break;
-        default: unexpected(L);
+        default: break;
 #undef F
         }
-    return newhfdata(L, hfdata);
     }
 
-static double GetHeightCallback(void* p_user_data, int x, int z)
+static double GetSample(int datatype, const void *data, size_t k)
+    {
+    switch(datatype)
+        {
+        case DATATYPE_UCHAR: return ((const unsigned char*)data)[k];
+        case DATATYPE_SHORT: return ((const short*)data)[k];
+        case DATATYPE_FLOAT: return ((const float*)data)[k];
+        case DATATYPE_DOUBLE: return ((const double*)data)[k];
+        default: return 0;
+        }
+    return 0;
+    }
+
+static int ComputeBounds(info_t *info, int x0, int z0, int w, int h, int reset)
+/* Updates the bounds with the samples of the given rectangle, resetting them first
+ * if reset=1, and returns 1 if they changed. Bounds are only extended otherwise: they 
+ * stay conservative, without the need to scan the whole heightfield */
+    {
+    int i, j;
+    double v, minh = info->minh, maxh = info->maxh;
+    if(reset)
+        minh = maxh = GetSample(info->datatype, info->samples, (size_t)z0*info->nw + x0);
+    for(j = z0; j < z0 + h; j++)
+        for(i = x0; i < x0 + w; i++)
+            {
+            v = GetSample(info->datatype, info->samples, (size_t)j*info->nw + i);
+            if(v < minh) minh = v; else if(v > maxh) maxh = v;
+            }
+    if(!reset && minh == info->minh && maxh == info->maxh) return 0;
+    info->minh = minh;
+    info->maxh = maxh;
+    dGeomHeightfieldDataSetBounds(info->hfdata, minh, maxh);
+    return 1;
+    }
+
+static int Create(lua_State *L)
+    {
+    size_t len;
+    ud_t *ud;
+    info_t *info;
+    const char* data;
+    params_t params;
+    hfdata_t hfdata;
+    int datatype = checkdatatype(L, 1);
+    buffer_t buffer = testbuffer(L, 2, NULL);
+    int widthsamples = luaL_checkinteger(L, 5);
+    int depthsamples = luaL_checkinteger(L, 6);
+    checkparams(L, 3, 7, &params);
+    if(SampleSize(datatype) == 0)
+        return argerror(L, 1, ERR_VALUE);
+    /* samples from a buffer are used in place, samples from a string are copied */
+    if(buffer)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, 2, &len);
+    if(widthsamples < 2 || depthsamples < 2 || 
+            len != (size_t)widthsamples*depthsamples*SampleSize(datatype))
+        return argerror(L, 2, ERR_LENGTH);
+    info = (info_t*)Malloc(L, sizeof(info_t));
+    memset(info, 0, sizeof(info_t));
+    if(!buffer)
+        {
+        /* the copy is made here rather than by ODE, so that set_heights() can modify it */
+        info->samples = MallocNoErr(L, len);
+        if(!info->samples) { Free(L, info); return errmemory(L); }
+        memcpy(info->samples, data, len);
+        info->ownsamples = 1;
+        }
+    else
+        info->samples = (void*)data;
+    info->datatype = datatype;
+    info->nw = widthsamples;
+    info->nd = depthsamples;
+    hfdata = dGeomHeightfieldDataCreate();
+    Build(hfdata, datatype, info->samples, 0, widthsamples, depthsamples, &params);
+    newhfdata(L, hfdata);
+    ud = userdata(hfdata);
+    ud->info = info;
+    info->hfdata = hfdata;
+    if(buffer)
+        {
+        info->buffer = buffer;
+        bufferpin(buffer);
+        lua_pushvalue(L, 2);
+        ud->ref2 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    ComputeBounds(info, 0, 0, widthsamples, depthsamples, 1);
+    return 1; /* pushed by newhfdata() */
+    }
+
+static int CheckHeader(const fileheader_t *header, uint64_t filesize)
+/* Returns ERR_SUCCESS or an error code */
+    {
+    if(filesize < sizeof(fileheader_t))
+        return ERR_LENGTH;
+    if(memcmp(header->magic, FILE_MAGIC, 4) != 0 || header->version != FILE_VERSION ||
+            SampleSize(header->datatype) == 0 || header->widthsamples < 2 || header->depthsamples < 2)
+        return ERR_VALUE;
+    if(filesize < sizeof(fileheader_t) + 
+            (uint64_t)header->widthsamples*header->depthsamples*SampleSize(header->datatype))
+        return ERR_LENGTH;
+    return ERR_SUCCESS;
+    }
+
+static int CreateFromFile(lua_State *L)
+/* The file is mapped in memory and the samples are used in place */
+    {
+    int err;
+    ud_t *ud;
+    info_t *info;
+    params_t params;
+    fileheader_t header;
+    hfdata_t hfdata;
+    mapfile_t *map;
+    const char *filename = luaL_checkstring(L, 1);
+    checkparams(L, 2, 4, &params);
+    map = mapfile_open(L, filename);
+    if(map->size >= sizeof(fileheader_t))
+        memcpy(&header, map->data, sizeof(fileheader_t));
+    if((err = CheckHeader(&header, map->size)) != ERR_SUCCESS)
+        { mapfile_close(L, map); return argerror(L, 1, err); }
+    info = (info_t*)MallocNoErr(L, sizeof(info_t));
+    if(!info)
+        { mapfile_close(L, map); return errmemory(L); }
+    memset(info, 0, sizeof(info_t));
+    info->map = map;
+    hfdata = dGeomHeightfieldDataCreate();
+    Build(hfdata, header.datatype, map->data + sizeof(fileheader_t), 0,
+            header.widthsamples, header.depthsamples, &params);
+    newhfdata(L, hfdata);
+    ud = userdata(hfdata);
+    ud->info = info;
+    return 1;
+    }
+
+static int SaveFile(lua_State *L)
+/* save_hfdata_file(filename, datatype, data, nw, nd) */
+    {
+    int err;
+    size_t len;
+    const char *data;
+    fileheader_t header;
+    const char *filename = luaL_checkstring(L, 1);
+    int datatype = checkdatatype(L, 2);
+    buffer_t buffer = testbuffer(L, 3, NULL);
+    int widthsamples = luaL_checkinteger(L, 4);
+    int depthsamples = luaL_checkinteger(L, 5);
+    if(SampleSize(datatype) == 0)
+        return argerror(L, 2, ERR_VALUE);
+    if(buffer)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, 3, &len);
+    if(widthsamples < 2 || depthsamples < 2 || 
+            len != (size_t)widthsamples*depthsamples*SampleSize(datatype))
+        return argerror(L, 3, ERR_LENGTH);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FILE_MAGIC, 4);
+    header.version = FILE_VERSION;
+    header.datatype = datatype;
+    header.widthsamples = widthsamples;
+    header.depthsamples = depthsamples;
+    err = mapfile_save(filename, &header, sizeof(header), data, len, NULL, 0);
+    if(err) return failure(L, err);
+    return 0;
+    }
+
+static info_t *newinfo(lua_State *L, hfdata_t hfdata, int nw, int nd, int wrap)
+/* Creates the info for a heightfield with a callback source */
+    {
+    ud_t *ud = userdata(hfdata);
+    info_t *info = (info_t*)Malloc(L, sizeof(info_t));
+    memset(info, 0, sizeof(info_t));
+    info->hfdata = hfdata;
+    info->nw = nw;
+    info->nd = nd;
+    info->wrap = wrap;
+    ud->info = info;
+    return info;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Lua callback, with tile cache                                                |
+ *------------------------------------------------------------------------------*/
+
+static double CallLua(info_t *info, int x, int z)
     {
 #define L moonode_L
     double result;
-    hfdata_t hfdata = (hfdata_t)p_user_data;    
-    ud_t *ud = userdata(hfdata);
+    int top = lua_gettop(L);
+    ud_t *ud = userdata(info->hfdata);
     if(!ud) { unexpected(L); return 0; } 
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
-    pushhfdata(L, hfdata);
+    pushhfdata(L, info->hfdata);
     lua_pushnumber(L, x);
     lua_pushnumber(L, z);
     if(lua_pcall(L, 3, 1, 0) != LUA_OK)
         { lua_error(L); return 0; }
     result = luaL_checknumber(L, -1);
+    lua_settop(L, top);
     return result;
 #undef L
     }
 
+static double GetHeightCallback(void* p_user_data, int x, int z)
+    {
+    int i, j, tx, tz;
+    tile_t *tile;
+    info_t *info = (info_t*)p_user_data;    
+    if(info->ntiles == 0)
+        return CallLua(info, x, z);
+    /* ODE queries the samples around the colliding geoms, so on a miss the whole
+     * tile is filled, and the neighbouring queries are served from the cache */
+    tx = x >> TILE_SHIFT;
+    tz = z >> TILE_SHIFT;
+    tile = &info->cache[((uint32_t)tx*0x9E3779B1u ^ (uint32_t)tz*0x85EBCA77u) & (info->ntiles - 1)];
+    if(!tile->valid || tile->tx != tx || tile->tz != tz)
+        {
+        tile->valid = 0;
+        for(j = 0; j < TILE_SIZE; j++)
+            {
+            if((tz << TILE_SHIFT) + j >= info->nd) break;
+            for(i = 0; i < TILE_SIZE; i++)
+                {
+                if((tx << TILE_SHIFT) + i >= info->nw) break;
+                tile->height[j*TILE_SIZE + i] = CallLua(info, (tx << TILE_SHIFT) + i, (tz << TILE_SHIFT) + j);
+                }
+            }
+        tile->tx = tx;
+        tile->tz = tz;
+        tile->valid = 1;
+        }
+    return tile->height[(z & TILE_MASK)*TILE_SIZE + (x & TILE_MASK)];
+    }
+
 static int CreateWithCallback(lua_State *L)
     {
     ud_t *ud;
+    info_t *info;
     hfdata_t hfdata;
+    int ntiles;
     double width = luaL_checknumber(L, 2);
     double depth = luaL_checknumber(L, 3);
     int widthsamples = luaL_checkinteger(L, 4);
@@ -107,23 +439,520 @@ static int CreateWithCallback(lua_State *L)
     double offset = luaL_checknumber(L, 7);
     double thickness = luaL_checknumber(L, 8);
     int wrap = checkboolean(L, 9);
+    lua_Integer cachetiles = luaL_optinteger(L, 10, DEFAULT_CACHE_TILES);
     if(!lua_isfunction(L, 1)) return argerror(L, 1, ERR_FUNCTION);
+    if(cachetiles < 0 || cachetiles > (1<<20)) return argerror(L, 10, ERR_RANGE);
+    for(ntiles = 0; ntiles < cachetiles; ntiles = ntiles ? ntiles*2 : 1);
     hfdata = dGeomHeightfieldDataCreate();
     newhfdata(L, hfdata);
     ud = userdata(hfdata);
     lua_pushvalue(L, 1);
     ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
-    dGeomHeightfieldDataBuildCallback(hfdata, hfdata, GetHeightCallback, width, depth,
+    info = newinfo(L, hfdata, widthsamples, depthsamples, wrap);
+    if(ntiles > 0)
+        {
+        info->cache = (tile_t*)Malloc(L, ntiles*sizeof(tile_t));
+        memset(info->cache, 0, ntiles*sizeof(tile_t));
+        info->ntiles = ntiles;
+        }
+    dGeomHeightfieldDataBuildCallback(hfdata, info, GetHeightCallback, width, depth,
             widthsamples, depthsamples, scale, offset, thickness, wrap);
     return 1; /* pushed by newhfdata() */
     }
 
+static int ClearCache(lua_State *L)
+/* To be called if the heights returned by the callback change */
+    {
+    int i;
+    ud_t *ud;
+    info_t *info;
+    (void)checkhfdata(L, 1, &ud);
+    info = (info_t*)ud->info;
+    if(info && info->cache)
+        for(i = 0; i < info->ntiles; i++) info->cache[i].valid = 0;
+    if(info && info->pager)
+        {
+        info->pager->npages = 0;
+        info->pager->head = info->pager->tail = NULL;
+        memset(info->pager->buckets, 0, info->pager->nbuckets*sizeof(page_t*));
+        }
+    return 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Procedural noise (fBm of gradient noise)                                     |
+ *------------------------------------------------------------------------------*/
+
+static uint32_t Hash(int32_t x, int32_t z, uint32_t seed)
+    {
+    uint32_t h = seed ^ ((uint32_t)x * 0x27d4eb2du) ^ ((uint32_t)z * 0x165667b1u);
+    h ^= h >> 15; h *= 0x2c1b3c6du;
+    h ^= h >> 12; h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+    }
+
+static double Gradient(uint32_t h, double dx, double dz)
+    {
+    switch(h & 7)
+        {
+        case 0: return dx + dz;
+        case 1: return dx - dz;
+        case 2: return -dx + dz;
+        case 3: return -dx - dz;
+        case 4: return dx;
+        case 5: return -dx;
+        case 6: return dz;
+        default: return -dz;
+        }
+    return 0;
+    }
+
+#define Fade(t) ((t)*(t)*(t)*((t)*((t)*6 - 15) + 10))
+#define Lerp(a, b, t) ((a) + ((b) - (a))*(t))
+
+static double GradientNoise(double x, double z, int px, int pz, uint32_t seed)
+/* 2D gradient noise in [-1, 1], periodic with period px along x and pz along z
+ * (if they are > 0) */
+    {
+    int x0 = (int)floor(x), z0 = (int)floor(z);
+    int x1 = x0 + 1, z1 = z0 + 1;
+    double fx = x - x0, fz = z - z0;
+    double u = Fade(fx), v = Fade(fz);
+    double n00, n10, n01, n11;
+    if(px > 0) { x0 %= px; if(x0 < 0) x0 += px; x1 = (x0 + 1) % px; }
+    if(pz > 0) { z0 %= pz; if(z0 < 0) z0 += pz; z1 = (z0 + 1) % pz; }
+    n00 = Gradient(Hash(x0, z0, seed), fx, fz);
+    n10 = Gradient(Hash(x1, z0, seed), fx - 1, fz);
+    n01 = Gradient(Hash(x0, z1, seed), fx, fz - 1);
+    n11 = Gradient(Hash(x1, z1, seed), fx - 1, fz - 1);
+    return Lerp(Lerp(n00, n10, u), Lerp(n01, n11, u), v);
+    }
+
+static double GetHeightNoise(void* p_user_data, int x, int z)
+    {
+    int i, px = 0, pz = 0;
+    double fx, fz, h = 0, amp = 1, ampsum = 0;
+    info_t *info = (info_t*)p_user_data;    
+    noise_t *noise = &info->noise;
+    double frequency = noise->frequency;
+    for(i = 0; i < noise->octaves; i++)
+        {
+        fx = fz = frequency;
+        if(info->wrap)
+            {
+            /* ODE wraps with a period of (nw-1, nd-1) samples: round the frequency
+             * of each octave so that an integer number of cells fits in a period */
+            px = (int)floor(frequency*(info->nw - 1) + 0.5); if(px < 1) px = 1;
+            pz = (int)floor(frequency*(info->nd - 1) + 0.5); if(pz < 1) pz = 1;
+            fx = (double)px/(info->nw - 1);
+            fz = (double)pz/(info->nd - 1);
+            }
+        h += amp * GradientNoise(x*fx, z*fz, px, pz, noise->seed + i);
+        ampsum += amp;
+        amp *= noise->gain;
+        frequency *= noise->lacunarity;
+        }
+    return ampsum > 0 ? h/ampsum : 0;
+    }
+
+static double GetNumber(lua_State *L, int arg, const char *name, double defval)
+    {
+    double val;
+    lua_getfield(L, arg, name);
+    val = lua_isnoneornil(L, -1) ? defval : luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+    return val;
+    }
+
+static void checknoiseparams(lua_State *L, int arg, noise_t *noise)
+    {
+    if(!lua_istable(L, arg)) { argerror(L, arg, ERR_TABLE); return; }
+    noise->seed = (uint32_t)GetNumber(L, arg, "seed", 0);
+    noise->octaves = (int)GetNumber(L, arg, "octaves", 4);
+    noise->frequency = GetNumber(L, arg, "frequency", 1.0/16);
+    noise->lacunarity = GetNumber(L, arg, "lacunarity", 2.0);
+    noise->gain = GetNumber(L, arg, "gain", 0.5);
+    if(noise->octaves < 1 || noise->octaves > 16 || noise->frequency <= 0 || noise->lacunarity <= 0)
+        argerror(L, arg, ERR_RANGE);
+    }
+
+static int CreateWithNoise(lua_State *L)
+/* create_hfdata_with_noise(noiseparams, width, depth, nw, nd, scale, offset, thickness, wrap) */
+    {
+    info_t *info;
+    hfdata_t hfdata;
+    noise_t noise;
+    double width = luaL_checknumber(L, 2);
+    double depth = luaL_checknumber(L, 3);
+    int widthsamples = luaL_checkinteger(L, 4);
+    int depthsamples = luaL_checkinteger(L, 5);
+    double scale = luaL_checknumber(L, 6);
+    double offset = luaL_checknumber(L, 7);
+    double thickness = luaL_checknumber(L, 8);
+    int wrap = checkboolean(L, 9);
+    checknoiseparams(L, 1, &noise);
+    if(widthsamples < 2 || depthsamples < 2) return argerror(L, 4, ERR_RANGE);
+    hfdata = dGeomHeightfieldDataCreate();
+    newhfdata(L, hfdata);
+    info = newinfo(L, hfdata, widthsamples, depthsamples, wrap);
+    info->noise = noise;
+    dGeomHeightfieldDataBuildCallback(hfdata, info, GetHeightNoise, width, depth,
+            widthsamples, depthsamples, scale, offset, thickness, wrap);
+    /* the noise is in [-1, 1], so the bounds are known (ODE assumes infinite 
+     * bounds for callback heightfields) */
+    dGeomHeightfieldDataSetBounds(hfdata, -1, 1);
+    return 1; /* pushed by newhfdata() */
+    }
+
+/*------------------------------------------------------------------------------*
+ | Bilinear lookup in a (coarser) grid of samples                               |
+ *------------------------------------------------------------------------------*/
+
+static double LoadSample(const grid_t *grid, int i, int j)
+    { return GetSample(grid->datatype, grid->data, (size_t)j*grid->gw + i); }
+
+static double GetHeightGrid(void* p_user_data, int x, int z)
+    {
+    int i, j;
+    double u, v, fu, fv, h0, h1;
+    info_t *info = (info_t*)p_user_data;    
+    grid_t *grid = &info->grid;
+    /* map the sample (x, z) to grid coordinates, the corners matching */
+    u = (double)x*(grid->gw - 1)/(info->nw - 1);
+    v = (double)z*(grid->gd - 1)/(info->nd - 1);
+    i = (int)u; if(i > grid->gw - 2) i = grid->gw - 2;
+    j = (int)v; if(j > grid->gd - 2) j = grid->gd - 2;
+    fu = u - i;
+    fv = v - j;
+    h0 = Lerp(LoadSample(grid, i, j), LoadSample(grid, i + 1, j), fu);
+    h1 = Lerp(LoadSample(grid, i, j + 1), LoadSample(grid, i + 1, j + 1), fu);
+    return Lerp(h0, h1, fv);
+    }
+
+static int CreateWithGrid(lua_State *L)
+/* create_hfdata_with_grid(datatype, data, gw, gd, width, depth, nw, nd, scale, offset, thickness, wrap) */
+    {
+    size_t len, k, n;
+    ud_t *ud;
+    info_t *info;
+    params_t params;
+    hfdata_t hfdata;
+    const char *data;
+    double h, minh, maxh;
+    int datatype = checkdatatype(L, 1);
+    buffer_t buffer = testbuffer(L, 2, NULL);
+    int gw = luaL_checkinteger(L, 3);
+    int gd = luaL_checkinteger(L, 4);
+    int widthsamples = luaL_checkinteger(L, 7);
+    int depthsamples = luaL_checkinteger(L, 8);
+    checkparams(L, 5, 9, &params);
+    if(SampleSize(datatype) == 0)
+        return argerror(L, 1, ERR_VALUE);
+    if(buffer)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, 2, &len);
+    if(gw < 2 || gd < 2 || len != (size_t)gw*gd*SampleSize(datatype))
+        return argerror(L, 2, ERR_LENGTH);
+    if(widthsamples < 2 || depthsamples < 2) return argerror(L, 7, ERR_RANGE);
+    hfdata = dGeomHeightfieldDataCreate();
+    newhfdata(L, hfdata);
+    ud = userdata(hfdata);
+    info = newinfo(L, hfdata, widthsamples, depthsamples, params.wrap);
+    info->grid.datatype = datatype;
+    info->grid.gw = gw;
+    info->grid.gd = gd;
+    /* samples from a buffer are used in place, samples from a string are copied */
+    if(buffer)
+        {
+        info->grid.data = data;
+        info->buffer = buffer;
+        bufferpin(buffer);
+        lua_pushvalue(L, 2);
+        ud->ref2 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    else
+        {
+        info->gridcopy = Malloc(L, len);
+        memcpy(info->gridcopy, data, len);
+        info->grid.data = info->gridcopy;
+        }
+    dGeomHeightfieldDataBuildCallback(hfdata, info, GetHeightGrid, params.width, params.depth,
+            widthsamples, depthsamples, params.scale, params.offset, params.thickness, params.wrap);
+    /* bilinear interpolation does not exceed the grid's extremes */
+    n = (size_t)gw*gd;
+    minh = maxh = LoadSample(&info->grid, 0, 0);
+    for(k = 1; k < n; k++)
+        {
+        h = LoadSample(&info->grid, k % gw, k / gw);
+        if(h < minh) minh = h; else if(h > maxh) maxh = h;
+        }
+    dGeomHeightfieldDataSetBounds(hfdata, minh, maxh);
+    return 1; /* pushed by newhfdata() */
+    }
+
+/*------------------------------------------------------------------------------*
+ | Paged samples                                                                |
+ *------------------------------------------------------------------------------*/
+
+static void pagerfree(lua_State *L, pager_t *pager)
+    {
+    if(pager->pf) pagefile_close(L, pager->pf);
+    if(pager->pages) Free(L, pager->pages);
+    if(pager->pagedata) Free(L, pager->pagedata);
+    if(pager->buckets) Free(L, pager->buckets);
+    Free(L, pager);
+    }
+
+#define Bucket(pager, px, pz) \
+    (((uint32_t)(px)*0x9E3779B1u ^ (uint32_t)(pz)*0x85EBCA77u) & ((pager)->nbuckets - 1))
+
+static void LruUnlink(pager_t *pager, page_t *page)
+    {
+    if(page->prev) page->prev->next = page->next; else pager->head = page->next;
+    if(page->next) page->next->prev = page->prev; else pager->tail = page->prev;
+    page->prev = page->next = NULL;
+    }
+
+static void LruPushFront(pager_t *pager, page_t *page)
+    {
+    page->prev = NULL;
+    page->next = pager->head;
+    if(pager->head) pager->head->prev = page; else pager->tail = page;
+    pager->head = page;
+    }
+
+static void LruPushBack(pager_t *pager, page_t *page)
+    {
+    page->next = NULL;
+    page->prev = pager->tail;
+    if(pager->tail) pager->tail->next = page; else pager->head = page;
+    pager->tail = page;
+    }
+
+static void HashRemove(pager_t *pager, page_t *page)
+    {
+    page_t **pp;
+    if(page->px < 0) return; /* not loaded, so not in the hash */
+    for(pp = &pager->buckets[Bucket(pager, page->px, page->pz)]; *pp; pp = &(*pp)->hnext)
+        if(*pp == page) { *pp = page->hnext; break; }
+    page->hnext = NULL;
+    }
+
+static int LoadPage(pager_t *pager, page_t *page, int px, int pz)
+/* Reads the samples of the page, one row at a time */
+    {
+    int j, err;
+    int x0 = px << PAGE_SHIFT, z0 = pz << PAGE_SHIFT;
+    int w = pager->nw - x0 < PAGE_SIDE ? pager->nw - x0 : PAGE_SIDE;
+    int h = pager->nd - z0 < PAGE_SIDE ? pager->nd - z0 : PAGE_SIDE;
+    size_t ss = pager->samplesize;
+    for(j = 0; j < h; j++)
+        {
+        err = pagefile_read(pager->pf, sizeof(fileheader_t) + ((uint64_t)(z0 + j)*pager->nw + x0)*ss,
+                page->data + (size_t)j*PAGE_SIDE*ss, w*ss);
+        if(err) return err;
+        }
+    pager->loads++;
+    return 0;
+    }
+
+static page_t *GetPage(lua_State *L, pager_t *pager, int px, int pz)
+/* Returns the page, loading it if not resident, and marks it as the most recently used */
+    {
+    int err;
+    page_t *page;
+    uint32_t b = Bucket(pager, px, pz);
+    for(page = pager->buckets[b]; page; page = page->hnext)
+        if(page->px == px && page->pz == pz) break;
+    if(page)
+        {
+        if(page != pager->head)
+            { LruUnlink(pager, page); LruPushFront(pager, page); }
+        return page;
+        }
+    /* miss: take a page from the pool or, if exhausted, evict the least recently used */
+    if(pager->npages < pager->maxpages)
+        page = &pager->pages[pager->npages++];
+    else
+        {
+        page = pager->tail;
+        LruUnlink(pager, page);
+        HashRemove(pager, page);
+        }
+    page->px = page->pz = -1;
+    if((err = LoadPage(pager, page, px, pz)) != 0)
+        {
+        LruPushBack(pager, page); /* reusable first */
+        luaL_error(L, "%s (loading heightfield page)", errstring(err));
+        return NULL;
+        }
+    page->px = px;
+    page->pz = pz;
+    page->hnext = pager->buckets[b];
+    pager->buckets[b] = page;
+    LruPushFront(pager, page);
+    return page;
+    }
+
+static double GetHeightPaged(void* p_user_data, int x, int z)
+    {
+    info_t *info = (info_t*)p_user_data;    
+    pager_t *pager = info->pager;
+    page_t *page = pager->head; /* the last used page, most likely the one needed */
+    int px = x >> PAGE_SHIFT, pz = z >> PAGE_SHIFT;
+    if(!page || page->px != px || page->pz != pz)
+        page = GetPage(moonode_L, pager, px, pz);
+    return GetSample(pager->datatype, page->data, ((z & PAGE_MASK) << PAGE_SHIFT) + (x & PAGE_MASK));
+    }
+
+static int CreatePaged(lua_State *L)
+/* create_hfdata_paged(filename, width, depth, scale, offset, thickness, wrap, [cachepages]) */
+    {
+    int err;
+    info_t *info;
+    pager_t *pager;
+    params_t params;
+    hfdata_t hfdata;
+    fileheader_t header;
+    pagefile_t *pf;
+    int i;
+    const char *filename = luaL_checkstring(L, 1);
+    lua_Integer cachepages = luaL_optinteger(L, 8, DEFAULT_CACHE_PAGES);
+    checkparams(L, 2, 4, &params);
+    if(cachepages < 1 || cachepages > (1<<20)) return argerror(L, 8, ERR_RANGE);
+    pf = pagefile_open(L, filename);
+    err = pagefile_read(pf, 0, &header, sizeof(header));
+    if(err == ERR_BOUNDARIES) err = ERR_LENGTH;
+    if(!err) err = CheckHeader(&header, pagefile_size(pf));
+    if(err)
+        { pagefile_close(L, pf); return argerror(L, 1, err); }
+    pager = (pager_t*)MallocNoErr(L, sizeof(pager_t));
+    if(!pager)
+        { pagefile_close(L, pf); return errmemory(L); }
+    memset(pager, 0, sizeof(pager_t));
+    pager->pf = pf;
+    pager->datatype = header.datatype;
+    pager->samplesize = SampleSize(header.datatype);
+    pager->nw = header.widthsamples;
+    pager->nd = header.depthsamples;
+    pager->maxpages = cachepages;
+    for(pager->nbuckets = 1; pager->nbuckets < 2*cachepages; pager->nbuckets *= 2);
+    pager->pages = (page_t*)MallocNoErr(L, cachepages*sizeof(page_t));
+    pager->pagedata = (char*)MallocNoErr(L, cachepages*PAGE_SIDE*PAGE_SIDE*pager->samplesize);
+    pager->buckets = (page_t**)MallocNoErr(L, pager->nbuckets*sizeof(page_t*));
+    if(!pager->pages || !pager->pagedata || !pager->buckets)
+        { pagerfree(L, pager); return errmemory(L); }
+    memset(pager->pages, 0, cachepages*sizeof(page_t));
+    memset(pager->buckets, 0, pager->nbuckets*sizeof(page_t*));
+    for(i = 0; i < cachepages; i++)
+        pager->pages[i].data = pager->pagedata + (size_t)i*PAGE_SIDE*PAGE_SIDE*pager->samplesize;
+    hfdata = dGeomHeightfieldDataCreate();
+    newhfdata(L, hfdata);
+    info = newinfo(L, hfdata, pager->nw, pager->nd, params.wrap);
+    info->pager = pager;
+    dGeomHeightfieldDataBuildCallback(hfdata, info, GetHeightPaged, params.width, params.depth,
+            pager->nw, pager->nd, params.scale, params.offset, params.thickness, params.wrap);
+    return 1; /* pushed by newhfdata() */
+    }
+
+static pager_t *checkpager(lua_State *L, int arg)
+    {
+    ud_t *ud;
+    info_t *info;
+    (void)checkhfdata(L, arg, &ud);
+    info = (info_t*)ud->info;
+    if(!info || !info->pager) { failure(L, ERR_OPERATION); return NULL; }
+    return info->pager;
+    }
+
+static int Prefetch(lua_State *L)
+/* prefetch(x0, z0, x1, z1): loads the pages containing the samples in the given range */
+    {
+    int px, pz, px0, pz0, px1, pz1;
+    pager_t *pager = checkpager(L, 1);
+    int x0 = luaL_checkinteger(L, 2);
+    int z0 = luaL_checkinteger(L, 3);
+    int x1 = luaL_checkinteger(L, 4);
+    int z1 = luaL_checkinteger(L, 5);
+    if(x0 < 0) x0 = 0;
+    if(z0 < 0) z0 = 0;
+    if(x1 > pager->nw - 1) x1 = pager->nw - 1;
+    if(z1 > pager->nd - 1) z1 = pager->nd - 1;
+    if(x1 < x0 || z1 < z0) return 0;
+    px0 = x0 >> PAGE_SHIFT; px1 = x1 >> PAGE_SHIFT;
+    pz0 = z0 >> PAGE_SHIFT; pz1 = z1 >> PAGE_SHIFT;
+    if((px1 - px0 + 1)*(pz1 - pz0 + 1) > pager->maxpages)
+        return argerror(L, 4, ERR_RANGE); /* would evict pages of the same range */
+    for(pz = pz0; pz <= pz1; pz++)
+        for(px = px0; px <= px1; px++)
+            GetPage(L, pager, px, pz);
+    return 0;
+    }
+
+static int GetPagingStats(lua_State *L)
+    {
+    pager_t *pager = checkpager(L, 1);
+    lua_pushinteger(L, pager->npages);
+    lua_pushinteger(L, pager->loads);
+    return 2;
+    }
+
+static int SetHeights(lua_State *L)
+/* set_heights(x0, z0, w, h, data, [offset]) */
+    {
+    int j;
+    ud_t *ud;
+    info_t *info;
+    size_t len, ss, rowlen;
+    const char *data;
+    buffer_t buffer;
+    hfdata_t hfdata = checkhfdata(L, 1, &ud);
+    int x0 = luaL_checkinteger(L, 2);
+    int z0 = luaL_checkinteger(L, 3);
+    int w = luaL_checkinteger(L, 4);
+    int h = luaL_checkinteger(L, 5);
+    size_t offset = checkoffset(L, 7);
+    info = (info_t*)ud->info;
+    /* only sample data owned by MoonODE or in a buffer can be modified */
+    if(!info || !info->samples || info->map) return failure(L, ERR_OPERATION);
+    if(x0 < 0 || x0 >= info->nw) return argerror(L, 2, ERR_RANGE);
+    if(z0 < 0 || z0 >= info->nd) return argerror(L, 3, ERR_RANGE);
+    if(w < 1 || w > info->nw - x0) return argerror(L, 4, ERR_RANGE);
+    if(h < 1 || h > info->nd - z0) return argerror(L, 5, ERR_RANGE);
+    if((buffer = testbuffer(L, 6, NULL)) != NULL)
+        { data = buffer->data; len = buffer->size; }
+    else
+        data = luaL_checklstring(L, 6, &len);
+    ss = SampleSize(info->datatype);
+    rowlen = w*ss;
+    if(offset > len || len - offset < (size_t)h*rowlen) return argerror(L, 6, ERR_LENGTH);
+    data += offset;
+    for(j = 0; j < h; j++)
+        memmove((char*)info->samples + ((size_t)(z0 + j)*info->nw + x0)*ss, data + j*rowlen, rowlen);
+    /* the geoms' AABBs depend on the bounds, so they need to be recomputed only if these changed */
+    if(ComputeBounds(info, x0, z0, w, h, 0))
+        heightfielddatachanged(L, hfdata);
+    return 0;
+    }
+
 static int SetBounds(lua_State *L)
     {
-    hfdata_t hfdata = checkhfdata(L, 1, NULL);
+    ud_t *ud;
+    info_t *info;
+    hfdata_t hfdata = checkhfdata(L, 1, &ud);
     double minheight = luaL_checknumber(L, 2);
     double maxheight = luaL_checknumber(L, 3);
+    info = (info_t*)ud->info;
+    /* keep the stored bounds in sync, since set_heights() extends them incrementally */
+    if(info)
+        {
+        info->minh = minheight;
+        info->maxh = maxheight;
+        }
     dGeomHeightfieldDataSetBounds(hfdata, minheight, maxheight);
+    heightfielddatachanged(L, hfdata);
     return 0;
     }
 
@@ -134,6 +963,10 @@ static const struct luaL_Reg Methods[] =
     {
         { "raw", Raw },
         { "set_bounds", SetBounds },
+        { "set_heights", SetHeights },
+        { "clear_cache", ClearCache },
+        { "prefetch", Prefetch },
+        { "get_paging_stats", GetPagingStats },
         { "destroy", Destroy },
         { NULL, NULL } /* sentinel */
     };
@@ -147,7 +980,12 @@ static const struct luaL_Reg MetaMethods[] =
 static const struct luaL_Reg Functions[] = 
     {
         { "create_hfdata", Create },
+        { "create_hfdata_from_file", CreateFromFile },
+        { "save_hfdata_file", SaveFile },
         { "create_hfdata_with_callback", CreateWithCallback },
+        { "create_hfdata_with_noise", CreateWithNoise },
+        { "create_hfdata_with_grid", CreateWithGrid },
+        { "create_hfdata_paged", CreatePaged },
         { NULL, NULL } /* sentinel */
     };
 
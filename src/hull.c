@@ -0,0 +1,563 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+#include <float.h>
+
+/* Convex hull of a point cloud (quickhull), producing the representation used by 
+ * dCreateConvex(): the outward planes of the faces (a, b, c, d, with ax+by+cz=d),
+ * the hull vertices, and the polygons (each encoded as the no. of its vertices followed
+ * by their indices, counterclockwise when seen from outside).
+ * Coplanar triangles are merged into polygons. A non-zero tolerance discards points
+ * that are less than tolerance outside of the hull and merges nearly coplanar faces,
+ * while maxvertices, if non-zero, stops the hull growth when the given no. of vertices
+ * is reached (the farthest points are added first, so the result is the best 
+ * approximation with that no. of vertices that the algorithm can find).
+ */
+
+typedef struct {
+    int v[3]; /* vertices (indices of the input points), counterclockwise from outside */
+    int adj[3]; /* adj[j] = face across the edge v[j]->v[j+1] */
+    double n[3], d; /* plane */
+    int alive;
+    int stamp; /* iteration in which the face was last visited */
+    int visible;
+    int outside; /* first point of the outside set (linked by pnext), or -1 */
+    int furthest; /* farthest point of the outside set */
+    int cluster; /* polygon the face is merged in */
+    int cnext; /* next face in the same polygon */
+} face_t;
+
+typedef struct {
+    lua_State *L;
+    const double *p; /* input points, 3 doubles each */
+    int np;
+    face_t *faces;
+    int nfaces, maxfaces;
+    int *pnext; /* links of the outside sets */
+    double *dist; /* distance of each point from the face whose outside set contains it */
+    int *conestart, *coneend; /* scratch, indexed by vertex */
+    int *list; /* scratch, for visible faces and the work list (maxfaces entries) */
+    int *work; /* faces with non-empty outside sets (maxfaces entries) */
+    int nwork;
+    int stamp;
+    double eps; /* below this distance a point is considered to lie on a plane */
+    double threshold; /* eps + tolerance */
+} qh_t;
+
+#define P(qh, i) ((qh)->p + 3*(i))
+#define Dot(a, b) ((a)[0]*(b)[0] + (a)[1]*(b)[1] + (a)[2]*(b)[2])
+#define Sub(r, a, b) do { (r)[0]=(a)[0]-(b)[0]; (r)[1]=(a)[1]-(b)[1]; (r)[2]=(a)[2]-(b)[2]; } while(0)
+#define Cross(r, a, b) do {                     \
+    (r)[0] = (a)[1]*(b)[2] - (a)[2]*(b)[1];     \
+    (r)[1] = (a)[2]*(b)[0] - (a)[0]*(b)[2];     \
+    (r)[2] = (a)[0]*(b)[1] - (a)[1]*(b)[0];     \
+} while(0)
+#define Distance(qh, f, i) (Dot((f)->n, P((qh), (i))) - (f)->d)
+
+/*------------------------------------------------------------------------------*
+ | Quickhull                                                                    |
+ *------------------------------------------------------------------------------*/
+
+static int Grow(qh_t *qh)
+/* Doubles the capacity of the faces array and of the per-face scratch arrays */
+    {
+    int maxfaces = qh->maxfaces ? 2*qh->maxfaces : 64;
+    face_t *faces = (face_t*)MallocNoErr(qh->L, maxfaces*sizeof(face_t));
+    int *list = (int*)MallocNoErr(qh->L, maxfaces*sizeof(int));
+    int *work = (int*)MallocNoErr(qh->L, maxfaces*sizeof(int));
+    if(!faces || !list || !work)
+        {
+        if(faces) Free(qh->L, faces);
+        if(list) Free(qh->L, list);
+        if(work) Free(qh->L, work);
+        return ERR_MEMORY;
+        }
+    if(qh->faces)
+        {
+        memcpy(faces, qh->faces, qh->nfaces*sizeof(face_t));
+        memcpy(list, qh->list, qh->maxfaces*sizeof(int));
+        memcpy(work, qh->work, qh->nwork*sizeof(int));
+        Free(qh->L, qh->faces);
+        Free(qh->L, qh->list);
+        Free(qh->L, qh->work);
+        }
+    qh->faces = faces;
+    qh->list = list;
+    qh->work = work;
+    qh->maxfaces = maxfaces;
+    return 0;
+    }
+
+static int NewFace(qh_t *qh, int a, int b, int c)
+/* Returns the index of the new face, or -1 on memory error */
+    {
+    face_t *f;
+    double e1[3], e2[3], len;
+    if(qh->nfaces == qh->maxfaces && Grow(qh) != 0) return -1;
+    f = &qh->faces[qh->nfaces];
+    memset(f, 0, sizeof(face_t));
+    f->v[0] = a; f->v[1] = b; f->v[2] = c;
+    f->adj[0] = f->adj[1] = f->adj[2] = -1;
+    Sub(e1, P(qh, b), P(qh, a));
+    Sub(e2, P(qh, c), P(qh, a));
+    Cross(f->n, e1, e2);
+    len = sqrt(Dot(f->n, f->n));
+    if(len > 0) { f->n[0] /= len; f->n[1] /= len; f->n[2] /= len; }
+    f->d = Dot(f->n, P(qh, a));
+    f->alive = 1;
+    f->outside = -1;
+    f->cluster = -1;
+    return qh->nfaces++;
+    }
+
+static void AssignPoint(qh_t *qh, int i, int first, int last)
+/* Adds the point to the outside set of the face (among first .. last-1) that it is
+ * farthest from, if any */
+    {
+    int j, best = -1;
+    double dist, bestdist = qh->threshold;
+    face_t *f;
+    for(j = first; j < last; j++)
+        {
+        if(!qh->faces[j].alive) continue;
+        dist = Distance(qh, &qh->faces[j], i);
+        if(dist > bestdist) { bestdist = dist; best = j; }
+        }
+    if(best < 0) return; /* inside */
+    f = &qh->faces[best];
+    if(f->outside < 0)
+        {
+        f->furthest = i;
+        qh->work[qh->nwork++] = best;
+        }
+    else if(bestdist > qh->dist[f->furthest])
+        f->furthest = i;
+    qh->dist[i] = bestdist;
+    qh->pnext[i] = f->outside;
+    f->outside = i;
+    }
+
+static int InitialSimplex(qh_t *qh)
+    {
+    int i, j, k, g, h, i0, i1, i2, i3;
+    int ext[6];
+    double d, best, e1[3], e2[3], c[3], n[3], centroid[3];
+    int tri[4][3];
+    /* extreme points along the axes */
+    for(k = 0; k < 6; k++) ext[k] = 0;
+    for(i = 1; i < qh->np; i++)
+        for(k = 0; k < 3; k++)
+            {
+            if(P(qh, i)[k] < P(qh, ext[k])[k]) ext[k] = i;
+            if(P(qh, i)[k] > P(qh, ext[k+3])[k]) ext[k+3] = i;
+            }
+    /* the most distant pair among them */
+    i0 = i1 = 0; best = 0;
+    for(j = 0; j < 6; j++)
+        for(k = j + 1; k < 6; k++)
+            {
+            Sub(e1, P(qh, ext[j]), P(qh, ext[k]));
+            if((d = Dot(e1, e1)) > best) { best = d; i0 = ext[j]; i1 = ext[k]; }
+            }
+    if(sqrt(best) <= qh->eps) return ERR_VALUE; /* all points coincide */
+    /* the point farthest from the line through them */
+    Sub(e1, P(qh, i1), P(qh, i0));
+    i2 = -1; best = 0;
+    for(i = 0; i < qh->np; i++)
+        {
+        Sub(e2, P(qh, i), P(qh, i0));
+        Cross(c, e1, e2);
+        if((d = Dot(c, c)) > best) { best = d; i2 = i; }
+        }
+    if(i2 < 0 || sqrt(best)/sqrt(Dot(e1, e1)) <= qh->eps) return ERR_VALUE; /* collinear */
+    /* the point farthest from the plane through the three */
+    Sub(e2, P(qh, i2), P(qh, i0));
+    Cross(n, e1, e2);
+    d = sqrt(Dot(n, n));
+    n[0] /= d; n[1] /= d; n[2] /= d;
+    i3 = -1; best = 0;
+    for(i = 0; i < qh->np; i++)
+        {
+        Sub(c, P(qh, i), P(qh, i0));
+        if((d = fabs(Dot(n, c))) > best) { best = d; i3 = i; }
+        }
+    if(i3 < 0 || best <= qh->eps) return ERR_VALUE; /* coplanar */
+    /* the four faces, oriented outward */
+    for(k = 0; k < 3; k++)
+        centroid[k] = (P(qh, i0)[k] + P(qh, i1)[k] + P(qh, i2)[k] + P(qh, i3)[k])/4;
+    tri[0][0] = i0; tri[0][1] = i1; tri[0][2] = i2;
+    tri[1][0] = i0; tri[1][1] = i3; tri[1][2] = i1;
+    tri[2][0] = i1; tri[2][1] = i3; tri[2][2] = i2;
+    tri[3][0] = i2; tri[3][1] = i3; tri[3][2] = i0;
+    Sub(c, P(qh, i3), P(qh, i0));
+    if(Dot(n, c) > 0) /* i3 is above the base: flip all */
+        for(k = 0; k < 4; k++) { j = tri[k][1]; tri[k][1] = tri[k][2]; tri[k][2] = j; }
+    for(k = 0; k < 4; k++)
+        {
+        if(NewFace(qh, tri[k][0], tri[k][1], tri[k][2]) < 0) return ERR_MEMORY;
+        if(Dot(qh->faces[k].n, centroid) - qh->faces[k].d > 0) return ERR_VALUE; /* numerically degenerate */
+        }
+    /* adjacency: the face across a->b is the one with b->a */
+    for(k = 0; k < 4; k++)
+        for(j = 0; j < 3; j++)
+            for(g = 0; g < 4; g++)
+                for(h = 0; h < 3; h++)
+                    if(qh->faces[g].v[h] == qh->faces[k].v[(j+1)%3] && 
+                            qh->faces[g].v[(h+1)%3] == qh->faces[k].v[j])
+                        qh->faces[k].adj[j] = g;
+    for(i = 0; i < qh->np; i++)
+        if(i != i0 && i != i1 && i != i2 && i != i3) AssignPoint(qh, i, 0, 4);
+    return 0;
+    }
+
+static int CountVertices(qh_t *qh, char *mark)
+    {
+    int i, j, count = 0;
+    memset(mark, 0, qh->np);
+    for(i = 0; i < qh->nfaces; i++)
+        {
+        if(!qh->faces[i].alive) continue;
+        for(j = 0; j < 3; j++)
+            if(!mark[qh->faces[i].v[j]]) { mark[qh->faces[i].v[j]] = 1; count++; }
+        }
+    return count;
+    }
+
+static int AddPoint(qh_t *qh, int face, int eye)
+/* Adds the point (the farthest of the outside set of the face) to the hull, replacing 
+ * the faces it sees with a cone of new faces */
+    {
+    int i, j, k, g, a, b, nf, nvisible, firstnew, pt, nextpt;
+    face_t *f;
+    /* the visible faces form a connected region around the face */
+    qh->stamp++;
+    qh->faces[face].stamp = qh->stamp;
+    qh->faces[face].visible = 1;
+    qh->list[0] = face;
+    nvisible = 1;
+    for(i = 0; i < nvisible; i++)
+        {
+        f = &qh->faces[qh->list[i]];
+        for(j = 0; j < 3; j++)
+            {
+            g = f->adj[j];
+            if(qh->faces[g].stamp == qh->stamp) continue;
+            qh->faces[g].stamp = qh->stamp;
+            qh->faces[g].visible = Distance(qh, &qh->faces[g], eye) > qh->eps;
+            if(qh->faces[g].visible) qh->list[nvisible++] = g;
+            }
+        }
+    /* the horizon is made of the edges between visible and non-visible faces: each
+     * horizon edge a->b is the base of a new face (a, b, eye) */
+    firstnew = qh->nfaces;
+    for(i = 0; i < nvisible; i++)
+        for(j = 0; j < 3; j++)
+            {
+            f = &qh->faces[qh->list[i]];
+            g = f->adj[j];
+            if(qh->faces[g].visible) continue;
+            a = f->v[j];
+            b = f->v[(j+1)%3];
+            if((nf = NewFace(qh, a, b, eye)) < 0) return ERR_MEMORY; /* (f may be invalid now) */
+            qh->faces[nf].adj[0] = g;
+            for(k = 0; k < 3; k++)
+                if(qh->faces[g].adj[k] == qh->list[i]) { qh->faces[g].adj[k] = nf; break; }
+            qh->conestart[a] = nf;
+            qh->coneend[b] = nf;
+            }
+    for(nf = firstnew; nf < qh->nfaces; nf++)
+        {
+        f = &qh->faces[nf];
+        f->adj[1] = qh->conestart[f->v[1]]; /* across b->eye */
+        f->adj[2] = qh->coneend[f->v[0]]; /* across eye->a */
+        }
+    for(nf = firstnew; nf < qh->nfaces; nf++)
+        qh->conestart[qh->faces[nf].v[0]] = qh->coneend[qh->faces[nf].v[1]] = -1;
+    /* remove the visible faces, and reassign their outside points to the new faces */
+    for(i = 0; i < nvisible; i++)
+        {
+        f = &qh->faces[qh->list[i]];
+        f->alive = 0;
+        f->visible = 0;
+        for(pt = f->outside; pt >= 0; pt = nextpt)
+            {
+            nextpt = qh->pnext[pt];
+            if(pt != eye) AssignPoint(qh, pt, firstnew, qh->nfaces);
+            }
+        f->outside = -1;
+        }
+    return 0;
+    }
+
+static int Quickhull(qh_t *qh, int maxvertices, char *mark)
+    {
+    int i, face, err;
+    double best;
+    if((err = InitialSimplex(qh)) != 0) return err;
+    for(;;)
+        {
+        if(maxvertices > 0)
+            {
+            /* add the globally farthest point first, so that the hull is the best
+             * approximation with the given no. of vertices */
+            if(CountVertices(qh, mark) >= maxvertices) break;
+            face = -1; best = 0;
+            for(i = 0; i < qh->nfaces; i++)
+                if(qh->faces[i].alive && qh->faces[i].outside >= 0 && 
+                        qh->dist[qh->faces[i].furthest] > best)
+                    { best = qh->dist[qh->faces[i].furthest]; face = i; }
+            }
+        else
+            {
+            face = -1;
+            while(qh->nwork > 0 && face < 0)
+                {
+                face = qh->work[--qh->nwork];
+                if(!qh->faces[face].alive || qh->faces[face].outside < 0) face = -1;
+                }
+            }
+        if(face < 0) break; /* no points left outside */
+        if((err = AddPoint(qh, face, qh->faces[face].furthest)) != 0) return err;
+        }
+    return 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Polygons                                                                     |
+ *------------------------------------------------------------------------------*/
+
+static int Coplanar(qh_t *qh, const face_t *seed, const face_t *f, double mergeeps)
+    {
+    int j;
+    if(Dot(seed->n, f->n) < 0.999) return 0;
+    for(j = 0; j < 3; j++)
+        if(fabs(Distance(qh, seed, f->v[j])) > mergeeps) return 0;
+    return 1;
+    }
+
+static int MergeFaces(qh_t *qh, double mergeeps, int *stack, int *seeds)
+/* Groups adjacent coplanar faces in clusters (polygons), and returns the no. of clusters.
+ * The faces of each cluster are linked in a list headed by its seed face, stored in seeds[] */
+    {
+    int i, j, g, top, nclusters = 0;
+    face_t *seed, *f;
+    for(i = 0; i < qh->nfaces; i++)
+        {
+        seed = &qh->faces[i];
+        if(!seed->alive || seed->cluster >= 0) continue;
+        seed->cluster = nclusters;
+        seed->cnext = -1;
+        seeds[nclusters] = i;
+        stack[0] = i; top = 1;
+        while(top > 0)
+            {
+            f = &qh->faces[stack[--top]];
+            for(j = 0; j < 3; j++)
+                {
+                g = f->adj[j];
+                if(qh->faces[g].cluster >= 0) continue;
+                if(!Coplanar(qh, seed, &qh->faces[g], mergeeps)) continue;
+                qh->faces[g].cluster = nclusters;
+                qh->faces[g].cnext = seed->cnext;
+                seed->cnext = g;
+                stack[top++] = g;
+                }
+            }
+        nclusters++;
+        }
+    return nclusters;
+    }
+
+static int Boundary(qh_t *qh, int seed, int *next, int *loop)
+/* Computes the boundary loop of the polygon made of the faces in the cluster of seed,
+ * and returns its length, or 0 if it is not a single simple loop.
+ * next[] is scratch space, with np entries set to -1 (and reset on return) */
+    {
+    int i, j, a, b, nbound = 0, len = 0, start = -1, ok = 1;
+    int cluster = qh->faces[seed].cluster;
+    for(i = seed; i >= 0; i = qh->faces[i].cnext)
+        for(j = 0; j < 3; j++)
+            {
+            if(qh->faces[qh->faces[i].adj[j]].cluster == cluster) continue; /* internal edge */
+            a = qh->faces[i].v[j];
+            b = qh->faces[i].v[(j+1)%3];
+            if(next[a] >= 0) ok = 0; /* vertex with two outgoing boundary edges */
+            next[a] = b;
+            start = a;
+            nbound++;
+            }
+    if(ok && start >= 0)
+        {
+        a = start;
+        do {
+            loop[len++] = a;
+            a = next[a];
+            } while(a >= 0 && a != start && len < nbound);
+        if(a != start || len != nbound) ok = 0;
+        }
+    /* reset the scratch space */
+    for(i = seed; i >= 0; i = qh->faces[i].cnext)
+        for(j = 0; j < 3; j++) next[qh->faces[i].v[j]] = -1;
+    return ok ? len : 0;
+    }
+
+/*------------------------------------------------------------------------------*
+ | API                                                                          |
+ *------------------------------------------------------------------------------*/
+
+void hull_free(lua_State *L, hull_t *hull)
+    {
+    if(hull->planes) Free(L, hull->planes);
+    if(hull->points) Free(L, hull->points);
+    if(hull->polygons) Free(L, hull->polygons);
+    memset(hull, 0, sizeof(hull_t));
+    }
+
+static void AddPolygon(int *polys, int *npolys, int *nvalues, const int *loop, int len)
+    {
+    int k;
+    polys[(*nvalues)++] = len;
+    for(k = 0; k < len; k++) polys[(*nvalues)++] = loop[k];
+    (*npolys)++;
+    }
+
+int hull_build(lua_State *L, const double *points, int count, double tolerance, int maxvertices, hull_t *hull)
+/* Computes the convex hull of the count points (3 doubles each) and stores its
+ * representation in hull, whose arrays are Malloc()'d (release them with hull_free()).
+ * Returns 0 on success or an ERR_xxx code (ERR_VALUE if the points are degenerate,
+ * e.g. all coplanar) */
+    {
+    qh_t qh;
+    int i, j, k, a, b, err = 0, nclusters, nalive, npolys, nvalues, nverts, len;
+    int *next = NULL, *loop = NULL, *remap = NULL, *stack = NULL, *seeds = NULL, *polys = NULL;
+    char *mark = NULL;
+    double maxabs = 0, d, dmax, *n;
+    const double *u, *v;
+
+    memset(hull, 0, sizeof(hull_t));
+    memset(&qh, 0, sizeof(qh));
+    if(count < 4) return ERR_LENGTH;
+    if(maxvertices > 0 && maxvertices < 4) return ERR_RANGE;
+    qh.L = L;
+    qh.p = points;
+    qh.np = count;
+    for(i = 0; i < 3*count; i++)
+        if(fabs(points[i]) > maxabs) maxabs = fabs(points[i]);
+    /* roundoff bound for the distance of a point from a plane */
+    qh.eps = 3*(3*maxabs)*DBL_EPSILON*16;
+    qh.threshold = qh.eps + (tolerance > 0 ? tolerance : 0);
+#define CHECK(p) do { if(!(p)) { err = ERR_MEMORY; goto done; } } while(0)
+    qh.pnext = (int*)MallocNoErr(L, count*sizeof(int)); CHECK(qh.pnext);
+    qh.dist = (double*)MallocNoErr(L, count*sizeof(double)); CHECK(qh.dist);
+    qh.conestart = (int*)MallocNoErr(L, count*sizeof(int)); CHECK(qh.conestart);
+    qh.coneend = (int*)MallocNoErr(L, count*sizeof(int)); CHECK(qh.coneend);
+    for(i = 0; i < count; i++) qh.conestart[i] = qh.coneend[i] = -1;
+    mark = (char*)MallocNoErr(L, count); CHECK(mark);
+    if((err = Quickhull(&qh, maxvertices, mark)) != 0) goto done;
+
+    /* merge coplanar faces into polygons */
+    nalive = 0;
+    for(i = 0; i < qh.nfaces; i++)
+        if(qh.faces[i].alive) nalive++;
+    stack = (int*)MallocNoErr(L, nalive*sizeof(int)); CHECK(stack);
+    seeds = (int*)MallocNoErr(L, nalive*sizeof(int)); CHECK(seeds);
+    nclusters = MergeFaces(&qh, 100*qh.eps + (tolerance > 0 ? tolerance : 0), stack, seeds);
+    next = (int*)MallocNoErr(L, count*sizeof(int)); CHECK(next);
+    loop = (int*)MallocNoErr(L, count*sizeof(int)); CHECK(loop);
+    remap = (int*)MallocNoErr(L, count*sizeof(int)); CHECK(remap);
+    polys = (int*)MallocNoErr(L, 4*nalive*sizeof(int)); CHECK(polys);
+    for(i = 0; i < count; i++) { next[i] = -1; remap[i] = -1; }
+    npolys = nvalues = 0;
+    for(k = 0; k < nclusters; k++)
+        {
+        len = Boundary(&qh, seeds[k], next, loop);
+        if(len >= 3)
+            AddPolygon(polys, &npolys, &nvalues, loop, len);
+        else /* not a simple polygon: dissolve the cluster into its triangles */
+            for(i = seeds[k]; i >= 0; i = qh.faces[i].cnext)
+                AddPolygon(polys, &npolys, &nvalues, qh.faces[i].v, 3);
+        }
+
+    /* output, with the vertices renumbered in order of appearance */
+    hull->planes = (double*)MallocNoErr(L, 4*npolys*sizeof(double)); CHECK(hull->planes);
+    hull->polygons = (unsigned int*)MallocNoErr(L, nvalues*sizeof(unsigned int)); CHECK(hull->polygons);
+    nverts = 0;
+    for(i = 0; i < nvalues; i += len + 1)
+        {
+        len = polys[i];
+        for(j = 1; j <= len; j++)
+            if(remap[polys[i+j]] < 0) remap[polys[i+j]] = nverts++;
+        }
+    hull->points = (double*)MallocNoErr(L, 3*nverts*sizeof(double)); CHECK(hull->points);
+    for(i = 0; i < count; i++)
+        if(remap[i] >= 0) memcpy(hull->points + 3*remap[i], P(&qh, i), 3*sizeof(double));
+    for(i = 0, k = 0; i < nvalues; i += len + 1, k++)
+        {
+        len = polys[i];
+        hull->polygons[i] = len;
+        /* plane: Newell's normal, and the offset of the outermost vertex */
+        n = hull->planes + 4*k;
+        n[0] = n[1] = n[2] = 0;
+        for(j = 0; j < len; j++)
+            {
+            a = polys[i + 1 + j];
+            b = polys[i + 1 + (j + 1) % len];
+            u = P(&qh, a); v = P(&qh, b);
+            n[0] += (u[1] - v[1])*(u[2] + v[2]);
+            n[1] += (u[2] - v[2])*(u[0] + v[0]);
+            n[2] += (u[0] - v[0])*(u[1] + v[1]);
+            hull->polygons[i + 1 + j] = remap[a];
+            }
+        d = sqrt(Dot(n, n));
+        if(d > 0) { n[0] /= d; n[1] /= d; n[2] /= d; }
+        dmax = -DBL_MAX;
+        for(j = 0; j < len; j++)
+            if((d = Dot(n, P(&qh, polys[i + 1 + j]))) > dmax) dmax = d;
+        n[3] = dmax;
+        }
+    hull->planecount = npolys;
+    hull->pointcount = nverts;
+    hull->polygonslen = nvalues;
+done:
+#undef CHECK
+    if(err) hull_free(L, hull);
+    if(qh.faces) Free(L, qh.faces);
+    if(qh.list) Free(L, qh.list);
+    if(qh.work) Free(L, qh.work);
+    if(qh.pnext) Free(L, qh.pnext);
+    if(qh.dist) Free(L, qh.dist);
+    if(qh.conestart) Free(L, qh.conestart);
+    if(qh.coneend) Free(L, qh.coneend);
+    if(mark) Free(L, mark);
+    if(stack) Free(L, stack);
+    if(seeds) Free(L, seeds);
+    if(next) Free(L, next);
+    if(loop) Free(L, loop);
+    if(remap) Free(L, remap);
+    if(polys) Free(L, polys);
+    return err;
+    }
+
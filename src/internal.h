@@ -56,6 +56,9 @@
 #define checkflags(L, arg) luaL_checkinteger((L), (arg))
 #define optflags(L, arg, defval) luaL_optinteger((L), (arg), (defval))
 #define pushflags(L, val) lua_pushinteger((L), (val))
+/* rayflags */
+#define RAY_ANY_HIT         0x00000001
+#define RAY_BACKFACE_CULL   0x00000002
 
 /* utils.c */
 void moonode_utils_init(lua_State *L);
@@ -227,10 +230,236 @@ int jointdestroy(lua_State *L, joint_t joint);
 #define geomdestroy moonode_geomdestroy
 int geomdestroy(lua_State *L, geom_t geom);
 
+/* geom_trimesh.c */
+#define trimeshsavetransforms moonode_trimeshsavetransforms
+void trimeshsavetransforms(lua_State *L, world_t world);
+#define trimeshdatachanged moonode_trimeshdatachanged
+void trimeshdatachanged(lua_State *L, tmdata_t tmdata);
+
+/* geom_heightfield.c */
+#define heightfielddatachanged moonode_heightfielddatachanged
+void heightfielddatachanged(lua_State *L, hfdata_t hfdata);
+
 /* space.c */
 #define spacedestroy moonode_spacedestroy
 int spacedestroy(lua_State *L, space_t space);
 
+/* space_split.c */
+#define issplitspace moonode_issplitspace
+int issplitspace(space_t space);
+#define splitspacecollide moonode_splitspacecollide
+void splitspacecollide(lua_State *L, space_t space, void *data, dNearCallback *callback);
+#define splitspacecollide2 moonode_splitspacecollide2
+void splitspacecollide2(lua_State *L, space_t space, geom_t geom, void *data, dNearCallback *callback);
+#define splitspacegeomdestroyed moonode_splitspacegeomdestroyed
+void splitspacegeomdestroyed(geom_t geom);
+#define splitspacegeomchanged moonode_splitspacegeomchanged
+void splitspacegeomchanged(geom_t geom);
+#define splitspacestatics moonode_splitspacestatics
+space_t splitspacestatics(space_t space);
+#define splitspacestaticsbvh moonode_splitspacestaticsbvh
+struct moonode_bvh_s *splitspacestaticsbvh(space_t space);
+
+/* bvh.c */
+#define bvh_t moonode_bvh_t
+typedef struct moonode_bvh_s bvh_t;
+#define bvh_item_t moonode_bvh_item_t
+typedef struct {
+    geom_t geom;
+    double aabb[6];
+} bvh_item_t;
+#define bvh_func_t moonode_bvh_func_t
+typedef int (*bvh_func_t)(const bvh_item_t *item, void *data);
+#define bvh_build moonode_bvh_build
+bvh_t *bvh_build(lua_State *L, const bvh_item_t *items, int count);
+#define bvh_free moonode_bvh_free
+void bvh_free(lua_State *L, bvh_t *bvh);
+#define bvh_count moonode_bvh_count
+int bvh_count(bvh_t *bvh);
+#define bvh_query_box moonode_bvh_query_box
+int bvh_query_box(bvh_t *bvh, const double box[6], bvh_func_t func, void *data);
+#define bvh_query_ray moonode_bvh_query_ray
+int bvh_query_ray(bvh_t *bvh, const double origin[3], const double dir[3], const double *maxlen, bvh_func_t func, void *data);
+#define bvh_query_planes moonode_bvh_query_planes
+int bvh_query_planes(bvh_t *bvh, const double *planes, int count, bvh_func_t func, void *data);
+#define bvh_classify_planes moonode_bvh_classify_planes
+int bvh_classify_planes(const double aabb[6], const double *planes, int count);
+#define bvh_items moonode_bvh_items
+const bvh_item_t *bvh_items(bvh_t *bvh);
+
+/* hull.c */
+#define hull_t moonode_hull_t
+typedef struct {
+    double *planes; /* planecount planes (a, b, c, d) */
+    int planecount;
+    double *points; /* pointcount points (x, y, z) */
+    int pointcount;
+    unsigned int *polygons; /* planecount polygons (n, i1, ..., in), polygonslen values */
+    int polygonslen;
+} hull_t;
+#define hull_build moonode_hull_build
+int hull_build(lua_State *L, const double *points, int count, double tolerance, int maxvertices, hull_t *hull);
+#define hull_free moonode_hull_free
+void hull_free(lua_State *L, hull_t *hull);
+
+/* datahandling.c */
+#define sizeoftype moonode_sizeoftype
+size_t sizeoftype(int type);
+#define toflattable moonode_toflattable
+int toflattable(lua_State *L, int arg);
+#define testdata moonode_testdata
+int testdata(lua_State *L, int type, size_t n, void *dst, size_t dstsize);
+#define checkdata moonode_checkdata
+int checkdata(lua_State *L, int arg, int type, void *dst, size_t dstsize);
+#define countdata moonode_countdata
+size_t countdata(lua_State *L, int first, int last, int exact);
+#define packdata moonode_packdata
+int packdata(lua_State *L, int type, int first, int last, void *dst, size_t cap, size_t *count);
+#define convertdata moonode_convertdata
+void convertdata(int dsttype, void *dst, int srctype, const void *src, size_t count, double scale, double bias);
+#define pushdata moonode_pushdata
+int pushdata(lua_State *L, int type, void *data, size_t datalen);
+
+/* buffer.c */
+struct moonode_buffer_s {
+    char *data;
+    size_t size;
+    int pins; /* no. of objects using data in place */
+    int orphan; /* the buffer object was collected while pinned */
+};
+#define bufferptr moonode_bufferptr
+void *bufferptr(lua_State *L, buffer_t buffer, size_t offset, size_t len, int arg);
+#define bufferreserve moonode_bufferreserve
+void *bufferreserve(lua_State *L, buffer_t buffer, size_t offset, size_t len);
+#define bufferpin moonode_bufferpin
+void bufferpin(buffer_t buffer);
+#define bufferunpin moonode_bufferunpin
+void bufferunpin(lua_State *L, buffer_t buffer);
+#define checkoffset moonode_checkoffset
+size_t checkoffset(lua_State *L, int arg);
+
+/* mapfile.c */
+#define mapfile_t moonode_mapfile_t
+typedef struct moonode_mapfile_s mapfile_t;
+struct moonode_mapfile_s {
+    const char *data; /* read-only */
+    size_t size;
+};
+#define mapfile_open moonode_mapfile_open
+mapfile_t *mapfile_open(lua_State *L, const char *filename);
+#define mapfile_close moonode_mapfile_close
+void mapfile_close(lua_State *L, mapfile_t *map);
+#define mapfile_save moonode_mapfile_save
+int mapfile_save(const char *filename, const void *header, size_t headerlen, 
+                const void *data1, size_t len1, const void *data2, size_t len2);
+#define pagefile_t moonode_pagefile_t
+typedef struct moonode_pagefile_s pagefile_t;
+#define pagefile_open moonode_pagefile_open
+pagefile_t *pagefile_open(lua_State *L, const char *filename);
+#define pagefile_size moonode_pagefile_size
+uint64_t pagefile_size(pagefile_t *pf);
+#define pagefile_read moonode_pagefile_read
+int pagefile_read(pagefile_t *pf, uint64_t offset, void *dst, size_t len);
+#define pagefile_close moonode_pagefile_close
+void pagefile_close(lua_State *L, pagefile_t *pf);
+
+/* mesh.c */
+struct moonode_mesh_s {
+    int vertextype; /* DATATYPE_FLOAT or DATATYPE_DOUBLE */
+    int pcount; /* no. of vertices */
+    int icount; /* no. of indices (3 per triangle, 0 if the mesh has no indices) */
+    void *positions;
+    void *indices;
+    mapfile_t *map; /* mapped file containing positions and indices (if any) */
+    int refcount; /* the mesh object, plus the tmdata objects using it */
+};
+#define meshref moonode_meshref
+void meshref(mesh_t mesh);
+#define meshunref moonode_meshunref
+void meshunref(lua_State *L, mesh_t mesh);
+
+/* convexdata.c */
+struct moonode_convexdata_s {
+    double *planes; /* planecount planes (a, b, c, d) */
+    int planecount;
+    double *points; /* pointcount points (x, y, z) */
+    int pointcount;
+    unsigned int *polygons; /* planecount polygons (n, i1, ..., in) */
+    int refcount; /* the convexdata object (if any), plus the geoms using it */
+};
+#define convexdataref moonode_convexdataref
+void convexdataref(convexdata_t data);
+#define convexdataunref moonode_convexdataunref
+void convexdataunref(lua_State *L, convexdata_t data);
+#define convexdatacheck moonode_convexdatacheck
+convexdata_t convexdatacheck(lua_State *L, int arg);
+#define convexdatahull moonode_convexdatahull
+convexdata_t convexdatahull(lua_State *L, int arg);
+#define convexdatafromhull moonode_convexdatafromhull
+convexdata_t convexdatafromhull(lua_State *L, hull_t *hull);
+#define newconvexdata moonode_newconvexdata
+int newconvexdata(lua_State *L, convexdata_t data);
+
+/* pairs.c */
+#define pair_t moonode_pair_t
+typedef struct {
+    geom_t g1, g2;
+    uint32_t stamp; /* last frame the pair was found */
+    int state; /* PAIR_XXX */
+    double value, maxvalue; /* user specific */
+} pair_t;
+#define PAIR_FREE   0
+#define PAIR_NEW    1 /* found for the first time in the current frame */
+#define PAIR_ACTIVE 2 /* found since a previous frame */
+#define PAIR_DEAD   3 /* removed (tombstone) */
+#define pairtable_t moonode_pairtable_t
+typedef struct {
+    pair_t *pairs;
+    int cap, used, live;
+} pairtable_t;
+#define pairtable_find moonode_pairtable_find
+pair_t *pairtable_find(pairtable_t *t, geom_t g1, geom_t g2);
+#define pairtable_insert moonode_pairtable_insert
+pair_t *pairtable_insert(lua_State *L, pairtable_t *t, geom_t g1, geom_t g2);
+#define pairtable_remove moonode_pairtable_remove
+void pairtable_remove(pairtable_t *t, pair_t *pair);
+#define pairtable_purge moonode_pairtable_purge
+void pairtable_purge(pairtable_t *t, geom_t geom);
+#define pairtable_compact moonode_pairtable_compact
+void pairtable_compact(lua_State *L, pairtable_t *t);
+#define pairtable_index moonode_pairtable_index
+int pairtable_index(lua_State *L, geom_t geom);
+
+/* sensor.c */
+#define sensorpair moonode_sensorpair
+int sensorpair(lua_State *L, geom_t o1, geom_t o2);
+#define sensorcount moonode_sensorcount
+int sensorcount(void);
+#define sensorgeomdestroyed moonode_sensorgeomdestroyed
+void sensorgeomdestroyed(geom_t geom);
+
+/* contact_tracker.c */
+#define contactfeedbackpooled moonode_contactfeedbackpooled
+int contactfeedbackpooled(jointfeedback_t *fb);
+#define contacttrack moonode_contacttrack
+void contacttrack(lua_State *L, joint_t joint, geom_t o1, geom_t o2);
+#define contactgeomdestroyed moonode_contactgeomdestroyed
+void contactgeomdestroyed(geom_t geom);
+
+/* distance.c */
+#define geomdistance moonode_geomdistance
+int geomdistance(geom_t g1, geom_t g2, double *dist, double p1[3], double p2[3]);
+
+/* tmdata.c */
+#define tmdata_parsefile moonode_tmdata_parsefile
+int tmdata_parsefile(mapfile_t *map, int *vertextype, int *pcount, int *icount, void **positions, void **indices);
+#define tmdata_getdata moonode_tmdata_getdata
+void tmdata_getdata(ud_t *ud, int *vertextype, int *pcount, const void **positions, int *icount, const uint32_t **indices);
+#define tmdata_positionstride moonode_tmdata_positionstride
+int tmdata_positionstride(int vertextype);
+#define tmdata_checkdata moonode_tmdata_checkdata
+const char *tmdata_checkdata(lua_State *L, int arg, size_t *len, buffer_t *buffer);
+
 /* main.c */
 extern lua_State *moonode_L;
 int luaopen_moonode(lua_State *L);
@@ -265,6 +494,7 @@ void moonode_open_space_simple(lua_State *L);
 void moonode_open_space_hash(lua_State *L);
 void moonode_open_space_quadtree(lua_State *L);
 void moonode_open_space_sap(lua_State *L);
+void moonode_open_space_split(lua_State *L);
 void moonode_open_geom(lua_State *L);
 void moonode_open_geom_sphere(lua_State *L);
 void moonode_open_geom_convex(lua_State *L);
@@ -278,6 +508,14 @@ void moonode_open_geom_trimesh(lua_State *L);
 void moonode_open_hfdata(lua_State *L);
 void moonode_open_tmdata(lua_State *L);
 void moonode_open_datahandling(lua_State *L);
+void moonode_open_buffer(lua_State *L);
+void moonode_open_mesh(lua_State *L);
+void moonode_open_convexdata(lua_State *L);
+void moonode_open_decompose(lua_State *L);
+void moonode_open_space_query(lua_State *L);
+void moonode_open_distance(lua_State *L);
+void moonode_open_sensor(lua_State *L);
+void moonode_open_contact_tracker(lua_State *L);
 
 /*------------------------------------------------------------------------------*
  | Debug and other utilities                                                    |
@@ -34,7 +34,7 @@ int jointdestroy(lua_State *L, joint_t joint)
     if(fb) 
         {
         dJointSetFeedback(joint, 0);
-        Free(L, fb);
+        if(!contactfeedbackpooled(fb)) Free(L, fb);
         }
     dJointDestroy(joint);
     return 0;
@@ -180,9 +180,9 @@ static int SetFeedback(lua_State *L)
     else
         {
         if(!fb) return 0; // already off
-        // disable and free the struct
+        // disable and free the struct (unless owned by the contact tracker)
         dJointSetFeedback(joint, 0);
-        Free(L, fb);
+        if(!contactfeedbackpooled(fb)) Free(L, fb);
         }
     return 0;
     }
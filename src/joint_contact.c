@@ -44,6 +44,49 @@ static int newjoint(lua_State *L, joint_t joint, ud_t *world_ud, int groupid)
     return 1;
     }
 
+static int newhandlejoint(lua_State *L, joint_t joint, ud_t *world_ud, int groupid)
+/* same as newjoint(), without a Lua userdata (see newhandle) */
+    {
+    ud_t *ud;
+    ud = newhandle(L, joint, JOINT_CONTACT_MT, "joint_contact");
+    ud->parent_ud = world_ud;
+    ud->destructor = freejoint;
+    ud->groupid = groupid;
+    return 0;
+    }
+
+typedef struct {
+    joint_t joint;
+    ud_t *world_ud;
+    int groupid;
+} handlejoint_t;
+
+static int NewHandleJoint(lua_State *L)
+/* newhandlejoint() in protected mode */
+    {
+    handlejoint_t *h = (handlejoint_t*)lua_touserdata(L, 1);
+    return newhandlejoint(L, h->joint, h->world_ud, h->groupid);
+    }
+
+static void checksurface(lua_State *L, int arg, surface_parameters_t *surface)
+    {
+    switch(lua_type(L, arg))
+        {
+        case LUA_TNIL:
+        case LUA_TNONE: break;
+        case LUA_TSTRING: /* binary string previously packed with pack_surface_parameters() */
+                {
+                size_t len;
+                const char *s = lua_tolstring(L, arg, &len);
+                if(len!=sizeof(surface_parameters_t)) { argerror(L, arg, ERR_LENGTH); return; }
+                memcpy(surface, s, sizeof(surface_parameters_t));
+                break;
+                }
+        default:
+            checksurfaceparameters(L, arg, surface);
+        }
+    }
+
 static int PackSurfaceParameters(lua_State *L)
     {
     surface_parameters_t surface;
@@ -72,38 +115,64 @@ static int GroupDestroy(lua_State *L)
 
 static int Create(lua_State *L)
     {
-    int t;
     ud_t *world_ud;
     contact_t contact;
     world_t world = checkworld(L, 1, &world_ud);
     int groupid = luaL_checkinteger(L, 2);
     memset(&contact, 0, sizeof(contact_t));
     checkcontactpoint(L, 3, &contact.geom);
-    t = lua_type(L, 4);
-    switch(t)
-        {
-        case LUA_TNIL:
-        case LUA_TNONE: break;
-        case LUA_TSTRING: /* binary string previously packed with pack_surface_parameters() */
-                {
-                size_t len;
-                const char *s = lua_tolstring(L, 4, &len);
-                if(len!=sizeof(surface_parameters_t)) return argerror(L, 4, ERR_LENGTH);
-                memcpy(&contact.surface, s, sizeof(surface_parameters_t));
-                break;
-                }
-        default:
-            checksurfaceparameters(L, 4, &contact.surface);
-        }
+    checksurface(L, 4, &contact.surface);
     if(!lua_isnoneornil(L, 5))
         {
         checkvec3(L, 5, contact.fdir1);
         contact.surface.mode = contact.surface.mode | dContactFDir1;
         }
     joint_t joint = dJointCreateContact(world, 0 /* native ODE groups not used here */, &contact);
+    contacttrack(L, joint, contact.geom.g1, contact.geom.g2);
     return newjoint(L, joint, world_ud, groupid);
     }
 
+#define MAX_CONTACTS        256
+
+static int CreateContacts(lua_State *L)
+/* Collides two geoms and creates a contact joint for each contact point, attached
+ * to the geoms' bodies. The joints are created without Lua userdata.
+ */
+    {
+    int n, i;
+    ud_t *world_ud;
+    contact_t contact;
+    contact_point_t contacts[MAX_CONTACTS];
+    handlejoint_t h;
+    world_t world = checkworld(L, 1, &world_ud);
+    int groupid = luaL_checkinteger(L, 2);
+    geom_t o1 = checkgeom(L, 3, NULL);
+    geom_t o2 = checkgeom(L, 4, NULL);
+    int max_contacts = luaL_checkinteger(L, 5);
+    int flags = optflags(L, 7, 0); /* collideflags */
+    memset(&contact, 0, sizeof(contact_t));
+    checksurface(L, 6, &contact.surface);
+    if(max_contacts<1 || max_contacts > MAX_CONTACTS)
+        return argerror(L, 5, ERR_RANGE);
+    n = dCollide(o1, o2, (flags&0xffff0000) | max_contacts, contacts, sizeof(contact_point_t));
+    h.world_ud = world_ud;
+    h.groupid = groupid;
+    for(i=0; i<n; i++)
+        {
+        contact.geom = contacts[i];
+        h.joint = dJointCreateContact(world, 0 /* native ODE groups not used here */, &contact);
+        /* the joint has no owner until the handle is created, so destroy it on failure */
+        lua_pushcfunction(L, NewHandleJoint);
+        lua_pushlightuserdata(L, &h);
+        if(lua_pcall(L, 1, 0, 0) != LUA_OK)
+            { dJointDestroy(h.joint); return lua_error(L); }
+        dJointAttach(h.joint, dGeomGetBody(o1), dGeomGetBody(o2));
+        contacttrack(L, h.joint, o1, o2);
+        }
+    lua_pushinteger(L, n);
+    return 1;
+    }
+
 DESTROY_FUNC(joint)
 
 static const struct luaL_Reg Methods[] = 
@@ -122,6 +191,7 @@ static const struct luaL_Reg Functions[] =
     {
         { "pack_surfaceparameters", PackSurfaceParameters },
         { "create_contact_joint", Create },
+        { "create_contact_joints", CreateContacts },
         { "destroy_joint_group", GroupDestroy },
         { NULL, NULL } /* sentinel */
     };
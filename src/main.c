@@ -167,6 +167,7 @@ int luaopen_moonode(lua_State *L)
     moonode_open_space_hash(L);
     moonode_open_space_quadtree(L);
     moonode_open_space_sap(L);
+    moonode_open_space_split(L);
     moonode_open_geom(L);
     moonode_open_geom_sphere(L);
     moonode_open_geom_convex(L);
@@ -180,6 +181,14 @@ int luaopen_moonode(lua_State *L)
     moonode_open_hfdata(L);
     moonode_open_tmdata(L);
     moonode_open_datahandling(L);
+    moonode_open_buffer(L);
+    moonode_open_mesh(L);
+    moonode_open_convexdata(L);
+    moonode_open_decompose(L);
+    moonode_open_space_query(L);
+    moonode_open_distance(L);
+    moonode_open_sensor(L);
+    moonode_open_contact_tracker(L);
 
     /* Add functions implemented in Lua */
     lua_pushvalue(L, -1); lua_setglobal(L, "moonode");
@@ -0,0 +1,201 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Read-only file mappings, used to load large datasets (trimesh and heightfield data)
+ * in place. On platforms without mmap() the file is read in memory instead.
+ */
+
+#if defined(LINUX)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+
+mapfile_t *mapfile_open(lua_State *L, const char *filename)
+/* Maps the whole file, raising an error on failure */
+    {
+    mapfile_t *map;
+#if defined(LINUX)
+    struct stat st;
+    void *ptr;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) 
+        { luaL_error(L, "%s '%s'", errstring(ERR_FOPEN), filename); return NULL; }
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+        close(fd);
+        luaL_error(L, "%s '%s'", errstring(ERR_LENGTH), filename);
+        return NULL;
+        }
+    ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping stays valid */
+    if(ptr == MAP_FAILED)
+        { luaL_error(L, "cannot map file '%s'", filename); return NULL; }
+    map = (mapfile_t*)MallocNoErr(L, sizeof(mapfile_t));
+    if(!map)
+        { munmap(ptr, st.st_size); errmemory(L); return NULL; }
+    map->data = (const char*)ptr;
+    map->size = st.st_size;
+#else
+    long size;
+    char *data;
+    FILE *f = fopen(filename, "rb");
+    if(!f) 
+        { luaL_error(L, "%s '%s'", errstring(ERR_FOPEN), filename); return NULL; }
+    if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET) != 0)
+        {
+        fclose(f);
+        luaL_error(L, "%s '%s'", errstring(ERR_LENGTH), filename);
+        return NULL;
+        }
+    data = (char*)MallocNoErr(L, size);
+    map = (mapfile_t*)MallocNoErr(L, sizeof(mapfile_t));
+    if(!data || !map)
+        { fclose(f); Free(L, data); Free(L, map); errmemory(L); return NULL; }
+    if(fread(data, 1, size, f) != (size_t)size)
+        {
+        fclose(f); Free(L, data); Free(L, map);
+        luaL_error(L, "cannot read file '%s'", filename);
+        return NULL;
+        }
+    fclose(f);
+    map->data = data;
+    map->size = size;
+#endif
+    return map;
+    }
+
+void mapfile_close(lua_State *L, mapfile_t *map)
+    {
+#if defined(LINUX)
+    munmap((void*)map->data, map->size);
+#else
+    Free(L, (void*)map->data);
+#endif
+    Free(L, map);
+    }
+
+int mapfile_save(const char *filename, const void *header, size_t headerlen, 
+                const void *data1, size_t len1, const void *data2, size_t len2)
+/* Writes a file with a header followed by up to two data chunks (data2 may be NULL).
+ * Returns ERR_xxx on failure, 0 on success */
+    {
+    FILE *f = fopen(filename, "wb");
+    if(!f) return ERR_FOPEN;
+    if((fwrite(header, 1, headerlen, f) != headerlen) ||
+       (len1 > 0 && fwrite(data1, 1, len1, f) != len1) ||
+       (len2 > 0 && fwrite(data2, 1, len2, f) != len2))
+        { fclose(f); return ERR_OPERATION; }
+    if(fclose(f) != 0) return ERR_OPERATION;
+    return 0;
+    }
+
+/* Paged access to (possibly huge) files, for datasets that are loaded piecewise on 
+ * demand rather than mapped as a whole. */
+
+struct moonode_pagefile_s {
+#if defined(LINUX)
+    int fd;
+#else
+    FILE *f;
+#endif
+    uint64_t size;
+};
+
+pagefile_t *pagefile_open(lua_State *L, const char *filename)
+/* Opens the file for reading, raising an error on failure */
+    {
+    pagefile_t *pf;
+#if defined(LINUX)
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) 
+        { luaL_error(L, "%s '%s'", errstring(ERR_FOPEN), filename); return NULL; }
+    if(fstat(fd, &st) != 0)
+        {
+        close(fd);
+        luaL_error(L, "%s '%s'", errstring(ERR_FOPEN), filename);
+        return NULL;
+        }
+    pf = (pagefile_t*)MallocNoErr(L, sizeof(pagefile_t));
+    if(!pf) { close(fd); errmemory(L); return NULL; }
+    pf->fd = fd;
+    pf->size = st.st_size;
+#else
+    long size;
+    FILE *f = fopen(filename, "rb");
+    if(!f) 
+        { luaL_error(L, "%s '%s'", errstring(ERR_FOPEN), filename); return NULL; }
+    if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+        {
+        fclose(f);
+        luaL_error(L, "%s '%s'", errstring(ERR_FOPEN), filename);
+        return NULL;
+        }
+    pf = (pagefile_t*)MallocNoErr(L, sizeof(pagefile_t));
+    if(!pf) { fclose(f); errmemory(L); return NULL; }
+    pf->f = f;
+    pf->size = size;
+#endif
+    return pf;
+    }
+
+uint64_t pagefile_size(pagefile_t *pf)
+    { return pf->size; }
+
+int pagefile_read(pagefile_t *pf, uint64_t offset, void *dst, size_t len)
+/* Reads len bytes at the given offset. Returns ERR_xxx on failure, 0 on success */
+    {
+    if(offset > pf->size || len > pf->size - offset) return ERR_BOUNDARIES;
+#if defined(LINUX)
+    while(len > 0)
+        {
+        ssize_t n = pread(pf->fd, dst, len, offset);
+        if(n <= 0) return ERR_OPERATION;
+        dst = (char*)dst + n;
+        offset += n;
+        len -= n;
+        }
+#else
+    if(fseek(pf->f, (long)offset, SEEK_SET) != 0) return ERR_OPERATION;
+    if(fread(dst, 1, len, pf->f) != len) return ERR_OPERATION;
+#endif
+    return 0;
+    }
+
+void pagefile_close(lua_State *L, pagefile_t *pf)
+    {
+#if defined(LINUX)
+    close(pf->fd);
+#else
+    fclose(pf->f);
+#endif
+    Free(L, pf);
+    }
+
@@ -0,0 +1,180 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* A mesh is a reference-counted vertex storage (positions and indices) that can be
+ * shared by any number of tmdata objects, so that instances of the same mesh, or
+ * different LODs or index subsets of it, do not need a copy each.
+ * The storage is released when both the mesh object and all the tmdata objects
+ * built on it are gone.
+ */
+
+/*------------------------------------------------------------------------------*
+ | Internal API                                                                 |
+ *------------------------------------------------------------------------------*/
+
+void meshref(mesh_t mesh)
+    { mesh->refcount++; }
+
+void meshunref(lua_State *L, mesh_t mesh)
+    {
+    if(--mesh->refcount > 0) return;
+    if(mesh->map)
+        mapfile_close(L, mesh->map);
+    else
+        {
+        if(mesh->positions) Free(L, mesh->positions);
+        if(mesh->indices) Free(L, mesh->indices);
+        }
+    Free(L, mesh);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Methods                                                                      |
+ *------------------------------------------------------------------------------*/
+
+static int freemesh(lua_State *L, ud_t *ud)
+    {
+    mesh_t mesh = (mesh_t)ud->handle;
+    if(!freeuserdata(L, ud, "mesh")) return 0;
+    meshunref(L, mesh);
+    return 0;
+    }
+
+static int newmesh(lua_State *L, mesh_t mesh)
+    {
+    ud_t *ud;
+    mesh->refcount = 1; /* owned by the mesh object */
+    ud = newuserdata(L, mesh, MESH_MT, "mesh");
+    ud->parent_ud = NULL;
+    ud->destructor = freemesh;
+    return 1;
+    }
+
+static void *copydata(lua_State *L, mesh_t mesh, const char *data, size_t len)
+    {
+    void *p = MallocNoErr(L, len);
+    if(!p) { meshunref(L, mesh); errmemory(L); return NULL; }
+    memcpy(p, data, len);
+    return p;
+    }
+
+static int Create(lua_State *L)
+    {
+    int pstride;
+    mesh_t mesh;
+    buffer_t buffer;
+    size_t plen, ilen = 0;
+    const char *positions, *indices = NULL;
+    int vertextype = checkdatatype(L, 1);
+    if((pstride = tmdata_positionstride(vertextype)) == 0)
+        return argerror(L, 1, ERR_VALUE);
+    positions = tmdata_checkdata(L, 2, &plen, &buffer);
+    if(plen==0 || plen % pstride != 0)
+        return argerror(L, 2, ERR_LENGTH);
+    if(!lua_isnoneornil(L, 3))
+        {
+        indices = tmdata_checkdata(L, 3, &ilen, &buffer);
+        if(ilen==0 || ilen % (3*sizeof(uint32_t)) != 0)
+            return argerror(L, 3, ERR_LENGTH);
+        }
+    mesh = (mesh_t)Malloc(L, sizeof(struct moonode_mesh_s));
+    memset(mesh, 0, sizeof(struct moonode_mesh_s));
+    mesh->refcount = 1;
+    mesh->vertextype = vertextype;
+    mesh->pcount = plen / pstride;
+    mesh->icount = ilen / sizeof(uint32_t);
+    /* the data is copied once here, and then shared by all the tmdata built on the mesh */
+    mesh->positions = copydata(L, mesh, positions, plen);
+    if(indices)
+        mesh->indices = copydata(L, mesh, indices, ilen);
+    return newmesh(L, mesh);
+    }
+
+static int CreateFromFile(lua_State *L)
+/* Same file format as create_tmdata_from_file(), mapped in place */
+    {
+    int err;
+    mesh_t mesh;
+    mapfile_t *map;
+    const char *filename = luaL_checkstring(L, 1);
+    map = mapfile_open(L, filename);
+    mesh = (mesh_t)MallocNoErr(L, sizeof(struct moonode_mesh_s));
+    if(!mesh)
+        { mapfile_close(L, map); return errmemory(L); }
+    memset(mesh, 0, sizeof(struct moonode_mesh_s));
+    err = tmdata_parsefile(map, &mesh->vertextype, &mesh->pcount, &mesh->icount,
+            &mesh->positions, &mesh->indices);
+    if(err)
+        {
+        mapfile_close(L, map);
+        Free(L, mesh);
+        return argerror(L, 1, err);
+        }
+    mesh->map = map;
+    return newmesh(L, mesh);
+    }
+
+static int GetInfo(lua_State *L)
+    {
+    mesh_t mesh = checkmesh(L, 1, NULL);
+    pushdatatype(L, mesh->vertextype);
+    lua_pushinteger(L, mesh->pcount);
+    lua_pushinteger(L, mesh->icount / 3);
+    lua_pushinteger(L, mesh->refcount - 1);
+    return 4;
+    }
+
+RAW_FUNC(mesh)
+DESTROY_FUNC(mesh)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raw", Raw },
+        { "get_info", GetInfo },
+        { "destroy", Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_mesh", Create },
+        { "create_mesh_from_file", CreateFromFile },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_mesh(lua_State *L)
+    {
+    udata_define(L, MESH_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -25,11 +25,8 @@
 
 #include "internal.h"
 
-ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracename)
+static ud_t *initud(ud_t *ud, void *handle, const char *tracename)
     {
-    ud_t *ud;
-    /* we use handle as search key */
-    ud = (ud_t*)udata_new(L, sizeof(ud_t), (uint64_t)(uintptr_t)handle, mt);
     memset(ud, 0, sizeof(ud_t));
     ud->handle = handle;
     ud->ref1 = ud->ref2 = ud->ref3 = ud->ref4 = LUA_NOREF;
@@ -39,6 +36,25 @@ ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracen
     return ud;
     }
 
+ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracename)
+    {
+    /* we use handle as search key */
+    ud_t *ud = (ud_t*)udata_new(L, sizeof(ud_t), (uint64_t)(uintptr_t)handle, mt);
+    return initud(ud, handle, tracename);
+    }
+
+ud_t *newhandle(lua_State *L, void *handle, const char *mt, const char *tracename)
+/* Same as newuserdata(), for objects created internally: the ud is registered
+ * without creating a Lua userdata (nothing is pushed on the stack), and a Lua
+ * proxy is created only if and when the object is pushed (pushuserdata/pushxxx).
+ * The object is not garbage collected: it must be destroyed explicitly, or by
+ * its parent's destruction.
+ */
+    {
+    ud_t *ud = (ud_t*)udata_new_lazy(L, sizeof(ud_t), (uint64_t)(uintptr_t)handle, mt);
+    return initud(ud, handle, tracename);
+    }
+
 int freeuserdata(lua_State *L, ud_t *ud, const char *tracename)
     {
     /* The 'Valid' mark prevents double calls when an object is explicitly destroyed, 
@@ -55,6 +71,7 @@ int freeuserdata(lua_State *L, ud_t *ud, const char *tracename)
     Unreference(L, ud->ref4);
     if(trace_objects)
         printf("delete %s %p (%p)\n", tracename, (void*)ud, ud->handle);
+    /* for objects created with newhandle() this releases also ud itself */
     udata_free(L, (uint64_t)(uintptr_t)ud->handle);
     return 1;
     }
@@ -48,6 +48,12 @@ typedef double box3_t[6];
 #define surface_parameters_t dSurfaceParameters
 #define hfdata_t dHeightfieldDataID
 #define tmdata_t dTriMeshDataID
+#define buffer_t moonode_buffer_t
+typedef struct moonode_buffer_s *buffer_t;
+#define mesh_t moonode_mesh_t
+typedef struct moonode_mesh_s *mesh_t;
+#define convexdata_t moonode_convexdata_t
+typedef struct moonode_convexdata_s *convexdata_t;
 
 /* Objects' metatable names */
 #define MASS_MT "moonode_mass"
@@ -57,6 +63,7 @@ typedef double box3_t[6];
 #define SPACE_HASH_MT "moonode_space_hash"
 #define SPACE_QUADTREE_MT "moonode_space_quadtree"
 #define SPACE_SAP_MT "moonode_space_sap" // sap = 'sweep and prune'
+#define SPACE_SPLIT_MT "moonode_space_split" // static/dynamic split
 #define BODY_MT "moonode_body"
 #define JOINT_MT "moonode_joint" /* base object */
 #define JOINT_BALL_MT "moonode_joint_ball"
@@ -88,6 +95,9 @@ typedef double box3_t[6];
 #define GEOM_TRIMESH_MT "moonode_geom_trimesh"
 #define HFDATA_MT "moonode_hfdata" /* heightfield data */
 #define TMDATA_MT "moonode_tmdata" /* trimesh data */
+#define BUFFER_MT "moonode_buffer"
+#define MESH_MT "moonode_mesh" /* shared trimesh vertex storage */
+#define CONVEXDATA_MT "moonode_convexdata" /* shared convex shape data */
 
 /* Userdata memory associated with objects */
 #define ud_t moonode_ud_t
@@ -122,6 +132,8 @@ int setmetatable(lua_State *L, const char *mt);
 
 #define newuserdata moonode_newuserdata
 ud_t *newuserdata(lua_State *L, void *handle, const char *mt, const char *tracename);
+#define newhandle moonode_newhandle
+ud_t *newhandle(lua_State *L, void *handle, const char *mt, const char *tracename);
 #define freeuserdata moonode_freeuserdata
 int freeuserdata(lua_State *L, ud_t *ud, const char *tracename);
 #define pushuserdata moonode_pushuserdata 
@@ -364,6 +376,14 @@ geom_t checkgeomorspace(lua_State *L, int arg, ud_t **udp);
 #define checkspace_saplist(L, arg, err) checkxxxlist((L), (arg), (err), SPACE_SAP_MT)
 #define pushspace_sap(L, handle) pushxxx((L), (void*)(handle))
 
+/* space_split.c */
+#define checkspace_split(L, arg, udp) (space_t)checkxxx((L), (arg), (udp), SPACE_SPLIT_MT)
+#define testspace_split(L, arg, udp) (space_t)testxxx((L), (arg), (udp), SPACE_SPLIT_MT)
+#define optspace_split(L, arg, udp) (space_t)optxxx((L), (arg), (udp), SPACE_SPLIT_MT)
+#define freespace_splitlist freexxxlist
+#define checkspace_splitlist(L, arg, err) checkxxxlist((L), (arg), (err), SPACE_SPLIT_MT)
+#define pushspace_split(L, handle) pushxxx((L), (void*)(handle))
+
 /* geom.c */
 #define checkgeom(L, arg, udp) (geom_t)checkxxx((L), (arg), (udp), GEOM_MT)
 #define testgeom(L, arg, udp) (geom_t)testxxx((L), (arg), (udp), GEOM_MT)
@@ -452,6 +472,30 @@ geom_t checkgeomorspace(lua_State *L, int arg, ud_t **udp);
 #define checktmdatalist(L, arg, err) checkxxxlist((L), (arg), (err), TMDATA_MT)
 #define pushtmdata(L, handle) pushxxx((L), (void*)(handle))
 
+/* buffer.c */
+#define checkbuffer(L, arg, udp) (buffer_t)checkxxx((L), (arg), (udp), BUFFER_MT)
+#define testbuffer(L, arg, udp) (buffer_t)testxxx((L), (arg), (udp), BUFFER_MT)
+#define optbuffer(L, arg, udp) (buffer_t)optxxx((L), (arg), (udp), BUFFER_MT)
+#define freebufferlist freexxxlist
+#define checkbufferlist(L, arg, err) checkxxxlist((L), (arg), (err), BUFFER_MT)
+#define pushbuffer(L, handle) pushxxx((L), (void*)(handle))
+
+/* mesh.c */
+#define checkmesh(L, arg, udp) (mesh_t)checkxxx((L), (arg), (udp), MESH_MT)
+#define testmesh(L, arg, udp) (mesh_t)testxxx((L), (arg), (udp), MESH_MT)
+#define optmesh(L, arg, udp) (mesh_t)optxxx((L), (arg), (udp), MESH_MT)
+#define freemeshlist freexxxlist
+#define checkmeshlist(L, arg, err) checkxxxlist((L), (arg), (err), MESH_MT)
+#define pushmesh(L, handle) pushxxx((L), (void*)(handle))
+
+/* convexdata.c */
+#define checkconvexdata(L, arg, udp) (convexdata_t)checkxxx((L), (arg), (udp), CONVEXDATA_MT)
+#define testconvexdata(L, arg, udp) (convexdata_t)testxxx((L), (arg), (udp), CONVEXDATA_MT)
+#define optconvexdata(L, arg, udp) (convexdata_t)optxxx((L), (arg), (udp), CONVEXDATA_MT)
+#define freeconvexdatalist freexxxlist
+#define checkconvexdatalist(L, arg, err) checkxxxlist((L), (arg), (err), CONVEXDATA_MT)
+#define pushconvexdata(L, handle) pushxxx((L), (void*)(handle))
+
 /* geom_trimesh.c */
 #define checkgeom_trimesh(L, arg, udp) (geom_t)checkxxx((L), (arg), (udp), GEOM_TRIMESH_MT)
 #define testgeom_trimesh(L, arg, udp) (geom_t)testxxx((L), (arg), (udp), GEOM_TRIMESH_MT)
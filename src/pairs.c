@@ -0,0 +1,151 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+
+/* Hash table of pairs of geoms, used to track the state of pairs across collision
+ * detection passes ('frames'), e.g. for sensors and contact events.
+ *
+ * Open addressing with linear probing. Removed entries are marked as tombstones, and
+ * dropped when the table is rehashed.
+ */
+
+static unsigned int Hash(geom_t g1, geom_t g2)
+    {
+    uint64_t h = (uint64_t)(uintptr_t)g1*0x9e3779b97f4a7c15ULL ^ (uint64_t)(uintptr_t)g2*0xc2b2ae3d27d4eb4fULL;
+    return (unsigned int)(h ^ (h >> 32));
+    }
+
+#define IsLive(pair) ((pair)->state == PAIR_NEW || (pair)->state == PAIR_ACTIVE)
+
+static int Rehash(lua_State *L, pairtable_t *t, int cap)
+/* Reallocates the table with the given capacity (a power of 2), dropping the tombstones */
+    {
+    int i;
+    unsigned int j;
+    pair_t *pairs = (pair_t*)MallocNoErr(L, cap*sizeof(pair_t));
+    if(!pairs) return ERR_MEMORY;
+    memset(pairs, 0, cap*sizeof(pair_t));
+    for(i = 0; i < t->cap; i++)
+        {
+        if(!IsLive(&t->pairs[i])) continue;
+        j = Hash(t->pairs[i].g1, t->pairs[i].g2) & (cap - 1);
+        while(pairs[j].state != PAIR_FREE) j = (j + 1) & (cap - 1);
+        pairs[j] = t->pairs[i];
+        }
+    if(t->pairs) Free(L, t->pairs);
+    t->pairs = pairs;
+    t->cap = cap;
+    t->used = t->live;
+    return 0;
+    }
+
+pair_t *pairtable_find(pairtable_t *t, geom_t g1, geom_t g2)
+    {
+    unsigned int j;
+    if(t->live == 0) return NULL;
+    j = Hash(g1, g2) & (t->cap - 1);
+    while(t->pairs[j].state != PAIR_FREE)
+        {
+        if(IsLive(&t->pairs[j]) && t->pairs[j].g1 == g1 && t->pairs[j].g2 == g2)
+            return &t->pairs[j];
+        j = (j + 1) & (t->cap - 1);
+        }
+    return NULL;
+    }
+
+pair_t *pairtable_insert(lua_State *L, pairtable_t *t, geom_t g1, geom_t g2)
+/* Returns the entry for the pair, adding it in the PAIR_NEW state if not present.
+ * Returns NULL on failure. Note that this may move the other entries. */
+    {
+    int cap;
+    unsigned int j;
+    pair_t *pair;
+    if((pair = pairtable_find(t, g1, g2)) != NULL) return pair;
+    if(2*(t->used + 1) > t->cap)
+        {
+        /* grow, unless it is enough to drop the tombstones */
+        cap = t->cap == 0 ? 64 : (4*(t->live + 1) > t->cap ? 2*t->cap : t->cap);
+        if(Rehash(L, t, cap) != 0) return NULL;
+        }
+    j = Hash(g1, g2) & (t->cap - 1);
+    while(t->pairs[j].state != PAIR_FREE) j = (j + 1) & (t->cap - 1);
+    pair = &t->pairs[j];
+    memset(pair, 0, sizeof(pair_t));
+    pair->g1 = g1;
+    pair->g2 = g2;
+    pair->state = PAIR_NEW;
+    t->used++;
+    t->live++;
+    return pair;
+    }
+
+void pairtable_remove(pairtable_t *t, pair_t *pair)
+    {
+    if(!IsLive(pair)) return;
+    pair->state = PAIR_DEAD;
+    t->live--;
+    }
+
+void pairtable_purge(pairtable_t *t, geom_t geom)
+/* Removes all the pairs involving the geom */
+    {
+    int i;
+    for(i = 0; i < t->cap && t->live > 0; i++)
+        {
+        if(t->pairs[i].g1 == geom || t->pairs[i].g2 == geom)
+            pairtable_remove(t, &t->pairs[i]);
+        }
+    }
+
+void pairtable_compact(lua_State *L, pairtable_t *t)
+/* Drops the tombstones, if too many */
+    {
+    if(t->used - t->live > t->cap/4) Rehash(L, t, t->cap);
+    }
+
+int pairtable_index(lua_State *L, geom_t geom)
+/* Returns the 1-based index of the geom in the geoms table at -1, adding it if needed
+ * (the table at -2 maps geoms to indices). Used to report the geoms in events. */
+    {
+    int index;
+    ud_t *ud = userdata(geom);
+    if(!ud) return 0; /* (should not happen) */
+    pushuserdata(L, ud);
+    lua_pushvalue(L, -1);
+    if(lua_rawget(L, -4) == LUA_TNUMBER)
+        {
+        index = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        return index;
+        }
+    lua_pop(L, 1);
+    index = luaL_len(L, -2) + 1;
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, index);
+    lua_pushinteger(L, index);
+    lua_rawset(L, -4);
+    return index;
+    }
+
@@ -0,0 +1,171 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+
+/* Sensor geoms.
+ *
+ * A sensor geom detects overlaps without generating contacts. Pairs of potentially
+ * colliding geoms where at least one is a sensor are intercepted by the near callback
+ * of space_collide() and tested natively (the Lua callback is not called for them).
+ * The overlapping pairs are kept in a hash table, stamped with the current frame, and
+ * sensor_events() reports the pairs that started or stopped overlapping since its
+ * previous call, and starts a new frame.
+ *
+ * Sensors are marked by their geom data (not used otherwise), so that they can be
+ * recognized cheaply in the near callback and also when the geom is being destroyed.
+ */
+
+static char SensorTag;
+#define IsSensor(geom) (dGeomGetData(geom) == &SensorTag)
+
+#define EVENT_SIZE 3 /* event (1 = begin, 2 = end), sensor index, other geom index */
+
+/* g1 is the sensor (if both are sensors, the one with lower address) */
+static pairtable_t Pairs = { NULL, 0, 0, 0 };
+static int SensorCount = 0;
+static uint32_t Frame = 1;
+
+int sensorpair(lua_State *L, geom_t o1, geom_t o2)
+/* Called by the near callback for each pair of geoms. If at least one of them is a
+ * sensor, tests the pair for overlap and returns 1 (the pair must not be passed to
+ * the Lua callback). Otherwise returns 0. */
+    {
+    pair_t *pair;
+    geom_t tmp;
+    contact_point_t contact;
+    int s1, s2;
+    if(SensorCount == 0) return 0;
+    s1 = IsSensor(o1); s2 = IsSensor(o2);
+    if(!s1 && !s2) return 0;
+    if(s1 ? (s2 && o2 < o1) : 1) { tmp = o1; o1 = o2; o2 = tmp; }
+    if(dCollide(o1, o2, 1 | CONTACTS_UNIMPORTANT, &contact, sizeof(contact_point_t)) == 0) return 1;
+    if((pair = pairtable_insert(L, &Pairs, o1, o2)) != NULL) /* (on failure, the pair is just missed) */
+        pair->stamp = Frame;
+    return 1;
+    }
+
+int sensorcount(void)
+    { return SensorCount; }
+
+void sensorgeomdestroyed(geom_t geom)
+/* Called when a geom is being destroyed */
+    {
+    if(IsSensor(geom)) SensorCount--;
+    pairtable_purge(&Pairs, geom);
+    }
+
+static void SetSensor_(geom_t geom, int on)
+    {
+    if(on == IsSensor(geom)) return;
+    if(on)
+        {
+        dGeomSetData(geom, &SensorTag);
+        SensorCount++;
+        }
+    else
+        {
+        dGeomSetData(geom, NULL);
+        SensorCount--;
+        pairtable_purge(&Pairs, geom);
+        }
+    }
+
+static int SetSensor(lua_State *L)
+    {
+    geom_t geom = checkgeom(L, 1, NULL);
+    SetSensor_(geom, optboolean(L, 2, 1));
+    return 0;
+    }
+
+static int IsSensorGeom(lua_State *L)
+    {
+    geom_t geom = checkgeom(L, 1, NULL);
+    lua_pushboolean(L, IsSensor(geom));
+    return 1;
+    }
+
+static int SensorEvents(lua_State *L)
+/* n, {geom} = sensor_events(buffer, [offset]) */
+    {
+    int i, n;
+    double *dst;
+    pair_t *pair;
+    buffer_t buffer = checkbuffer(L, 1, NULL);
+    size_t offset = checkoffset(L, 2);
+    for(i = n = 0; i < Pairs.cap; i++)
+        {
+        pair = &Pairs.pairs[i];
+        if(pair->state == PAIR_NEW || (pair->state == PAIR_ACTIVE && pair->stamp != Frame)) n++;
+        }
+    dst = n > 0 ? (double*)bufferreserve(L, buffer, offset, n*EVENT_SIZE*sizeof(double)) : NULL;
+    lua_pushinteger(L, n);
+    lua_newtable(L); /* geom -> index (temporary) */
+    lua_newtable(L); /* geoms */
+    for(i = 0; i < Pairs.cap; i++)
+        {
+        pair = &Pairs.pairs[i];
+        switch(pair->state)
+            {
+            case PAIR_NEW:
+                pair->state = PAIR_ACTIVE;
+                dst[0] = 1;
+                break;
+            case PAIR_ACTIVE:
+                if(pair->stamp == Frame) continue;
+                pairtable_remove(&Pairs, pair);
+                dst[0] = 2;
+                break;
+            default:
+                continue;
+            }
+        dst[1] = pairtable_index(L, pair->g1);
+        dst[2] = pairtable_index(L, pair->g2);
+        dst += EVENT_SIZE;
+        }
+    lua_remove(L, -2);
+    Frame++;
+    pairtable_compact(L, &Pairs);
+    return 2;
+    }
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "set_sensor", SetSensor },
+        { "is_sensor", IsSensorGeom },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "sensor_events", SensorEvents },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_sensor(lua_State *L)
+    {
+    udata_addmethods(L, GEOM_MT, Methods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
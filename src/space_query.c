@@ -0,0 +1,983 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "internal.h"
+#if defined(LINUX)
+#include <pthread.h>
+#endif
+
+/* Native spatial queries on spaces.
+ *
+ * Each query takes a snapshot of the geoms in the space (recursively, including the
+ * static geoms of split spaces), refreshes their AABBs and indexes them in a bvh that
+ * lives only for the duration of the query. The geoms must not be modified while the
+ * query runs. Note that Lua code may still run during a query, in the trimesh callbacks
+ * and in the height callbacks of heightfields: this is why queries that may use several
+ * threads fall back to a single thread when such geoms are involved (see ThreadSafe()).
+ */
+
+#define MAX_THREADS 64
+
+/*------------------------------------------------------------------------------*
+ | Snapshot                                                                     |
+ *------------------------------------------------------------------------------*/
+
+#define AabbOverlap(a, b) (!((a)[0] > (b)[1] || (a)[1] < (b)[0] || \
+                             (a)[2] > (b)[3] || (a)[3] < (b)[2] || \
+                             (a)[4] > (b)[5] || (a)[5] < (b)[4]))
+
+typedef struct {
+    bvh_item_t *items;
+    int count, cap;
+    const double *box; /* if not NULL, only the geoms whose AABB overlaps it are collected */
+} collect_t;
+
+static int CollectItem(lua_State *L, collect_t *c, geom_t geom)
+    {
+    bvh_item_t *items;
+    double aabb[6];
+    if(c->box)
+        {
+        dGeomGetAABB(geom, aabb);
+        if(!AabbOverlap(aabb, c->box)) return 0;
+        }
+    if(c->count == c->cap)
+        {
+        c->cap = c->cap ? 2*c->cap : 256;
+        items = (bvh_item_t*)MallocNoErr(L, c->cap*sizeof(bvh_item_t));
+        if(!items) return ERR_MEMORY;
+        if(c->items)
+            {
+            memcpy(items, c->items, c->count*sizeof(bvh_item_t));
+            Free(L, c->items);
+            }
+        c->items = items;
+        }
+    c->items[c->count].geom = geom;
+    /* this also recomputes the geom's pose and AABB if they are out of date */
+    dGeomGetAABB(geom, c->items[c->count].aabb);
+    c->count++;
+    return 0;
+    }
+
+static int Collect(lua_State *L, collect_t *c, space_t space)
+    {
+    int i, n, err;
+    geom_t geom;
+    space_t statics;
+    n = dSpaceGetNumGeoms(space);
+    for(i = 0; i < n; i++)
+        {
+        geom = dSpaceGetGeom(space, i);
+        if(dGeomIsSpace(geom))
+            err = Collect(L, c, (space_t)geom);
+        else if(!dGeomIsEnabled(geom))
+            continue;
+        else
+            err = CollectItem(L, c, geom);
+        if(err) return err;
+        }
+    if((statics = splitspacestatics(space)) != NULL)
+        return Collect(L, c, statics);
+    return 0;
+    }
+
+static bvh_t *Snapshot(lua_State *L, space_t space)
+/* Builds a bvh over the enabled geoms in the space (raises an error on failure) */
+    {
+    bvh_t *bvh;
+    collect_t c;
+    memset(&c, 0, sizeof(c));
+    if(Collect(L, &c, space) != 0)
+        {
+        if(c.items) Free(L, c.items);
+        errmemory(L);
+        return NULL;
+        }
+    bvh = bvh_build(L, c.items, c.count); /* this makes a copy of the items */
+    if(c.items) Free(L, c.items);
+    if(!bvh) errmemory(L);
+    return bvh;
+    }
+
+static int Index(lua_State *L, bvh_t *bvh, int *map, const bvh_item_t *item)
+/* Returns the 1-based index of the geom in the table at the top of the stack, adding
+ * the geom if it is not there yet (map has an entry per bvh item, initially 0) */
+    {
+    int i = item - bvh_items(bvh);
+    ud_t *ud;
+    if(map[i] == 0)
+        {
+        map[i] = luaL_len(L, -1) + 1;
+        if((ud = userdata(item->geom)) != NULL)
+            pushuserdata(L, ud);
+        else
+            lua_pushboolean(L, 0); /* (should not happen) */
+        lua_rawseti(L, -2, map[i]);
+        }
+    return map[i];
+    }
+
+/*------------------------------------------------------------------------------*
+ | Batch raycasting                                                             |
+ *------------------------------------------------------------------------------*/
+
+#define RAY_SIZE 6 /* origin (3), direction (3) */
+#define HIT_SIZE 8 /* geom index (1), position (3), normal (3), distance (1) */
+
+typedef struct {
+    bvh_t *bvh;
+    const double *rays;
+    double *hits;
+    const bvh_item_t **hititems; /* hit item per ray (or NULL) */
+    int nrays;
+    double maxlen;
+    int flags;
+    uint32_t mask;
+} raybatch_t;
+
+typedef struct {
+    raybatch_t *batch;
+    int first, last; /* rays range */
+    geom_t ray; /* geom_ray used by this thread */
+    double len; /* current length of the ray (closest hit so far) */
+    contact_point_t contact; /* closest hit so far */
+    const bvh_item_t *item;
+    int nhits;
+} rayjob_t;
+
+static int RayHit(const bvh_item_t *item, void *data)
+    {
+    rayjob_t *job = (rayjob_t*)data;
+    contact_point_t contact;
+    if(job->batch->mask != 0xffffffff && (dGeomGetCategoryBits(item->geom) & job->batch->mask) == 0)
+        return 0;
+    if(dGeomGetClass(item->geom) == dRayClass) return 0;
+    dGeomRaySetLength(job->ray, job->len);
+    if(dCollide(job->ray, item->geom, 1, &contact, sizeof(contact_point_t)) == 0) return 0;
+    if(contact.depth > job->len) return 0;
+    job->contact = contact;
+    job->item = item;
+    job->len = contact.depth;
+    return (job->batch->flags & RAY_ANY_HIT) ? 1 : 0;
+    }
+
+static void CastRays(rayjob_t *job)
+    {
+    int i;
+    double d;
+    const double *ray;
+    double *hit;
+    raybatch_t *batch = job->batch;
+    dVector3 dir;
+    for(i = job->first; i < job->last; i++)
+        {
+        ray = batch->rays + RAY_SIZE*i;
+        hit = batch->hits + HIT_SIZE*i;
+        memset(hit, 0, HIT_SIZE*sizeof(double));
+        batch->hititems[i] = NULL;
+        d = sqrt(ray[3]*ray[3] + ray[4]*ray[4] + ray[5]*ray[5]);
+        if(d == 0) continue;
+        dir[0] = ray[3]/d; dir[1] = ray[4]/d; dir[2] = ray[5]/d;
+        dGeomRaySet(job->ray, ray[0], ray[1], ray[2], dir[0], dir[1], dir[2]);
+        job->len = batch->maxlen;
+        job->item = NULL;
+        bvh_query_ray(batch->bvh, ray, dir, &job->len, RayHit, job);
+        if(!job->item) continue;
+        batch->hititems[i] = job->item;
+        hit[1] = job->contact.pos[0]; hit[2] = job->contact.pos[1]; hit[3] = job->contact.pos[2];
+        hit[4] = job->contact.normal[0]; hit[5] = job->contact.normal[1]; hit[6] = job->contact.normal[2];
+        hit[7] = job->contact.depth;
+        job->nhits++;
+        }
+    }
+
+#if defined(LINUX)
+static void *RayThread(void *arg)
+    {
+    /* ODE needs per-thread data for some colliders (e.g. trimeshes) */
+    dAllocateODEDataForThread(dAllocateMaskAll);
+    CastRays((rayjob_t*)arg);
+    dCleanupODEAllDataForThread();
+    return NULL;
+    }
+#endif
+
+static int ThreadSafe(bvh_t *bvh)
+/* Checks if the geoms in the snapshot can be tested against rays from several threads
+ * at once. Heightfields are not, because ODE keeps temporary buffers in the geom (and
+ * their height sources may call Lua or update caches). Trimeshes are only if ODE was
+ * built with per-thread collider caches (otherwise the cache is a single global), and
+ * provided they have no callbacks, which may call Lua. */
+    {
+    int i;
+    geom_t geom;
+    const bvh_item_t *items = bvh_items(bvh);
+    for(i = 0; i < bvh_count(bvh); i++)
+        {
+        geom = items[i].geom;
+        switch(dGeomGetClass(geom))
+            {
+            case dHeightfieldClass: return 0;
+            case dTriMeshClass:
+                if(!dCheckConfiguration("ODE_EXT_mt_collisions")) return 0;
+                if(dGeomTriMeshGetCallback(geom) || dGeomTriMeshGetRayCallback(geom)) return 0;
+                break;
+            default: break;
+            }
+        }
+    return 1;
+    }
+
+typedef struct {
+    raybatch_t *batch;
+    int *map;
+} rayresults_t;
+
+static int RayResults(lua_State *L)
+/* Pushes the table of hit geoms and writes their indices in the hits. Executed in
+ * protected mode, so that the caller can release the snapshot on error. */
+    {
+    int i;
+    rayresults_t *r = (rayresults_t*)lua_touserdata(L, 1);
+    raybatch_t *batch = r->batch;
+    lua_newtable(L);
+    for(i = 0; i < batch->nrays; i++)
+        if(batch->hititems[i])
+            batch->hits[HIT_SIZE*i] = Index(L, batch->bvh, r->map, batch->hititems[i]);
+    return 1;
+    }
+
+static int RaycastBatch(lua_State *L)
+/* nhits, {geom} = space:raycast_batch(rays, maxlen, rayflags, buffer, [offset], [nthreads], [mask]) */
+    {
+    int i, nrays, nthreads, nhits, err;
+    size_t len, offset;
+    const char *data;
+    buffer_t rbuffer, buffer;
+    raybatch_t batch;
+    rayjob_t jobs[MAX_THREADS];
+    rayresults_t r;
+#if defined(LINUX)
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS];
+#endif
+    space_t space = checkspace(L, 1, NULL);
+    double maxlen = luaL_checknumber(L, 3);
+    int flags = optflags(L, 4, 0);
+    buffer = checkbuffer(L, 5, NULL);
+    offset = checkoffset(L, 6);
+    nthreads = luaL_optinteger(L, 7, 1);
+    memset(&batch, 0, sizeof(batch));
+    batch.mask = (uint32_t)luaL_optinteger(L, 8, 0xffffffff);
+    if(maxlen <= 0) return argerror(L, 3, ERR_VALUE);
+    if(nthreads < 1 || nthreads > MAX_THREADS) return argerror(L, 7, ERR_RANGE);
+    if((rbuffer = testbuffer(L, 2, NULL)) != NULL)
+        len = rbuffer->size;
+    else
+        (void)luaL_checklstring(L, 2, &len);
+    if(len % (RAY_SIZE*sizeof(double)) != 0) return argerror(L, 2, ERR_LENGTH);
+    nrays = len / (RAY_SIZE*sizeof(double));
+    /* the output must not overwrite the rays */
+    if(rbuffer == buffer && offset < len) return argerror(L, 6, ERR_VALUE);
+    if(nrays == 0)
+        { lua_pushinteger(L, 0); lua_newtable(L); return 2; }
+    /* reserve the output first, since it may move the data if rays are in the same buffer */
+    batch.hits = (double*)bufferreserve(L, buffer, offset, nrays*HIT_SIZE*sizeof(double));
+    data = rbuffer ? rbuffer->data : lua_tostring(L, 2);
+    batch.rays = (const double*)data;
+    batch.nrays = nrays;
+    batch.maxlen = maxlen;
+    batch.flags = flags;
+    batch.bvh = Snapshot(L, space);
+    batch.hititems = (const bvh_item_t**)MallocNoErr(L, nrays*sizeof(bvh_item_t*));
+    if(!batch.hititems) { bvh_free(L, batch.bvh); return errmemory(L); }
+    if(nthreads > nrays) nthreads = nrays;
+    if(nthreads > 1 && !ThreadSafe(batch.bvh)) nthreads = 1;
+    for(i = 0; i < nthreads; i++)
+        {
+        memset(&jobs[i], 0, sizeof(rayjob_t));
+        jobs[i].batch = &batch;
+        jobs[i].first = (int)(((long long)nrays*i)/nthreads);
+        jobs[i].last = (int)(((long long)nrays*(i+1))/nthreads);
+        jobs[i].ray = dCreateRay(NULL, maxlen);
+        dGeomRaySetClosestHit(jobs[i].ray, 1);
+        dGeomRaySetBackfaceCull(jobs[i].ray, (flags & RAY_BACKFACE_CULL) ? 1 : 0);
+        }
+#if defined(LINUX)
+    /* the first job runs in this thread, the others in new threads (or here, if the
+     * thread creation fails) */
+    for(i = 1; i < nthreads; i++)
+        {
+        err = pthread_create(&threads[i], NULL, RayThread, &jobs[i]);
+        started[i] = (err == 0);
+        if(!started[i]) CastRays(&jobs[i]);
+        }
+    CastRays(&jobs[0]);
+    for(i = 1; i < nthreads; i++)
+        if(started[i]) pthread_join(threads[i], NULL);
+#else
+    for(i = 0; i < nthreads; i++) CastRays(&jobs[i]);
+    (void)err;
+#endif
+    nhits = 0;
+    for(i = 0; i < nthreads; i++)
+        {
+        nhits += jobs[i].nhits;
+        dGeomDestroy(jobs[i].ray);
+        }
+    /* geom indices */
+    r.batch = &batch;
+    r.map = (int*)MallocNoErr(L, (bvh_count(batch.bvh) + 1)*sizeof(int));
+    if(!r.map)
+        { Free(L, batch.hititems); bvh_free(L, batch.bvh); return errmemory(L); }
+    lua_pushinteger(L, nhits);
+    lua_pushcfunction(L, RayResults);
+    lua_pushlightuserdata(L, &r);
+    err = lua_pcall(L, 1, 1, 0);
+    Free(L, r.map);
+    Free(L, batch.hititems);
+    bvh_free(L, batch.bvh);
+    if(err != LUA_OK) return lua_error(L);
+    return 2;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Shape casting                                                                |
+ *------------------------------------------------------------------------------*/
+
+#define SWEEP_MIN_STEP 0.125 /* relative to the smallest half-extent of the shape */
+#define SWEEP_BISECTIONS 24
+#define SWEEP_CONTACTS 8
+
+typedef struct {
+    geom_t shape; /* private copy of the swept shape */
+    double from[3], delta[3]; /* path */
+    collect_t c; /* candidate geoms */
+} sweep_t;
+
+static geom_t SweepShape(geom_t geom, double *extent)
+/* Creates a private (non-placed) copy of the geom's shape, and returns in extent the
+ * smallest of its half-extents. Returns NULL if the geom class is not supported. */
+    {
+    dReal r, l;
+    dVector3 sides;
+    switch(dGeomGetClass(geom))
+        {
+        case dSphereClass:
+            r = dGeomSphereGetRadius(geom);
+            *extent = r;
+            return dCreateSphere(NULL, r);
+        case dCapsuleClass:
+            dGeomCapsuleGetParams(geom, &r, &l);
+            *extent = r;
+            return dCreateCapsule(NULL, r, l);
+        case dCylinderClass:
+            dGeomCylinderGetParams(geom, &r, &l);
+            *extent = r < l/2 ? r : l/2;
+            return dCreateCylinder(NULL, r, l);
+        case dBoxClass:
+            dGeomBoxGetLengths(geom, sides);
+            *extent = sides[0] < sides[1] ? sides[0] : sides[1];
+            if(sides[2] < *extent) *extent = sides[2];
+            *extent /= 2;
+            return dCreateBox(NULL, sides[0], sides[1], sides[2]);
+        default:
+            return NULL;
+        }
+    }
+
+static int SweepTest(sweep_t *s, double t, contact_point_t *contact, geom_t *hitgeom)
+/* Places the shape at t (0..1) along the path and tests it against the candidates.
+ * Returns 1 if it overlaps any of them, with the deepest contact found. */
+    {
+    int i, j, n, hit = 0;
+    double aabb[6];
+    contact_point_t contacts[SWEEP_CONTACTS];
+    dGeomSetPosition(s->shape, s->from[0] + t*s->delta[0],
+            s->from[1] + t*s->delta[1], s->from[2] + t*s->delta[2]);
+    dGeomGetAABB(s->shape, aabb);
+    for(i = 0; i < s->c.count; i++)
+        {
+        if(!AabbOverlap(s->c.items[i].aabb, aabb)) continue;
+        n = dCollide(s->shape, s->c.items[i].geom, SWEEP_CONTACTS, contacts, sizeof(contact_point_t));
+        for(j = 0; j < n; j++)
+            {
+            if(hit && contacts[j].depth <= contact->depth) continue;
+            *contact = contacts[j];
+            *hitgeom = s->c.items[i].geom;
+            hit = 1;
+            }
+        }
+    return hit;
+    }
+
+static double BoxDistance(const double a[6], const double b[6])
+/* Distance between two AABBs (0 if they overlap) */
+    {
+    int i;
+    double d, d2 = 0;
+    for(i = 0; i < 3; i++)
+        {
+        if(a[2*i] > b[2*i+1]) d = a[2*i] - b[2*i+1];
+        else if(b[2*i] > a[2*i+1]) d = b[2*i] - a[2*i+1];
+        else continue;
+        d2 += d*d;
+        }
+    return sqrt(d2);
+    }
+
+static double SweepBound(sweep_t *s, double coarse)
+/* Returns a lower bound for the distance between the shape (where it was last placed)
+ * and the candidates, i.e. how far it can be advanced without overlapping any of
+ * them. The exact distance is used for convex candidates, the distance between the
+ * AABBs otherwise, and the coarse step if the shape is inside the AABB of a
+ * non-convex candidate (e.g. a trimesh). */
+    {
+    int i;
+    double bound = HUGE_VAL, d, boxd, aabb[6], p1[3], p2[3];
+    dGeomGetAABB(s->shape, aabb);
+    for(i = 0; i < s->c.count; i++)
+        {
+        if((boxd = BoxDistance(s->c.items[i].aabb, aabb)) >= bound) continue;
+        switch(geomdistance(s->shape, s->c.items[i].geom, &d, p1, p2))
+            {
+            case 0: break;
+            case 1: d = 0; break;
+            default: d = boxd > 0 ? boxd : coarse; break; /* not convex */
+            }
+        if(d < bound) bound = d;
+        }
+    return bound;
+    }
+
+static int Sweep(lua_State *L)
+/* toi, position, normal, geom = space:sweep(geom, from, to, [rotation], [mask]) */
+    {
+    int i, k, n, hit;
+    double extent, len, step, t, t0, t1, box[6], aabb[6];
+    vec3_t from, to;
+    mat3_t R;
+    sweep_t s;
+    contact_point_t contact, c;
+    geom_t g, hitgeom = NULL;
+    body_t body;
+    uint32_t mask;
+    space_t space = checkspace(L, 1, NULL);
+    geom_t geom = checkgeom(L, 2, NULL);
+    checkvec3(L, 3, from);
+    checkvec3(L, 4, to);
+    if(optmat3(L, 5, R) == ERR_NOTPRESENT)
+        memcpy(R, dGeomGetRotation(geom), sizeof(mat3_t));
+    mask = (uint32_t)luaL_optinteger(L, 6, 0xffffffff);
+    memset(&s, 0, sizeof(s));
+    if((s.shape = SweepShape(geom, &extent)) == NULL) return argerror(L, 2, ERR_TYPE);
+    if(extent <= 0) { dGeomDestroy(s.shape); return argerror(L, 2, ERR_VALUE); }
+    dGeomSetRotation(s.shape, R);
+    for(i = 0; i < 3; i++)
+        { s.from[i] = from[i]; s.delta[i] = to[i] - from[i]; }
+    len = sqrt(s.delta[0]*s.delta[0] + s.delta[1]*s.delta[1] + s.delta[2]*s.delta[2]);
+
+    /* collect the candidates, i.e. the geoms overlapping the AABB of the swept volume */
+    dGeomSetPosition(s.shape, from[0], from[1], from[2]);
+    dGeomGetAABB(s.shape, box);
+    dGeomSetPosition(s.shape, to[0], to[1], to[2]);
+    dGeomGetAABB(s.shape, aabb);
+    for(i = 0; i < 6; i += 2)
+        {
+        if(aabb[i] < box[i]) box[i] = aabb[i];
+        if(aabb[i+1] > box[i+1]) box[i+1] = aabb[i+1];
+        }
+    s.c.box = box;
+    if(Collect(L, &s.c, space) != 0)
+        {
+        if(s.c.items) Free(L, s.c.items);
+        dGeomDestroy(s.shape);
+        return errmemory(L);
+        }
+    /* skip the swept geom itself, the geoms attached to its body, rays, and masked geoms */
+    body = dGeomGetBody(geom);
+    for(i = n = 0; i < s.c.count; i++)
+        {
+        g = s.c.items[i].geom;
+        if(g == geom || dGeomGetClass(g) == dRayClass) continue;
+        if(body && dGeomGetBody(g) == body) continue;
+        if(mask != 0xffffffff && (dGeomGetCategoryBits(g) & mask) == 0) continue;
+        s.c.items[n++] = s.c.items[i];
+        }
+    s.c.count = n;
+
+    /* conservative advancement: the shape is advanced along the path by a lower bound
+     * of its distance from the candidates, until it overlaps one of them. Steps are not
+     * shorter than a fraction of the shape's smallest half-extent, so that the loop
+     * terminates when the shape passes close to a geom without hitting it (the overlap,
+     * if any, is then small and refined below), and not longer than half of it where
+     * no bound is available, so that consecutive placements overlap */
+    hit = 0; t0 = t1 = 0;
+    while(s.c.count > 0)
+        {
+        if((hit = SweepTest(&s, t1, &contact, &hitgeom)) != 0) break;
+        t0 = t1;
+        if(t1 >= 1 || len == 0) break;
+        step = SweepBound(&s, extent/2);
+        if(step < SWEEP_MIN_STEP*extent) step = SWEEP_MIN_STEP*extent;
+        t1 = t0 + step/len;
+        if(t1 > 1) t1 = 1;
+        }
+    /* refine the time of impact by bisection between the last free position and the
+     * first overlapping one (unless the shape overlaps something already at 'from') */
+    if(hit && t1 > 0)
+        {
+        for(k = 0; k < SWEEP_BISECTIONS; k++)
+            {
+            t = (t0 + t1)/2;
+            if(SweepTest(&s, t, &c, &g)) { t1 = t; contact = c; hitgeom = g; }
+            else t0 = t;
+            }
+        }
+    dGeomDestroy(s.shape);
+    if(s.c.items) Free(L, s.c.items);
+    if(!hit) { lua_pushnil(L); return 1; }
+    lua_pushnumber(L, t0);
+    pushvec3(L, contact.pos);
+    pushvec3(L, contact.normal);
+    pushxxx(L, hitgeom);
+    return 4;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Region queries                                                               |
+ *------------------------------------------------------------------------------*/
+
+/* Region queries do not use snapshots: they run a query geom bounding the region
+ * against the space with dSpaceCollide2(), so to use the space's own broadphase, and
+ * query the static tree of split spaces directly. */
+
+typedef struct region_s region_t;
+struct region_s {
+    geom_t geom; /* query geom, bounding the region */
+    uint32_t mask;
+    int (*test)(region_t *r, const double aabb[6]); /* returns 1 if the AABB is in the region */
+    const double *box;
+    double center[3], radius;
+    collect_t c; /* results */
+    int err;
+};
+
+static int RegionBoxTest(region_t *r, const double aabb[6])
+    {
+    return AabbOverlap(aabb, r->box);
+    }
+
+static int RegionSphereTest(region_t *r, const double aabb[6])
+    {
+    int i;
+    double d, d2 = 0;
+    for(i = 0; i < 3; i++)
+        {
+        if(r->center[i] < aabb[2*i]) d = aabb[2*i] - r->center[i];
+        else if(r->center[i] > aabb[2*i+1]) d = r->center[i] - aabb[2*i+1];
+        else continue;
+        d2 += d*d;
+        }
+    return d2 <= r->radius*r->radius;
+    }
+
+static void RegionGeom(lua_State *L, region_t *r, geom_t geom)
+    {
+    double aabb[6];
+    if(r->err || !dGeomIsEnabled(geom)) return;
+    if(r->mask != 0xffffffff && (dGeomGetCategoryBits(geom) & r->mask) == 0) return;
+    dGeomGetAABB(geom, aabb);
+    if(r->test(r, aabb)) r->err = CollectItem(L, &r->c, geom);
+    }
+
+static void RegionSpace(region_t *r, space_t space);
+
+static void RegionPair(void *data, geom_t o1, geom_t o2)
+    {
+    region_t *r = (region_t*)data;
+    geom_t geom = (o1 == r->geom) ? o2 : o1;
+    if(dGeomIsSpace(geom))
+        RegionSpace(r, (space_t)geom);
+    else
+        RegionGeom(moonode_L, r, geom);
+    }
+
+static int RegionItem(const bvh_item_t *item, void *data)
+    {
+    RegionGeom(moonode_L, (region_t*)data, item->geom);
+    return 0;
+    }
+
+static void RegionSpace(region_t *r, space_t space)
+    {
+    double aabb[6];
+    bvh_t *bvh;
+    space_t statics;
+    dSpaceCollide2(r->geom, (geom_t)space, r, RegionPair);
+    if((statics = splitspacestatics(space)) == NULL) return;
+    if((bvh = splitspacestaticsbvh(space)) != NULL)
+        {
+        dGeomGetAABB(r->geom, aabb);
+        bvh_query_box(bvh, aabb, RegionItem, r);
+        }
+    else /* the tree is out of date, and will be rebuilt at the next collide pass */
+        dSpaceCollide2(r->geom, (geom_t)statics, r, RegionPair);
+    }
+
+static int RegionQuery(lua_State *L, space_t space, region_t *r, int outarg)
+/* Runs the query and stores the geoms found in the table at outarg (or in a new table
+ * if outarg is nil). Destroys r->geom and leaves n, table on the stack. */
+    {
+    int i;
+    ud_t *ud;
+    int n = 0;
+    /* the query geom has no category bits, and collides only with the mask categories */
+    dGeomSetCategoryBits(r->geom, 0);
+    dGeomSetCollideBits(r->geom, r->mask);
+    RegionSpace(r, space);
+    dGeomDestroy(r->geom);
+    if(r->err)
+        {
+        if(r->c.items) Free(L, r->c.items);
+        return errmemory(L);
+        }
+    if(lua_isnoneornil(L, outarg))
+        lua_newtable(L);
+    else
+        lua_pushvalue(L, outarg);
+    for(i = 0; i < r->c.count; i++)
+        {
+        if((ud = userdata(r->c.items[i].geom)) == NULL) continue;
+        pushuserdata(L, ud);
+        lua_rawseti(L, -2, ++n);
+        }
+    /* clear any entries left from previous uses of the table */
+    for(i = n + 1; lua_rawgeti(L, -1, i) != LUA_TNIL; i++)
+        {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+        lua_rawseti(L, -2, i);
+        }
+    lua_pop(L, 1);
+    if(r->c.items) Free(L, r->c.items);
+    lua_pushinteger(L, n);
+    lua_insert(L, -2);
+    return 2;
+    }
+
+static int QueryAABB(lua_State *L)
+/* n, {geom} = space:query_aabb(box, [out], [mask]) */
+    {
+    region_t r;
+    box3_t box;
+    space_t space = checkspace(L, 1, NULL);
+    checkbox3(L, 2, box);
+    if(!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+    memset(&r, 0, sizeof(r));
+    r.mask = (uint32_t)luaL_optinteger(L, 4, 0xffffffff);
+    if(box[1] < box[0] || box[3] < box[2] || box[5] < box[4]) return argerror(L, 2, ERR_VALUE);
+    r.box = box;
+    r.test = RegionBoxTest;
+    r.geom = dCreateBox(NULL, box[1] - box[0], box[3] - box[2], box[5] - box[4]);
+    dGeomSetPosition(r.geom, (box[0] + box[1])/2, (box[2] + box[3])/2, (box[4] + box[5])/2);
+    return RegionQuery(L, space, &r, 3);
+    }
+
+static int QuerySphere(lua_State *L)
+/* n, {geom} = space:query_sphere(center, radius, [out], [mask]) */
+    {
+    region_t r;
+    vec3_t center;
+    space_t space = checkspace(L, 1, NULL);
+    checkvec3(L, 2, center);
+    memset(&r, 0, sizeof(r));
+    r.radius = luaL_checknumber(L, 3);
+    if(!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+    r.mask = (uint32_t)luaL_optinteger(L, 5, 0xffffffff);
+    if(r.radius < 0) return argerror(L, 3, ERR_VALUE);
+    r.center[0] = center[0]; r.center[1] = center[1]; r.center[2] = center[2];
+    r.test = RegionSphereTest;
+    r.geom = dCreateSphere(NULL, r.radius);
+    dGeomSetPosition(r.geom, center[0], center[1], center[2]);
+    return RegionQuery(L, space, &r, 4);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Frustum culling                                                              |
+ *------------------------------------------------------------------------------*/
+
+#define MAX_PLANES 32
+#define XFORM_SIZE 7 /* position (3), quaternion (4) */
+
+typedef struct {
+    double planes[4*MAX_PLANES];
+    int count;
+    uint32_t mask;
+    collect_t c; /* results */
+} frustum_t;
+
+static int FrustumItem(const bvh_item_t *item, void *data)
+    {
+    frustum_t *f = (frustum_t*)data;
+    if(!dGeomIsEnabled(item->geom)) return 0;
+    if(f->mask != 0xffffffff && (dGeomGetCategoryBits(item->geom) & f->mask) == 0) return 0;
+    return CollectItem(moonode_L, &f->c, item->geom);
+    }
+
+static int FrustumSpace(lua_State *L, frustum_t *f, space_t space, int inside)
+/* Collects the geoms of the space that are not outside the frustum. Sub-spaces are
+ * culled as a whole by their AABB, and those entirely inside are not tested further. */
+    {
+    int i, n, cls, err = 0;
+    double aabb[6];
+    geom_t geom;
+    bvh_t *bvh;
+    space_t statics;
+    n = dSpaceGetNumGeoms(space);
+    for(i = 0; i < n && !err; i++)
+        {
+        geom = dSpaceGetGeom(space, i);
+        if(!dGeomIsEnabled(geom)) continue;
+        cls = inside;
+        if(!inside)
+            {
+            dGeomGetAABB(geom, aabb);
+            if((cls = bvh_classify_planes(aabb, f->planes, f->count)) < 0) continue;
+            }
+        if(dGeomIsSpace(geom))
+            err = FrustumSpace(L, f, (space_t)geom, cls);
+        else if(f->mask == 0xffffffff || (dGeomGetCategoryBits(geom) & f->mask) != 0)
+            err = CollectItem(L, &f->c, geom);
+        }
+    if(err) return err;
+    if((statics = splitspacestatics(space)) == NULL) return 0;
+    if((bvh = splitspacestaticsbvh(space)) != NULL)
+        return bvh_query_planes(bvh, f->planes, f->count, FrustumItem, f) ? ERR_MEMORY : 0;
+    return FrustumSpace(L, f, statics, inside);
+    }
+
+typedef struct {
+    frustum_t *f;
+    buffer_t buffer;
+    size_t offset;
+} frustumresults_t;
+
+static int FrustumResults(lua_State *L)
+/* Pushes the results of QueryFrustum and writes the transforms in the buffer.
+ * Executed in protected mode, so that the caller can release the items on error. */
+    {
+    int i, k;
+    double *xform;
+    const double *pos;
+    quat_t q;
+    ud_t *ud;
+    geom_t geom;
+    frustumresults_t *r = (frustumresults_t*)lua_touserdata(L, 1);
+    frustum_t *f = r->f;
+    xform = (double*)bufferreserve(L, r->buffer, r->offset, f->c.count*XFORM_SIZE*sizeof(double));
+    lua_pushinteger(L, f->c.count);
+    lua_newtable(L);
+    for(i = k = 0; i < f->c.count; i++)
+        {
+        geom = f->c.items[i].geom;
+        if((ud = userdata(geom)) == NULL) continue;
+        pushuserdata(L, ud);
+        lua_rawseti(L, -2, ++k);
+        if(dGeomGetClass(geom) == dPlaneClass) /* non-placeable */
+            {
+            memset(xform, 0, XFORM_SIZE*sizeof(double));
+            xform[3] = 1;
+            }
+        else
+            {
+            pos = dGeomGetPosition(geom);
+            dGeomGetQuaternion(geom, q);
+            xform[0] = pos[0]; xform[1] = pos[1]; xform[2] = pos[2];
+            xform[3] = q[0]; xform[4] = q[1]; xform[5] = q[2]; xform[6] = q[3];
+            }
+        xform += XFORM_SIZE;
+        }
+    if(k < f->c.count) /* (should not happen) */
+        { lua_pushinteger(L, k); lua_replace(L, -3); }
+    return 2;
+    }
+
+static int QueryFrustum(lua_State *L)
+/* n, {geom} = space:query_frustum(planes, buffer, [offset], [mask]) */
+    {
+    int err;
+    vec4_t *planes;
+    frustum_t f;
+    frustumresults_t r;
+    space_t space = checkspace(L, 1, NULL);
+    r.buffer = checkbuffer(L, 3, NULL);
+    r.offset = checkoffset(L, 4);
+    r.f = &f;
+    memset(&f, 0, sizeof(f));
+    f.mask = (uint32_t)luaL_optinteger(L, 5, 0xffffffff);
+    planes = checkvec4list(L, 2, &f.count, NULL);
+    if(f.count > MAX_PLANES) { Free(L, planes); return argerror(L, 2, ERR_LENGTH); }
+    memcpy(f.planes, planes, f.count*sizeof(vec4_t));
+    Free(L, planes);
+    if((err = FrustumSpace(L, &f, space, 0)) != 0)
+        {
+        if(f.c.items) Free(L, f.c.items);
+        return errmemory(L);
+        }
+    lua_pushcfunction(L, FrustumResults);
+    lua_pushlightuserdata(L, &r);
+    err = lua_pcall(L, 1, 2, 0);
+    if(f.c.items) Free(L, f.c.items);
+    if(err != LUA_OK) return lua_error(L);
+    return 2;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Nearest geoms                                                                |
+ *------------------------------------------------------------------------------*/
+
+typedef struct {
+    geom_t geom;
+    double dist; /* lower bound (distance to the AABB) or exact distance */
+} nearest_t;
+
+static int NearestCompare(const void *a, const void *b)
+    {
+    double da = ((const nearest_t*)a)->dist, db = ((const nearest_t*)b)->dist;
+    return da < db ? -1 : (da > db ? 1 : 0);
+    }
+
+static double AabbDistance(const double aabb[6], const double point[3])
+    {
+    int i;
+    double d, d2 = 0;
+    for(i = 0; i < 3; i++)
+        {
+        if(point[i] < aabb[2*i]) d = aabb[2*i] - point[i];
+        else if(point[i] > aabb[2*i+1]) d = point[i] - aabb[2*i+1];
+        else continue;
+        d2 += d*d;
+        }
+    return sqrt(d2);
+    }
+
+static int QueryNearest(lua_State *L)
+/* n, {geom}, {distance} = space:query_nearest(point, k, [maxdist], [mask]) */
+    {
+    int i, j, k, n, count, rc;
+    double maxdist, dist, box[6], p1[3], p2[3];
+    vec3_t point;
+    uint32_t mask;
+    collect_t c;
+    nearest_t *cand, *best;
+    ud_t *ud;
+    space_t space = checkspace(L, 1, NULL);
+    checkvec3(L, 2, point);
+    k = luaL_checkinteger(L, 3);
+    maxdist = luaL_optnumber(L, 4, HUGE_VAL);
+    mask = (uint32_t)luaL_optinteger(L, 5, 0xffffffff);
+    if(k < 1) return argerror(L, 3, ERR_VALUE);
+    if(maxdist < 0) return argerror(L, 4, ERR_VALUE);
+    for(i = 0; i < 3; i++)
+        { box[2*i] = point[i] - maxdist; box[2*i+1] = point[i] + maxdist; }
+    memset(&c, 0, sizeof(c));
+    c.box = box;
+    if(Collect(L, &c, space) != 0)
+        {
+        if(c.items) Free(L, c.items);
+        return errmemory(L);
+        }
+    /* candidates, sorted by the distance of their AABBs (a lower bound for their
+     * distance), and k best results so far, sorted by distance */
+    cand = (nearest_t*)MallocNoErr(L, (c.count + 1)*sizeof(nearest_t));
+    best = (nearest_t*)MallocNoErr(L, (k < c.count ? k : c.count + 1)*sizeof(nearest_t));
+    if(!cand || !best)
+        {
+        if(cand) Free(L, cand);
+        if(best) Free(L, best);
+        if(c.items) Free(L, c.items);
+        return errmemory(L);
+        }
+    for(i = count = 0; i < c.count; i++)
+        {
+        if(mask != 0xffffffff && (dGeomGetCategoryBits(c.items[i].geom) & mask) == 0) continue;
+        cand[count].geom = c.items[i].geom;
+        cand[count].dist = AabbDistance(c.items[i].aabb, point);
+        if(cand[count].dist <= maxdist) count++;
+        }
+    qsort(cand, count, sizeof(nearest_t), NearestCompare);
+    n = 0;
+    for(i = 0; i < count; i++)
+        {
+        if(n == k && cand[i].dist >= best[k-1].dist) break; /* no better ones left */
+        /* (geomdistance() overwrites p2 with the closest point, so pass a copy) */
+        p2[0] = point[0]; p2[1] = point[1]; p2[2] = point[2];
+        rc = geomdistance(cand[i].geom, NULL, &dist, p1, p2);
+        if(rc == 1) dist = 0; /* the point is inside the geom */
+        else if(rc != 0) dist = cand[i].dist; /* not supported: use the AABB distance */
+        if(dist > maxdist || (n == k && dist >= best[k-1].dist)) continue;
+        /* insert it in the best ones */
+        j = (n < k) ? n++ : k - 1;
+        for(; j > 0 && best[j-1].dist > dist; j--) best[j] = best[j-1];
+        best[j].geom = cand[i].geom;
+        best[j].dist = dist;
+        }
+    Free(L, cand);
+    if(c.items) Free(L, c.items);
+    lua_pushinteger(L, n);
+    lua_newtable(L);
+    lua_newtable(L);
+    for(i = j = 0; i < n; i++)
+        {
+        if((ud = userdata(best[i].geom)) == NULL) continue;
+        j++;
+        pushuserdata(L, ud);
+        lua_rawseti(L, -3, j);
+        lua_pushnumber(L, best[i].dist);
+        lua_rawseti(L, -2, j);
+        }
+    Free(L, best);
+    if(j < n) /* (should not happen) */
+        { lua_pushinteger(L, j); lua_replace(L, -4); }
+    return 3;
+    }
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "raycast_batch", RaycastBatch },
+        { "sweep", Sweep },
+        { "query_aabb", QueryAABB },
+        { "query_sphere", QuerySphere },
+        { "query_frustum", QueryFrustum },
+        { "query_nearest", QueryNearest },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_space_query(lua_State *L)
+    {
+    udata_addmethods(L, SPACE_MT, Methods);
+    }
+
@@ -0,0 +1,377 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonODE, https://github.com/stetre/moonode
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* A split space is a simple space that contains the dynamic geoms, plus a hidden simple
+ * space that contains the static geoms. The AABBs of the static geoms are indexed by a
+ * bvh that is built once, and rebuilt only when the set of static geoms changes (or on
+ * explicit request, e.g. after a static geom has been moved).
+ * Each collide pass tests the dynamic geoms against each other and against the bvh, so
+ * static geoms are never tested against each other.
+ */
+
+#define MAGIC 0x53504c54 /* identifies the info_t attached to the hidden space */
+
+typedef struct {
+    uint32_t magic;
+    space_t statics; /* hidden space containing the static geoms */
+    bvh_t *bvh; /* tree over the AABBs of the static geoms */
+    int dirty; /* the tree must be rebuilt */
+} info_t;
+
+typedef struct {
+    info_t *info;
+    geom_t geom; /* the current query source */
+    void *data;
+    dNearCallback *callback;
+} collide_t;
+
+static int freespace(lua_State *L, ud_t *ud)
+    {
+    space_t space = (space_t)ud->handle;
+    info_t *info = (info_t*)ud->info;
+    ud->info = NULL; /* to prevent its automatic deletion */
+    if(!freeuserdata(L, ud, "space_split")) return 0;
+    if(info)
+        {
+        bvh_free(L, info->bvh);
+        info->bvh = NULL;
+        spacedestroy(L, info->statics);
+        Free(L, info);
+        }
+    spacedestroy(L, space);
+    return 0;
+    }
+
+static int newspace(lua_State *L, space_t space, info_t *info)
+    {
+    ud_t *ud;
+    ud = newuserdata(L, space, SPACE_SPLIT_MT, "space_split");
+    ud->parent_ud = NULL;
+    ud->info = info;
+    ud->destructor = freespace;
+    return 1;
+    }
+
+static int Create(lua_State *L)
+    {
+    space_t space;
+    space_t parentspace = optspace(L, 1, NULL);
+    info_t *info = (info_t*)Malloc(L, sizeof(info_t));
+    info->magic = MAGIC;
+    info->statics = dSimpleSpaceCreate(NULL);
+    dGeomSetData((geom_t)info->statics, info);
+    info->dirty = 1;
+    space = dSimpleSpaceCreate(parentspace);
+    return newspace(L, space, info);
+    }
+
+int issplitspace(space_t space)
+    {
+    ud_t *ud = userdata(space);
+    return ud && ud->destructor == freespace;
+    }
+
+space_t splitspacestatics(space_t space)
+/* Returns the hidden space with the static geoms, if space is a split space */
+    {
+    ud_t *ud = userdata(space);
+    if(!ud || ud->destructor != freespace) return NULL;
+    return ((info_t*)ud->info)->statics;
+    }
+
+bvh_t *splitspacestaticsbvh(space_t space)
+/* Returns the tree of the static geoms of a split space, or NULL if it is out of date
+ * (or if space is not a split space) */
+    {
+    info_t *info;
+    ud_t *ud = userdata(space);
+    if(!ud || ud->destructor != freespace) return NULL;
+    info = (info_t*)ud->info;
+    return info->dirty ? NULL : info->bvh;
+    }
+
+void splitspacegeomdestroyed(geom_t geom)
+/* Called when a geom is being destroyed: if it is a static geom of a split space,
+ * the tree of the split space must be rebuilt.
+ */
+    {
+    splitspacegeomchanged(geom);
+    }
+
+void splitspacegeomchanged(geom_t geom)
+/* Called when the AABB of a geom changes other than by moving it (e.g. because its 
+ * data was modified): same as above. */
+    {
+    info_t *info;
+    space_t space = dGeomGetSpace(geom);
+    if(!space) return;
+    info = (info_t*)dGeomGetData((geom_t)space);
+    if(info && info->magic == MAGIC)
+        info->dirty = 1;
+    }
+
+static void Rebuild(lua_State *L, info_t *info)
+    {
+    int i;
+    int n = dSpaceGetNumGeoms(info->statics);
+    bvh_item_t *items = NULL;
+    bvh_free(L, info->bvh);
+    info->bvh = NULL;
+    if(n > 0)
+        {
+        items = (bvh_item_t*)Malloc(L, n*sizeof(bvh_item_t));
+        for(i = 0; i < n; i++)
+            {
+            items[i].geom = dSpaceGetGeom(info->statics, i);
+            dGeomGetAABB(items[i].geom, items[i].aabb);
+            }
+        }
+    info->bvh = bvh_build(L, items, n); /* this makes a copy of the items */
+    if(items) Free(L, items);
+    if(!info->bvh) { errmemory(L); return; }
+    info->dirty = 0;
+    }
+
+static int IsSleeping(geom_t geom)
+/* A geom is sleeping if it is attached to a disabled body */
+    {
+    body_t body;
+    if(dGeomIsSpace(geom)) return 0;
+    body = dGeomGetBody(geom);
+    return body && !dBodyIsEnabled(body);
+    }
+
+static int Match(geom_t g1, geom_t g2)
+/* Same filtering as done by ODE for pairs of geoms from the same space */
+    {
+    body_t body = dGeomGetBody(g1);
+    if(body && body == dGeomGetBody(g2)) return 0;
+    return ((dGeomGetCategoryBits(g1) & dGeomGetCollideBits(g2)) ||
+            (dGeomGetCategoryBits(g2) & dGeomGetCollideBits(g1)));
+    }
+
+static void DynamicPair(void *data, geom_t o1, geom_t o2)
+    {
+    collide_t *c = (collide_t*)data;
+    if(IsSleeping(o1) && IsSleeping(o2)) return;
+    c->callback(c->data, o1, o2);
+    }
+
+static int StaticPair(const bvh_item_t *item, void *data)
+    {
+    collide_t *c = (collide_t*)data;
+    geom_t geom = item->geom;
+    if(c->info->dirty) return 1; /* the callback modified the static geoms */
+    if(!dGeomIsEnabled(geom) || !Match(c->geom, geom)) return 0;
+    if(dGeomIsSpace(c->geom))
+        dSpaceCollide2(c->geom, geom, c->data, c->callback);
+    else
+        c->callback(c->data, c->geom, geom);
+    return 0;
+    }
+
+void splitspacecollide(lua_State *L, space_t space, void *data, dNearCallback *callback)
+/* dSpaceCollide() replacement for split spaces */
+    {
+    int i;
+    box3_t aabb;
+    collide_t c;
+    ud_t *ud = userdata(space);
+    info_t *info = ud ? (info_t*)ud->info : NULL;
+    if(!info) { dSpaceCollide(space, data, callback); return; }
+    c.info = info;
+    c.data = data;
+    c.callback = callback;
+    /* dynamic vs dynamic, skipping pairs where both are sleeping */
+    dSpaceCollide(space, &c, DynamicPair);
+    /* dynamic vs static, skipping sleeping query sources */
+    if(info->dirty) Rebuild(L, info);
+    if(bvh_count(info->bvh) == 0) return;
+    /* Note that the number of geoms is re-read at each iteration, because the
+     * callback may have destroyed some of them. If it modified the static geoms,
+     * the query for the current geom is stopped and the tree is rebuilt before
+     * going on with the next ones */
+    for(i = 0; i < dSpaceGetNumGeoms(space); i++)
+        {
+        c.geom = dSpaceGetGeom(space, i);
+        if(!c.geom || !dGeomIsEnabled(c.geom) || IsSleeping(c.geom)) continue;
+        dGeomGetAABB(c.geom, aabb);
+        if(bvh_query_box(info->bvh, aabb, StaticPair, &c) && info->dirty)
+            Rebuild(L, info);
+        }
+    }
+
+static void StaticCollide(lua_State *L, space_t space, geom_t geom, void *data, dNearCallback *callback)
+/* Tests geom (or the geoms in it, if it is a space) against the static geoms of space */
+    {
+    box3_t aabb;
+    collide_t c;
+    ud_t *ud = userdata(space);
+    info_t *info = ud ? (info_t*)ud->info : NULL;
+    if(!info || !dGeomIsEnabled(geom) || IsSleeping(geom)) return;
+    if(info->dirty) Rebuild(L, info);
+    if(bvh_count(info->bvh) == 0) return;
+    c.info = info;
+    c.geom = geom;
+    c.data = data;
+    c.callback = callback;
+    dGeomGetAABB(geom, aabb);
+    /* if the callback modified the static geoms, the query was stopped: rebuild the
+     * tree, so that it is up to date for the queries that follow */
+    if(bvh_query_box(info->bvh, aabb, StaticPair, &c) && info->dirty)
+        Rebuild(L, info);
+    }
+
+void splitspacecollide2(lua_State *L, space_t space, geom_t geom, void *data, dNearCallback *callback)
+/* dSpaceCollide2() replacement for a split space against a geom or another space
+ * (possibly split too). Static geoms are not tested against each other. */
+    {
+    /* dynamic vs dynamic */
+    dSpaceCollide2((geom_t)space, geom, data, callback);
+    /* geom vs the static geoms of space */
+    StaticCollide(L, space, geom, data, callback);
+    /* dynamic geoms of space vs the static geoms of geom */
+    if(dGeomIsSpace(geom) && issplitspace((space_t)geom))
+        StaticCollide(L, (space_t)geom, (geom_t)space, data, callback);
+    }
+
+static int AddStatic(lua_State *L)
+    {
+    ud_t *ud;
+    geom_t geom;
+    space_t space;
+    info_t *info;
+    (void)checkspace_split(L, 1, &ud);
+    geom = checkgeom(L, 2, NULL);
+    info = (info_t*)ud->info;
+    space = dGeomGetSpace(geom);
+    if(space == info->statics) return 0;
+    if(space) dSpaceRemove(space, geom);
+    dSpaceAdd(info->statics, geom);
+    info->dirty = 1;
+    return 0;
+    }
+
+static int RemoveStatic(lua_State *L)
+/* Moves a static geom back to the dynamic geoms */
+    {
+    ud_t *ud;
+    space_t space = checkspace_split(L, 1, &ud);
+    geom_t geom = checkgeom(L, 2, NULL);
+    info_t *info = (info_t*)ud->info;
+    if(dGeomGetSpace(geom) != info->statics) return argerror(L, 2, ERR_VALUE);
+    dSpaceRemove(info->statics, geom);
+    dSpaceAdd(space, geom);
+    info->dirty = 1;
+    return 0;
+    }
+
+static int IsStatic(lua_State *L)
+    {
+    ud_t *ud;
+    space_t space;
+    geom_t geom;
+    (void)checkspace_split(L, 1, &ud);
+    geom = checkgeom(L, 2, NULL);
+    space = ((info_t*)ud->info)->statics;
+    lua_pushboolean(L, dGeomGetSpace(geom) == space);
+    return 1;
+    }
+
+static int GetNumStaticGeoms(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkspace_split(L, 1, &ud);
+    lua_pushinteger(L, dSpaceGetNumGeoms(((info_t*)ud->info)->statics));
+    return 1;
+    }
+
+static int GetStaticGeoms(lua_State *L)
+    {
+    int i, j, n;
+    space_t statics;
+    ud_t *ud, *geom_ud;
+    (void)checkspace_split(L, 1, &ud);
+    statics = ((info_t*)ud->info)->statics;
+    n = dSpaceGetNumGeoms(statics);
+    lua_newtable(L);
+    j = 1;
+    for(i = 0; i < n; i++)
+        {
+        geom_ud = userdata(dSpaceGetGeom(statics, i));
+        if(geom_ud)
+            {
+            pushuserdata(L, geom_ud);
+            lua_rawseti(L, -2, j++);
+            }
+        }
+    return 1;
+    }
+
+static int Rebuild_(lua_State *L)
+/* Forces the tree to be rebuilt at the next collide pass (to be called
+ * if static geoms are moved or resized). */
+    {
+    ud_t *ud;
+    (void)checkspace_split(L, 1, &ud);
+    ((info_t*)ud->info)->dirty = 1;
+    return 0;
+    }
+
+DESTROY_FUNC(space)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "add_static", AddStatic },
+        { "remove_static", RemoveStatic },
+        { "is_static", IsStatic },
+        { "get_num_static_geoms", GetNumStaticGeoms },
+        { "get_static_geoms", GetStaticGeoms },
+        { "rebuild", Rebuild_ },
+        { "destroy", Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc", Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "create_split_space", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonode_open_space_split(lua_State *L)
+    {
+    udata_define(L, SPACE_SPLIT_MT, Methods, MetaMethods);
+    udata_inherit(L, SPACE_SPLIT_MT, SPACE_MT);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -24,73 +24,289 @@
  */
 
 #include "internal.h"
+#include <limits.h>
 
 typedef struct {
     void *positions;
     void *indices;
+    int ownpositions; /* positions allocated here (copied from a string) */
+    int ownindices; /* ditto, for indices */
+    buffer_t pbuffer; /* buffers used in place for positions and indices (if any) */
+    buffer_t ibuffer;
+    mapfile_t *map; /* mapped file containing positions and indices (if any) */
+    mesh_t mesh; /* shared mesh providing the positions, and possibly the indices (if any) */
+    int vertextype;
+    int pcount; /* no. of vertices */
+    int icount; /* no. of indices */
 } info_t;
 
+/* Header of tmdata files, followed by the positions and then by the indices */
+typedef struct {
+    char magic[4]; /* "MOTM" */
+    uint32_t version; /* = 1 */
+    uint32_t vertextype; /* DATATYPE_FLOAT or DATATYPE_DOUBLE */
+    uint32_t vertexcount;
+    uint32_t trianglecount;
+    uint32_t reserved[3];
+} fileheader_t;
+
+#define FILE_MAGIC "MOTM"
+#define FILE_VERSION 1
+
 static int freetmdata(lua_State *L, ud_t *ud)
     {
     tmdata_t tmdata = (tmdata_t)ud->handle;
     info_t *info = (info_t*)ud->info;
     ud->info = NULL; // to prevent its automatic deletion
     if(!freeuserdata(L, ud, "tmdata")) return 0;
+    dGeomTriMeshDataDestroy(tmdata);
     if(info)
         {
-        Free(L, info->positions);
-        Free(L, info->indices);
+        if(info->ownpositions) Free(L, info->positions);
+        if(info->ownindices) Free(L, info->indices);
+        if(info->pbuffer) bufferunpin(L, info->pbuffer);
+        if(info->ibuffer) bufferunpin(L, info->ibuffer);
+        if(info->map) mapfile_close(L, info->map);
+        if(info->mesh) meshunref(L, info->mesh);
         Free(L, info);
         }
-    dGeomTriMeshDataDestroy(tmdata);
     return 0;
     }
 
-static int Create(lua_State *L)
+const char *tmdata_checkdata(lua_State *L, int arg, size_t *len, buffer_t *buffer)
+/* Data passed either as a binary string or as a buffer (to be used in place) */
     {
-    int single=0;
-    int pstride, istride;
-    int pcount, icount;
-    size_t plen, ilen;
-    ud_t *ud;
-    info_t *info;
-    int vertextype = checkdatatype(L, 1);
-    const char* positions = luaL_checklstring(L, 2, &plen);
-    const char* indices = luaL_checklstring(L, 3, &ilen);
-    tmdata_t tmdata = dGeomTriMeshDataCreate();
+    if((*buffer = testbuffer(L, arg, NULL)) != NULL)
+        {
+        *len = (*buffer)->size;
+        return (*buffer)->data;
+        }
+    return luaL_checklstring(L, arg, len);
+    }
 
+int tmdata_positionstride(int vertextype)
+/* Size of a vertex position, or 0 if vertextype is not supported */
+    {
     switch(vertextype)
         {
-        case DATATYPE_FLOAT: single=1; pstride = 3*sizeof(float); break;
-        case DATATYPE_DOUBLE: single=0; pstride = 3*sizeof(double); break;
-        default:
-            return argerror(L, 2, ERR_VALUE);
+        case DATATYPE_FLOAT: return 3*sizeof(float);
+        case DATATYPE_DOUBLE: return 3*sizeof(double);
+        default: return 0;
         }
-    istride = 3*sizeof(uint32_t);
+    return 0;
+    }
 
-    if(plen==0 || plen % pstride != 0)
-        return argerror(L, 3, ERR_LENGTH);
-    pcount = plen/pstride;
-    if(ilen==0 || ilen % istride != 0)
-        return argerror(L, 3, ERR_LENGTH);
-    icount = ilen/sizeof(uint32_t);
+#define INDEX_STRIDE (3*sizeof(uint32_t))
 
-    info = Malloc(L, sizeof(info_t));
-    info->positions = Strndup(L, positions, plen);
-    info->indices = Strndup(L, indices, ilen);
-    if(single)
+static ud_t *newtmdata(lua_State *L, int vertextype, info_t *info, int pcount, int icount)
+/* Builds a tmdata with the positions and indices in info (pushes it on the stack) */
+    {
+    ud_t *ud;
+    int pstride = tmdata_positionstride(vertextype);
+    tmdata_t tmdata = dGeomTriMeshDataCreate();
+    info->vertextype = vertextype;
+    info->pcount = pcount;
+    info->icount = icount;
+    if(vertextype == DATATYPE_FLOAT)
         dGeomTriMeshDataBuildSingle(tmdata, info->positions, pstride, pcount,
-                info->indices, icount, istride);
+                info->indices, icount, INDEX_STRIDE);
     else
         dGeomTriMeshDataBuildDouble(tmdata, info->positions, pstride, pcount,
-                info->indices, icount, istride);
+                info->indices, icount, INDEX_STRIDE);
     ud = newuserdata(L, tmdata, TMDATA_MT, "tmdata");
     ud->parent_ud = NULL;
     ud->info = info;
     ud->destructor = freetmdata;
+    return ud;
+    }
+
+static int CreateFromMesh(lua_State *L, mesh_t mesh)
+/* create_tmdata(mesh, [indices | firsttriangle, [numtriangles]]) */
+    {
+    int icount;
+    size_t ilen;
+    ud_t *ud;
+    info_t *info;
+    buffer_t ibuffer = NULL;
+    const char *indices = NULL;
+    lua_Integer first, count;
+    if(lua_isnoneornil(L, 2) || lua_type(L, 2) == LUA_TNUMBER)
+        {
+        /* index range of the mesh's own indices, used in place */
+        if(!mesh->indices) return argerror(L, 2, ERR_NOTPRESENT);
+        first = luaL_optinteger(L, 2, 0);
+        if(first < 0 || first >= mesh->icount/3) return argerror(L, 2, ERR_RANGE);
+        count = luaL_optinteger(L, 3, mesh->icount/3 - first);
+        if(count <= 0 || count > mesh->icount/3 - first) return argerror(L, 3, ERR_RANGE);
+        icount = 3*count;
+        }
+    else
+        {
+        indices = tmdata_checkdata(L, 2, &ilen, &ibuffer);
+        if(ilen==0 || ilen % INDEX_STRIDE != 0)
+            return argerror(L, 2, ERR_LENGTH);
+        icount = ilen/sizeof(uint32_t);
+        first = 0;
+        }
+    info = Malloc(L, sizeof(info_t));
+    memset(info, 0, sizeof(info_t));
+    info->positions = mesh->positions;
+    if(indices)
+        {
+        info->indices = ibuffer ? (void*)indices : Strndup(L, indices, ilen);
+        info->ownindices = (ibuffer == NULL);
+        }
+    else
+        info->indices = (uint32_t*)mesh->indices + 3*first;
+    info->mesh = mesh;
+    meshref(mesh);
+    ud = newtmdata(L, mesh->vertextype, info, mesh->pcount, icount);
+    if(ibuffer)
+        {
+        bufferpin(ibuffer);
+        info->ibuffer = ibuffer;
+        lua_pushvalue(L, 2);
+        ud->ref2 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
     return 1;
     }
 
+static int Create(lua_State *L)
+    {
+    int pstride;
+    int pcount, icount;
+    size_t plen, ilen;
+    ud_t *ud;
+    info_t *info;
+    buffer_t pbuffer, ibuffer;
+    int vertextype;
+    const char *positions, *indices;
+    mesh_t mesh = testmesh(L, 1, NULL);
+    if(mesh) return CreateFromMesh(L, mesh);
+    vertextype = checkdatatype(L, 1);
+    positions = tmdata_checkdata(L, 2, &plen, &pbuffer);
+    indices = tmdata_checkdata(L, 3, &ilen, &ibuffer);
+
+    if((pstride = tmdata_positionstride(vertextype)) == 0)
+        return argerror(L, 1, ERR_VALUE);
+
+    if(plen==0 || plen % pstride != 0)
+        return argerror(L, 2, ERR_LENGTH);
+    pcount = plen/pstride;
+    if(ilen==0 || ilen % INDEX_STRIDE != 0)
+        return argerror(L, 3, ERR_LENGTH);
+    icount = ilen/sizeof(uint32_t);
+
+    info = Malloc(L, sizeof(info_t));
+    memset(info, 0, sizeof(info_t));
+    /* data from buffers is used in place, data from strings is copied */
+    info->positions = pbuffer ? (void*)positions : Strndup(L, positions, plen);
+    info->indices = ibuffer ? (void*)indices : Strndup(L, indices, ilen);
+    info->ownpositions = (pbuffer == NULL);
+    info->ownindices = (ibuffer == NULL);
+    ud = newtmdata(L, vertextype, info, pcount, icount);
+    if(pbuffer)
+        {
+        bufferpin(pbuffer);
+        info->pbuffer = pbuffer;
+        lua_pushvalue(L, 2);
+        ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    if(ibuffer)
+        {
+        bufferpin(ibuffer);
+        info->ibuffer = ibuffer;
+        lua_pushvalue(L, 3);
+        ud->ref2 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    return 1;
+    }
+
+int tmdata_parsefile(mapfile_t *map, int *vertextype, int *pcount, int *icount, void **positions, void **indices)
+/* Checks the contents of a mapped tmdata file and locates the positions and indices in it.
+ * Returns ERR_SUCCESS or an error code */
+    {
+    fileheader_t header;
+    size_t plen, ilen;
+    if(map->size < sizeof(fileheader_t))
+        return ERR_LENGTH;
+    memcpy(&header, map->data, sizeof(fileheader_t));
+    if(memcmp(header.magic, FILE_MAGIC, 4) != 0 || header.version != FILE_VERSION ||
+            tmdata_positionstride(header.vertextype) == 0 || 
+            header.vertexcount == 0 || header.trianglecount == 0 ||
+            header.vertexcount > INT_MAX || header.trianglecount > INT_MAX/3)
+        return ERR_VALUE;
+    plen = (size_t)header.vertexcount * tmdata_positionstride(header.vertextype);
+    ilen = (size_t)header.trianglecount * INDEX_STRIDE;
+    if(map->size < sizeof(fileheader_t) + plen + ilen)
+        return ERR_LENGTH;
+    *vertextype = header.vertextype;
+    *pcount = header.vertexcount;
+    *icount = 3*header.trianglecount;
+    *positions = (void*)(map->data + sizeof(fileheader_t));
+    *indices = (void*)(map->data + sizeof(fileheader_t) + plen);
+    return ERR_SUCCESS;
+    }
+
+void tmdata_getdata(ud_t *ud, int *vertextype, int *pcount, const void **positions, int *icount, const uint32_t **indices)
+/* Retrieves the data the tmdata was built with (ud is the tmdata's userdata) */
+    {
+    info_t *info = (info_t*)ud->info;
+    *vertextype = info->vertextype;
+    *pcount = info->pcount;
+    *positions = info->positions;
+    *icount = info->icount;
+    *indices = (const uint32_t*)info->indices;
+    }
+
+static int CreateFromFile(lua_State *L)
+/* The file is mapped in memory and its contents are used in place */
+    {
+    int err, vertextype, pcount, icount;
+    info_t *info;
+    mapfile_t *map;
+    const char *filename = luaL_checkstring(L, 1);
+    map = mapfile_open(L, filename);
+    info = MallocNoErr(L, sizeof(info_t));
+    if(!info)
+        { mapfile_close(L, map); return errmemory(L); }
+    memset(info, 0, sizeof(info_t));
+    err = tmdata_parsefile(map, &vertextype, &pcount, &icount, &info->positions, &info->indices);
+    if(err)
+        { mapfile_close(L, map); Free(L, info); return argerror(L, 1, err); }
+    info->map = map;
+    newtmdata(L, vertextype, info, pcount, icount);
+    return 1;
+    }
+
+static int SaveFile(lua_State *L)
+/* save_tmdata_file(filename, ptype, positions, indices) */
+    {
+    int err, pstride;
+    size_t plen, ilen;
+    fileheader_t header;
+    buffer_t pbuffer, ibuffer;
+    const char *filename = luaL_checkstring(L, 1);
+    int vertextype = checkdatatype(L, 2);
+    const char* positions = tmdata_checkdata(L, 3, &plen, &pbuffer);
+    const char* indices = tmdata_checkdata(L, 4, &ilen, &ibuffer);
+    if((pstride = tmdata_positionstride(vertextype)) == 0)
+        return argerror(L, 2, ERR_VALUE);
+    if(plen==0 || plen % pstride != 0)
+        return argerror(L, 3, ERR_LENGTH);
+    if(ilen==0 || ilen % INDEX_STRIDE != 0)
+        return argerror(L, 4, ERR_LENGTH);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FILE_MAGIC, 4);
+    header.version = FILE_VERSION;
+    header.vertextype = vertextype;
+    header.vertexcount = plen / pstride;
+    header.trianglecount = ilen / INDEX_STRIDE;
+    err = mapfile_save(filename, &header, sizeof(header), positions, plen, indices, ilen);
+    if(err) return failure(L, err);
+    return 0;
+    }
+
 static int Preprocess(lua_State *L)
     {
     unsigned int flags = 0;
@@ -111,6 +327,48 @@ static int Update(lua_State *L)
     return 0;
     }
 
+static int SetPositions(lua_State *L)
+/* set_positions(data, [offset], [count], [first]) */
+    {
+    ud_t *ud;
+    info_t *info;
+    size_t len, stride, n;
+    char *dst;
+    const char *src;
+    buffer_t buffer;
+    lua_Integer count, first;
+    int changed;
+    tmdata_t tmdata = checktmdata(L, 1, &ud);
+    size_t offset = checkoffset(L, 3);
+    info = (info_t*)ud->info;
+    src = tmdata_checkdata(L, 2, &len, &buffer);
+    /* mapped files and shared meshes are read-only */
+    if(!info || info->map || info->mesh) return failure(L, ERR_OPERATION);
+    stride = tmdata_positionstride(info->vertextype);
+    if(offset > len) return argerror(L, 3, ERR_BOUNDARIES);
+    first = luaL_optinteger(L, 5, 0);
+    if(first < 0 || first >= info->pcount) return argerror(L, 5, ERR_RANGE);
+    count = luaL_optinteger(L, 4, (len - offset) / stride);
+    if(count > info->pcount - first) count = lua_isnoneornil(L, 4) ? info->pcount - first : -1;
+    if(count < 0) return argerror(L, 4, ERR_RANGE);
+    n = count * stride;
+    if(offset + n > len) return argerror(L, 4, ERR_LENGTH);
+    src += offset;
+    dst = (char*)info->positions + first * stride;
+    if(src == dst) /* written in place in the buffer */
+        changed = (n > 0);
+    else if((changed = (memcmp(dst, src, n) != 0)))
+        memmove(dst, src, n);
+    if(changed) 
+        {
+        /* refit the AABB tree and invalidate the AABBs of the geoms using the data */
+        dGeomTriMeshDataUpdate(tmdata);
+        trimeshdatachanged(L, tmdata);
+        }
+    lua_pushboolean(L, changed);
+    return 1;
+    }
+
 RAW_FUNC(tmdata)
 DESTROY_FUNC(tmdata)
 
@@ -119,6 +377,7 @@ static const struct luaL_Reg Methods[] =
         { "raw", Raw },
         { "preprocess", Preprocess },
         { "update", Update },
+        { "set_positions", SetPositions },
         { "destroy", Destroy },
         { NULL, NULL } /* sentinel */
     };
@@ -132,6 +391,8 @@ static const struct luaL_Reg MetaMethods[] =
 static const struct luaL_Reg Functions[] = 
     {
         { "create_tmdata", Create },
+        { "create_tmdata_from_file", CreateFromFile },
+        { "save_tmdata_file", SaveFile },
         { NULL, NULL } /* sentinel */
     };
 
@@ -25,51 +25,356 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include "tree.h"
 #include "udata.h"
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
 
 struct moonode_udata_s {
-    RB_ENTRY(moonode_udata_s) entry;
     uint64_t id; /* object id (search key) */
     /* references on the Lua registry */
-    int ref;    /* the correspoding userdata */
-    void *mem;  /* userdata memory area allocated and released by Lua */
+    int ref;    /* the correspoding userdata (LUA_NOREF for lazy entries) */
+    void *mem;  /* userdata memory area allocated and released by Lua (or by us, if lazy) */
     const char *mt;
+    int lazy;   /* handle-only entry, created with udata_new_lazy() */
+    udata_t *next; /* next free node (in the pool) */
+    /* class registry */
+    struct class_s *class;
+    udata_t *cprev, *cnext; /* siblings in the class list */
+    int dead; /* freed while the class was being scanned (see udata_free) */
 };
 
 #define UNEXPECTED_ERROR "unexpected error (%s, %d)", __FILE__, __LINE__
 
-static int cmp(udata_t *udata1, udata_t *udata2) /* the compare function */
-    { return (udata1->id < udata2->id ? -1 : udata1->id > udata2->id); } 
-
-static RB_HEAD(udatatree_s, udata_s) Head = RB_INITIALIZER(&Head);
-
-RB_PROTOTYPE_STATIC(udatatree_s, udata_s, entry, cmp) 
-RB_GENERATE_STATIC(udatatree_s, udata_s, entry, cmp) 
- 
-static udata_t *udata_remove(udata_t *udata) 
-    { return RB_REMOVE(udatatree_s, &Head, udata); }
-static udata_t *udata_insert(udata_t *udata) 
-    { return RB_INSERT(udatatree_s, &Head, udata); }
-static udata_t *udata_search(uint64_t id) 
-    { udata_t tmp; tmp.id = id; return RB_FIND(udatatree_s, &Head, &tmp); }
-static udata_t *udata_first(uint64_t id) 
-    { udata_t tmp; tmp.id = id; return RB_NFIND(udatatree_s, &Head, &tmp); }
-#if 0
-static udata_t *udata_next(udata_t *udata)
-    { return RB_NEXT(udatatree_s, &Head, udata); }
-static udata_t *udata_prev(udata_t *udata)
-    { return RB_PREV(udatatree_s, &Head, udata); }
-static udata_t *udata_min(void)
-    { return RB_MIN(udatatree_s, &Head); }
-static udata_t *udata_max(void)
-    { return RB_MAX(udatatree_s, &Head); }
-static udata_t *udata_root(void)
-    { return RB_ROOT(&Head); }
-#endif
+/*------------------------------------------------------------------------------*
+ | Proxies                                                                      |
+ *------------------------------------------------------------------------------*/
+
+/* The Lua userdata bound to an entry is a proxy that points to the entry's memory.
+ * For regular entries the memory immediately follows the proxy, in the same Lua
+ * userdata, and the proxy is anchored in the registry until the entry is freed.
+ * For lazy entries the memory is allocated by us, and the proxy is created only
+ * when the entry is first pushed on the Lua stack. It is kept in a weak table so
+ * that it is garbage collected as soon as Lua drops it, and created again on the
+ * next push, while the entry stays alive until explicitly freed.
+ */
+
+typedef struct {
+    void *mem; /* NULL if the entry was freed */
+    int lazy;
+} proxy_t;
+
+#define PROXY_SIZE ((sizeof(proxy_t) + 15) & ~((size_t)15)) /* keeps mem aligned */
+#define PROXIES "moonode_proxies" /* registry field for the weak table of lazy proxies */
+
+static void PushProxies(lua_State *L)
+/* Pushes the weak table of the lazy proxies, creating it if needed */
+    {
+    if(luaL_getsubtable(L, LUA_REGISTRYINDEX, PROXIES))
+        return;
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    }
+
+static int PushLazyProxy(lua_State *L, udata_t *udata)
+    {
+    proxy_t *proxy;
+    PushProxies(L);
+    if(lua_rawgetp(L, -1, udata->mem) == LUA_TUSERDATA)
+        { lua_remove(L, -2); return 1; }
+    lua_pop(L, 1);
+    proxy = (proxy_t*)lua_newuserdata(L, sizeof(proxy_t));
+    proxy->mem = udata->mem;
+    proxy->lazy = 1;
+    luaL_getmetatable(L, udata->mt);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, -3, udata->mem);
+    lua_remove(L, -2);
+    return 1;
+    }
+
+static void DetachLazyProxy(lua_State *L, udata_t *udata)
+/* Detaches the current proxy (if any) from the memory of a lazy entry being freed */
+    {
+    proxy_t *proxy;
+    PushProxies(L);
+    if(lua_rawgetp(L, -1, udata->mem) == LUA_TUSERDATA)
+        {
+        proxy = (proxy_t*)lua_touserdata(L, -1);
+        proxy->mem = NULL;
+        lua_pushnil(L);
+        lua_rawsetp(L, -3, udata->mem);
+        }
+    lua_pop(L, 2);
+    }
+
+static int GcProxy(lua_State *L)
+/* __gc metamethod wrapper: lazy proxies are just released, since the
+ * entry they refer to outlives them */
+    {
+    proxy_t *proxy = (proxy_t*)lua_touserdata(L, 1);
+    if(proxy && proxy->lazy) return 0;
+    lua_pushvalue(L, lua_upvalueindex(1)); /* the original __gc */
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Node pool                                                                    |
+ *------------------------------------------------------------------------------*/
+
+/* The udata_t nodes are carved out of slabs of SLAB_SIZE nodes each, and recycled
+ * through a free list, so that creating/deleting an object does not cost a heap
+ * allocation. Nodes never move, so pointers to them stay valid until released.
+ * Slabs are released only by udata_free_all().
+ */
+
+#define SLAB_SIZE 1024 /* no. of nodes per slab */
+
+typedef struct slab_s {
+    struct slab_s *next;
+    udata_t nodes[SLAB_SIZE];
+} slab_t;
+
+static slab_t *Slabs = NULL;
+static udata_t *FreeNodes = NULL;
+
+static udata_t *NodeAlloc(lua_State *L)
+    {
+    int i;
+    slab_t *slab;
+    udata_t *udata;
+    if(!FreeNodes)
+        {
+        if((slab = (slab_t*)Malloc(L, sizeof(slab_t))) == NULL)
+            { luaL_error(L, "cannot allocate memory"); return NULL; }
+        slab->next = Slabs;
+        Slabs = slab;
+        for(i = SLAB_SIZE - 1; i >= 0; i--)
+            {
+            slab->nodes[i].next = FreeNodes;
+            FreeNodes = &slab->nodes[i];
+            }
+        }
+    udata = FreeNodes;
+    FreeNodes = udata->next;
+    memset(udata, 0, sizeof(udata_t));
+    return udata;
+    }
+
+static void NodeFree(udata_t *udata)
+    {
+    udata->id = 0;
+    udata->mem = NULL;
+    udata->next = FreeNodes;
+    FreeNodes = udata;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Hash table                                                                   |
+ *------------------------------------------------------------------------------*/
+
+/* Open addressing with linear probing, keyed by the object id.
+ * The slot caches the mem pointer so that udata_mem() (i.e. the handle-to-userdata
+ * lookup done for every object passed to or returned from C) touches a single line.
+ * Deleted slots are marked with TOMBSTONE (id=0, which is never a valid id).
+ */
+
+typedef struct {
+    uint64_t id;
+    void *mem;
+    udata_t *udata; /* NULL = free slot, TOMBSTONE = deleted slot */
+} slot_t;
+
+static udata_t Tombstone;
+#define TOMBSTONE (&Tombstone)
+
+#define MIN_BITS 8  /* initial size = 2^MIN_BITS slots */
+
+static slot_t *Table = NULL;
+static size_t Size = 0;    /* no. of slots (a power of 2) */
+static unsigned int Bits = 0; /* Size = 2^Bits */
+static size_t Count = 0;   /* no. of live entries */
+static size_t Used = 0;    /* no. of non-free slots (live entries + tombstones) */
+
+#define Hash(id) ((size_t)(((uint64_t)(id) * 0x9E3779B97F4A7C15ULL) >> (64 - Bits)))
+#define Next(i) (((i) + 1) & (Size - 1))
+#define Prev(i) (((i) - 1) & (Size - 1))
+
+static slot_t *Find(uint64_t id)
+    {
+    size_t i;
+    slot_t *slot;
+    if(Size == 0 || id == 0) return NULL;
+    i = Hash(id);
+    while(1)
+        {
+        slot = &Table[i];
+        if(slot->id == id) return slot; /* tombstones have id=0, so they never match */
+        if(slot->udata == NULL) return NULL;
+        i = Next(i);
+        }
+    return NULL;
+    }
+
+static void Place(udata_t *udata)
+/* Inserts udata in the table (the id must not be already there, and there must be room) */
+    {
+    size_t i = Hash(udata->id);
+    while(Table[i].udata != NULL && Table[i].udata != TOMBSTONE)
+        i = Next(i);
+    if(Table[i].udata == NULL) Used++;
+    Table[i].id = udata->id;
+    Table[i].mem = udata->mem;
+    Table[i].udata = udata;
+    Count++;
+    }
+
+static void Resize(lua_State *L, unsigned int bits)
+/* Reallocates the table with 2^bits slots, and rehashes the live entries (dropping tombstones) */
+    {
+    size_t i, oldsize = Size;
+    slot_t *oldtable = Table;
+    slot_t *table = (slot_t*)Malloc(L, (((size_t)1) << bits)*sizeof(slot_t));
+    if(!table)
+        { luaL_error(L, "cannot allocate memory"); return; }
+    memset(table, 0, (((size_t)1) << bits)*sizeof(slot_t));
+    Table = table;
+    Bits = bits;
+    Size = ((size_t)1) << bits;
+    Count = Used = 0;
+    for(i = 0; i < oldsize; i++)
+        {
+        if(oldtable[i].udata != NULL && oldtable[i].udata != TOMBSTONE)
+            Place(oldtable[i].udata);
+        }
+    if(oldtable) Free(L, oldtable);
+    }
+
+static void Reserve(lua_State *L)
+/* Makes room for one more entry, keeping the load factor (tombstones included) <= 1/2 */
+    {
+    if(Size == 0)
+        Resize(L, MIN_BITS);
+    else if((Used + 1)*2 > Size)
+        /* grow if mostly live entries, otherwise just rehash to get rid of tombstones */
+        Resize(L, (Count + 1)*4 > Size ? Bits + 1 : Bits);
+    }
+
+static void Remove(slot_t *slot)
+    {
+    size_t i = slot - Table;
+    slot->id = 0;
+    slot->mem = NULL;
+    slot->udata = TOMBSTONE;
+    Count--;
+    /* If the next slot is free, no probe sequence passes through this one, nor
+     * through the tombstones immediately preceding it: free them all. */
+    if(Table[Next(i)].udata == NULL)
+        {
+        while(Table[i].udata == TOMBSTONE)
+            {
+            Table[i].udata = NULL;
+            Used--;
+            i = Prev(i);
+            }
+        }
+    }
+
+/*------------------------------------------------------------------------------*
+ | Class registry                                                               |
+ *------------------------------------------------------------------------------*/
+
+/* Objects with a metatable are also linked in an intrusive list per metatable,
+ * so that udata_scan() visits only the objects of the requested class.
+ *
+ * A scan callback may delete any object, including the current one and the next
+ * one in the list. To keep the scan safe, while a class is being scanned
+ * (scanning > 0) its deleted nodes are only marked as dead and left in the list.
+ * They are unlinked and recycled when the outermost scan terminates.
+ */
+
+typedef struct class_s {
+    struct class_s *next; /* next in Classes */
+    const char *mt;
+    udata_t *head, *tail;
+    int scanning; /* nesting level of ongoing scans on this class */
+    int dead;     /* no. of dead nodes in the list */
+} class_t;
+
+static class_t *Classes = NULL;
+
+static class_t *GetClass(lua_State *L, const char *mt)
+/* Returns the class for mt, creating it if needed (if L != NULL) */
+    {
+    class_t *class;
+    for(class = Classes; class != NULL; class = class->next)
+        if(class->mt == mt) return class;
+    /* metatable names are literals and normally share the same pointer,
+     * but the compiler is not obliged to merge them */
+    for(class = Classes; class != NULL; class = class->next)
+        if(strcmp(class->mt, mt) == 0) return class;
+    if(!L) return NULL;
+    if((class = (class_t*)Malloc(L, sizeof(class_t))) == NULL)
+        { luaL_error(L, "cannot allocate memory"); return NULL; }
+    memset(class, 0, sizeof(class_t));
+    class->mt = mt;
+    class->next = Classes;
+    Classes = class;
+    return class;
+    }
+
+static void Link(class_t *class, udata_t *udata)
+/* Appends udata to the class list */
+    {
+    udata->class = class;
+    udata->cnext = NULL;
+    udata->cprev = class->tail;
+    if(class->tail) class->tail->cnext = udata;
+    else class->head = udata;
+    class->tail = udata;
+    }
+
+static void Unlink(udata_t *udata)
+    {
+    class_t *class = udata->class;
+    if(udata->cprev) udata->cprev->cnext = udata->cnext;
+    else class->head = udata->cnext;
+    if(udata->cnext) udata->cnext->cprev = udata->cprev;
+    else class->tail = udata->cprev;
+    udata->class = NULL;
+    udata->cprev = udata->cnext = NULL;
+    }
+
+static void Sweep(class_t *class)
+/* Unlinks and recycles the dead nodes of class */
+    {
+    udata_t *udata, *next;
+    for(udata = class->head; udata != NULL && class->dead > 0; udata = next)
+        {
+        next = udata->cnext;
+        if(udata->dead)
+            {
+            Unlink(udata);
+            NodeFree(udata);
+            class->dead--;
+            }
+        }
+    }
+
+static udata_t *udata_search(uint64_t id)
+    {
+    slot_t *slot = Find(id);
+    return slot ? slot->udata : NULL;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Object database                                                              |
+ *------------------------------------------------------------------------------*/
 
 void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
 /* Creates a new Lua userdata, optionally sets its metatable to mt (if != NULL),
@@ -83,40 +388,79 @@ void *udata_new(lua_State *L, size_t size, uint64_t id_, const char *mt)
  */
     {
     udata_t *udata;
-    if((udata = (udata_t*)Malloc(L, sizeof(udata_t))) == NULL) 
-        { luaL_error(L, "cannot allocate memory"); return NULL; }
-    memset(udata, 0, sizeof(udata_t));
-    udata->mem = lua_newuserdata(L, size);
-    if(!udata->mem)
-        {
-        Free(L, udata);
-        luaL_error(L, "lua_newuserdata error"); 
-        return NULL;
-        }
-    udata->id = id_ != 0 ? id_ : (uint64_t)(uintptr_t)(udata->mem);
-    if(udata_search(udata->id))
-        { 
-        Free(L, udata);
-        luaL_error(L, "duplicated object %p", id_); 
-        return NULL; 
-        }
+    class_t *class;
+    uint64_t id;
+    void *mem;
+    proxy_t *proxy = (proxy_t*)lua_newuserdata(L, PROXY_SIZE + size);
+    if(!proxy)
+        { luaL_error(L, "lua_newuserdata error"); return NULL; }
+    mem = (char*)proxy + PROXY_SIZE;
+    proxy->mem = mem;
+    proxy->lazy = 0;
+    id = id_ != 0 ? id_ : (uint64_t)(uintptr_t)mem;
+    if(Find(id))
+        { luaL_error(L, "duplicated object %p", id_); return NULL; }
+    /* allocate everything that may fail before taking the reference */
+    Reserve(L);
+    class = mt ? GetClass(L, mt) : NULL;
+    udata = NodeAlloc(L);
+    udata->id = id;
+    udata->mem = mem;
     /* create a reference for later push's */
     lua_pushvalue(L, -1); /* the newly created userdata */
     udata->ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    udata_insert(udata);
+    Place(udata);
     if(mt)
         {
         udata->mt = mt;
+        Link(class, udata);
         luaL_getmetatable(L, mt);
         lua_setmetatable(L, -2);
         }
     return udata->mem;
     }
 
+void *udata_new_lazy(lua_State *L, size_t size, uint64_t id, const char *mt)
+/* Same as udata_new(), but creates a handle-only entry with no Lua userdata bound
+ * to it (nothing is pushed on the stack). The memory area (zeroed) is allocated here
+ * and released by udata_free(). A Lua proxy for the entry is created on demand by
+ * udata_push(), and it is garbage collected when Lua no longer references it:
+ * this does not affect the entry, which must be explicitly freed.
+ *
+ * id must be != 0, and mt must be != NULL.
+ */
+    {
+    udata_t *udata;
+    class_t *class;
+    void *mem;
+    if(id == 0 || mt == NULL)
+        { luaL_error(L, UNEXPECTED_ERROR); return NULL; }
+    if(Find(id))
+        { luaL_error(L, "duplicated object %p", id); return NULL; }
+    Reserve(L);
+    class = GetClass(L, mt);
+    udata = NodeAlloc(L);
+    if((mem = Malloc(L, size)) == NULL)
+        {
+        NodeFree(udata);
+        luaL_error(L, "cannot allocate memory");
+        return NULL;
+        }
+    memset(mem, 0, size);
+    udata->id = id;
+    udata->mem = mem;
+    udata->ref = LUA_NOREF;
+    udata->lazy = 1;
+    udata->mt = mt;
+    Link(class, udata);
+    Place(udata);
+    return mem;
+    }
+
 void *udata_mem(uint64_t id)
     {
-    udata_t *udata = udata_search(id);
-    return udata ? udata->mem : NULL;
+    slot_t *slot = Find(id);
+    return slot ? slot->mem : NULL;
     }
 
 int udata_unref(lua_State *L, uint64_t id)
@@ -138,16 +482,29 @@ int udata_free(lua_State *L, uint64_t id)
 /* this should be called in the __gc metamethod
  */
     {
-    udata_t *udata = udata_search(id);
+    udata_t *udata;
+    slot_t *slot = Find(id);
 //  printf("free object %lu\n", id);
-    if(!udata) 
+    if(!slot) 
         return luaL_error(L, "invalid object identifier %p", id);
+    udata = slot->udata;
     /* release all references */
     if(udata->ref != LUA_NOREF)
         luaL_unref(L, LUA_REGISTRYINDEX, udata->ref);
-    udata_remove(udata);
-    Free(L, udata);
-    /* mem is released by Lua at garbage collection */
+    if(udata->lazy)
+        {
+        DetachLazyProxy(L, udata);
+        Free(L, udata->mem);
+        udata->mem = NULL;
+        }
+    Remove(slot);
+    if(!udata->class)
+        NodeFree(udata);
+    else if(udata->class->scanning)
+        { udata->dead = 1; udata->class->dead++; } /* see Sweep() */
+    else
+        { Unlink(udata); NodeFree(udata); }
+    /* mem is released by Lua at garbage collection (if not lazy) */
     return 0;
     }
 
@@ -157,6 +514,8 @@ int udata_push(lua_State *L, uint64_t id)
     udata_t *udata = udata_search(id);
     if(!udata) 
         return luaL_error(L, "invalid object identifier %p", id);
+    if(udata->lazy)
+        return PushLazyProxy(L, udata);
     if(udata->ref == LUA_NOREF)
         return luaL_error(L, "unreferenced object");
     if(lua_rawgeti(L, LUA_REGISTRYINDEX, udata->ref) != LUA_TUSERDATA)
@@ -166,13 +525,53 @@ int udata_push(lua_State *L, uint64_t id)
 
 void udata_free_all(lua_State *L)
 /* free all without unreferencing (for atexit()) */
+    {
+    size_t i;
+    slab_t *slab;
+    class_t *class;
+    for(i = 0; i < Size; i++)
+        {
+        if(Table[i].udata != NULL && Table[i].udata != TOMBSTONE && Table[i].udata->lazy)
+            Free(L, Table[i].mem);
+        }
+    while((class = Classes))
+        {
+        Classes = class->next;
+        Free(L, class);
+        }
+    while((slab = Slabs))
+        {
+        Slabs = slab->next;
+        Free(L, slab);
+        }
+    FreeNodes = NULL;
+    if(Table) Free(L, Table);
+    Table = NULL;
+    Size = Count = Used = 0;
+    Bits = 0;
+    }
+
+typedef struct {
+    class_t *class;
+    const char *mt;
+    void *info;
+    int (*func)(lua_State *L, const void *mem, const char* mt, const void *info);
+    int stop;
+} scan_t;
+
+static int Scan(lua_State *L)
+/* Scan loop for udata_scan, executed in protected mode */
     {
     udata_t *udata;
-    while((udata = udata_first(0)))
+    scan_t *scan = (scan_t*)lua_touserdata(L, 1);
+    /* objects created by func are appended, and visited too */
+    for(udata = scan->class->head; udata != NULL; udata = udata->cnext)
         {
-        udata_remove(udata);
-        Free(L, udata);
+        if(udata->dead) continue;
+        if((scan->stop = scan->func(L, (const void*)(udata->mem), scan->mt, scan->info)) != 0)
+            break;
         }
+    return 0;
     }
 
 int udata_scan(lua_State *L, const char *mt,  
@@ -183,19 +582,25 @@ int udata_scan(lua_State *L, const char *mt,
  * returns 1 if interrupted, 0 otherwise
  */
     {
-    int stop = 0;
-    uint64_t id = 0;
-    udata_t *udata;
-    while((udata = udata_first(id)))
-        {
-        id = udata->id + 1;
-        if(mt == udata->mt)
-            {
-            stop = func(L, (const void*)(udata->mem), mt, info);
-            if(stop) return 1;
-            }
-        }
-    return 0;
+    int err;
+    scan_t scan;
+    class_t *class = GetClass(NULL, mt);
+    if(!class) return 0; /* no object of this class was ever created */
+    scan.class = class;
+    scan.mt = mt;
+    scan.info = info;
+    scan.func = func;
+    scan.stop = 0;
+    /* func may raise an error, so the scan is run in protected mode to end it
+     * properly before propagating the error */
+    class->scanning++;
+    lua_pushcfunction(L, Scan);
+    lua_pushlightuserdata(L, &scan);
+    err = lua_pcall(L, 1, 0, 0);
+    if(--class->scanning == 0 && class->dead > 0)
+        Sweep(class);
+    if(err != LUA_OK) return lua_error(L);
+    return scan.stop ? 1 : 0;
     }
 
 
@@ -219,12 +624,12 @@ void *udata_test(lua_State *L, int arg, const char *mt)
  * mt as metatable but as ancestor
  */ 
     {
-    void *mem;
+    proxy_t *proxy;
     int ok;
-    if((mem = luaL_testudata(L, arg, mt)))
-        return mem;
+    if((proxy = (proxy_t*)luaL_testudata(L, arg, mt)))
+        return proxy->mem;
     
-    if((mem = lua_touserdata(L, arg)) == NULL)
+    if((proxy = (proxy_t*)lua_touserdata(L, arg)) == NULL)
         return NULL;
 
     if(luaL_getmetatable(L, mt)!=LUA_TTABLE)
@@ -232,7 +637,7 @@ void *udata_test(lua_State *L, int arg, const char *mt)
     ok = is_subclass(L, arg, lua_gettop(L));
 
     lua_pop(L, 1);
-    return ok ? mem : NULL;
+    return ok ? proxy->mem : NULL;
     }
 
 /*------------------------------------------------------------------------------*
@@ -247,8 +652,18 @@ int udata_define(lua_State *L, const char* mt, const luaL_Reg* methods, const lu
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
     if(metamethods)
+        {
         /* add metamethods */
         luaL_setfuncs(L, metamethods, 0);
+        /* wrap __gc so that it is not propagated from lazy proxies */
+        if(lua_getfield(L, -1, "__gc") == LUA_TFUNCTION)
+            {
+            lua_pushcclosure(L, GcProxy, 1);
+            lua_setfield(L, -2, "__gc");
+            }
+        else
+            lua_pop(L, 1);
+        }
     if(methods)
         {
         /* add methods */
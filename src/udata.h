@@ -46,6 +46,8 @@ void Free(lua_State *L, void *ptr);
 
 #define udata_new moonode_udata_new
 void *udata_new(lua_State*, size_t, uint64_t, const char*);
+#define udata_new_lazy moonode_udata_new_lazy
+void *udata_new_lazy(lua_State*, size_t, uint64_t, const char*);
 #define udata_unref moonode_udata_unref
 int udata_unref(lua_State *L, uint64_t);
 #define udata_free moonode_udata_free
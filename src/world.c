@@ -196,7 +196,9 @@ static int Step(lua_State *L)
     {
     world_t world = checkworld(L, 1, NULL);
     double stepsize = luaL_checknumber(L, 2);
-    int rc = dWorldStep(world, stepsize);
+    int rc;
+    trimeshsavetransforms(L, world);
+    rc = dWorldStep(world, stepsize);
     if(!rc) return failure(L, ERR_OPERATION);
     return 0;
     }
@@ -205,7 +207,9 @@ static int QuickStep(lua_State *L) /* wolf pack ;-) */
     {
     world_t world = checkworld(L, 1, NULL);
     double stepsize = luaL_checknumber(L, 2);
-    int rc = dWorldQuickStep(world, stepsize);
+    int rc;
+    trimeshsavetransforms(L, world);
+    rc = dWorldQuickStep(world, stepsize);
     if(!rc) return failure(L, ERR_OPERATION);
     return 0;
     }